@@ -0,0 +1,51 @@
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rayson.hpp"
+
+const int EXIT_CODE_SUCCESS = 0,
+          EXIT_CODE_BAD_USAGE = -1,
+          EXIT_CODE_RUNTIME_ERROR = 1;
+
+void print_usage() noexcept {
+  std::cout << "usage:" << std::endl
+            << std::endl
+            << "  rayson-embed <JSON-PATH> <NAME>    print a C++ header that defines rayson file <JSON-PATH>" << std::endl
+            << "                                     as a constexpr rayson::embedded_scene, <NAME>::scene" << std::endl
+            << "  rayson-embed -h|--help             print this usage information" << std::endl
+            << std::endl;
+}
+
+int main(int argc, const char** argv) {
+
+  std::vector<std::string> arguments(argv + 1, argv + argc);
+
+  if ((arguments.size() == 1) && ((arguments[0] == "-h") || (arguments[0] == "--help"))) {
+    print_usage();
+    return EXIT_CODE_SUCCESS;
+  }
+
+  if (arguments.size() != 2) {
+    print_usage();
+    return EXIT_CODE_BAD_USAGE;
+  }
+
+  const auto& path = arguments[0];
+  const auto& name = arguments[1];
+  try {
+
+    auto scene = rayson::read_file(path);
+    rayson::write_embedded(scene, name, std::cout);
+
+  } catch (rayson::read_exception e) {
+    std::cerr << "rayson-embed: " << e.message() << std::endl;
+    return EXIT_CODE_RUNTIME_ERROR;
+  } catch (rayson::write_exception e) {
+    std::cerr << "rayson-embed: " << e.message() << std::endl;
+    return EXIT_CODE_RUNTIME_ERROR;
+  }
+
+  return EXIT_CODE_SUCCESS;
+}
@@ -14,8 +14,12 @@ const int EXIT_CODE_SUCCESS = 0,
 void print_usage() noexcept {
   std::cout << "usage:" << std::endl
             << std::endl
-            << "  rayson-info <JSON-PATH>    print description of rayson file <JSON-PATH>" << std::endl
-            << "  rayson-info -h|--help      print this usage information" << std::endl
+            << "  rayson-info <JSON-PATH>              print description of rayson file <JSON-PATH>," << std::endl
+            << "                                       or of standard input if <JSON-PATH> is -" << std::endl
+            << "  rayson-info --summary <JSON-PATH>    print description of <JSON-PATH>, counting its" << std::endl
+            << "                                       geometry without loading it; <JSON-PATH> must be" << std::endl
+            << "                                       a file, not -, since it is read twice" << std::endl
+            << "  rayson-info -h|--help                print this usage information" << std::endl
             << std::endl;
 }
 
@@ -31,9 +35,10 @@ std::string color_to_string(const rayson::color& c) noexcept {
   return ss.str();
 }
 
-void print_scene(const std::string& path, const rayson::scene& scene) noexcept {
+const std::string tab = "    ";
 
-  const std::string tab = "    ";
+// Prints everything but the geometry of scene.
+void print_header(const std::string& path, const rayson::scene& scene) noexcept {
 
   auto print_indented = [&](auto& message) {
     std::cout << tab << message << std::endl;
@@ -94,6 +99,17 @@ void print_scene(const std::string& path, const rayson::scene& scene) noexcept {
                 << std::endl;
     }
   }
+}
+
+void print_scene(const std::string& path, const rayson::scene& scene) noexcept {
+
+  auto print_indented = [&](auto& message) {
+    std::cout << tab << message << std::endl;
+  };
+
+  auto print_none = [&]() { print_indented("(none)"); };
+
+  print_header(path, scene);
   std::cout << "spheres:" << std::endl;
   if (scene.spheres().empty()) {
     print_none();
@@ -119,17 +135,28 @@ void print_scene(const std::string& path, const rayson::scene& scene) noexcept {
   }
 }
 
+void print_summary(const rayson::scene_file& file) noexcept {
+  print_header(file.path(), file.header());
+  auto& counts = file.counts();
+  std::cout << "spheres = " << counts.spheres() << std::endl
+            << "triangles = " << counts.triangles() << std::endl
+            << "meshes = " << counts.meshes() << std::endl
+            << "objects = " << counts.objects() << std::endl
+            << "instances = " << counts.instances() << std::endl;
+}
+
 int main(int argc, const char** argv) {
 
   std::vector<std::string> arguments(argv + 1, argv + argc);
 
-  if (arguments.size() != 1) {
+  bool summary = (arguments.size() == 2) && (arguments[0] == "--summary");
+  if ((arguments.size() != 1) && !summary) {
     print_usage();
     return EXIT_CODE_BAD_USAGE;
   }
 
-  const auto& argument = arguments[0];
-  if ((argument == "-h") || (argument == "--help")) {
+  const auto& argument = arguments.back();
+  if (!summary && ((argument == "-h") || (argument == "--help"))) {
     print_usage();
     return EXIT_SUCCESS;
   }
@@ -137,8 +164,13 @@ int main(int argc, const char** argv) {
   const auto& path = argument;
   try {
 
-    auto scene = rayson::read_file(path);
-    print_scene(path, scene);
+    if (summary) {
+      rayson::scene_file file(path);
+      print_summary(file);
+    } else {
+      auto scene = rayson::read_file(path);
+      print_scene(path, scene);
+    }
 
   } catch (rayson::read_exception e) {
     std::cerr << "rayson-info: " << e.message() << std::endl;
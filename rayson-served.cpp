@@ -0,0 +1,276 @@
+
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "rayson.hpp"
+
+const int EXIT_CODE_SUCCESS = 0,
+          EXIT_CODE_BAD_USAGE = -1,
+          EXIT_CODE_RUNTIME_ERROR = 1;
+
+void print_usage() noexcept {
+  std::cout << "usage:" << std::endl
+            << std::endl
+            << "  rayson-served <SOCKET-PATH> [OPTIONS]    serve render requests on UNIX socket <SOCKET-PATH>" << std::endl
+            << "  rayson-served -h|--help                  print this usage information" << std::endl
+            << std::endl
+            << "options:" << std::endl
+            << std::endl
+            << "  --cache N              keep up to N parsed scenes (default 16)" << std::endl
+            << "  --clients N            serve up to N clients at once; others wait (default 64)" << std::endl
+            << "  --max-request BYTES    reject request lines longer than BYTES and disconnect (default 64 MiB)" << std::endl
+            << std::endl
+            << "Each request is one line of JSON:" << std::endl
+            << std::endl
+            << "  {\"path\": <JSON-PATH> | \"scene\": <SCENE>, \"output\": <IMAGE-PATH>," << std::endl
+            << "   \"format\": \"ppm\"|\"pfm\"|\"png\", \"camera\": {\"eye\": .., \"up\": .., \"view\": ..}}" << std::endl
+            << std::endl
+            << "where format defaults to ppm and camera, which overrides the scene's camera, is optional." << std::endl
+            << "Each reply is one line of JSON: {\"ok\": true, \"cached\": <BOOL>} or {\"ok\": false, \"error\": <MESSAGE>}." << std::endl
+            << std::endl;
+}
+
+rayson::vector3 parse_vector3(const nlohmann::json& j) {
+  return rayson::vector3(j.at(0).get<double>(), j.at(1).get<double>(), j.at(2).get<double>());
+}
+
+rayson::image_format parse_format(const std::string& name) {
+  if (name == "ppm") {
+    return rayson::image_format::ppm;
+  } else if (name == "pfm") {
+    return rayson::image_format::pfm;
+  } else if (name == "png") {
+    return rayson::image_format::png;
+  }
+  throw rayson::write_exception("unknown image format \"" + name + "\"");
+}
+
+// Handles one request line, returning the reply line. Renders run as jobs
+// on pool, which all clients share.
+std::string serve(rayson::scene_cache& cache, rayson::worker_pool& pool, const std::string& line) {
+  nlohmann::json reply;
+  try {
+    auto request = nlohmann::json::parse(line);
+
+    auto entry = request.contains("path")
+                 ? cache.load_file(request.at("path").get<std::string>())
+                 : cache.load_text(request.at("scene").dump());
+    auto output = request.at("output").get<std::string>();
+    auto format = parse_format(request.value("format", std::string("ppm")));
+
+    auto view = entry.scene();
+    if (request.contains("camera")) {
+      // rendered with the bvh cached for the scene, so its geometry is
+      // neither copied nor rebuilt
+      auto& c = request.at("camera");
+      view = std::make_shared<const rayson::scene>(
+        rayson::view_from(*entry.scene(),
+                          rayson::camera(parse_vector3(c.at("eye")),
+                                         parse_vector3(c.at("up")),
+                                         parse_vector3(c.at("view")))));
+    }
+    auto image = rayson::render_job(pool, view, entry.tree()).future().get();
+
+    std::ofstream f(output, std::ios::binary);
+    if (!f) {
+      throw rayson::write_exception("could not open \"" + output + "\"");
+    }
+    rayson::write_image(image, f, format);
+
+    reply["ok"] = true;
+    reply["cached"] = entry.hit();
+  } catch (rayson::read_exception& e) {
+    reply["ok"] = false;
+    reply["error"] = e.message();
+  } catch (rayson::write_exception& e) {
+    reply["ok"] = false;
+    reply["error"] = e.message();
+  } catch (rayson::render_exception& e) {
+    reply["ok"] = false;
+    reply["error"] = e.message();
+  } catch (nlohmann::json::exception& e) {
+    reply["ok"] = false;
+    reply["error"] = std::string("bad request: ") + e.what();
+  } catch (std::exception& e) {
+    // anything else, such as std::bad_alloc, fails only this request
+    reply["ok"] = false;
+    reply["error"] = e.what();
+  }
+  return reply.dump() + "\n";
+}
+
+// Writes all of reply to client, returning false if the client is gone.
+bool send_reply(int client, const std::string& reply) {
+  for (size_t sent = 0; sent < reply.size(); ) {
+    auto n = write(client, reply.data() + sent, reply.size() - sent);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// Serves requests from one client until it disconnects or sends a line
+// longer than max_request bytes.
+void serve_client(rayson::scene_cache& cache, rayson::worker_pool& pool, size_t max_request, int client) {
+  std::string pending;
+  char buffer[4096];
+  for (;;) {
+    auto count = read(client, buffer, sizeof(buffer));
+    if (count <= 0) {
+      break;
+    }
+    pending.append(buffer, count);
+    auto newline = pending.find('\n');
+    for (; (newline != std::string::npos) && (newline <= max_request); newline = pending.find('\n')) {
+      auto reply = serve(cache, pool, pending.substr(0, newline));
+      pending.erase(0, newline + 1);
+      if (!send_reply(client, reply)) {
+        close(client);
+        return;
+      }
+    }
+    if ((newline != std::string::npos) || (pending.size() > max_request)) {
+      // the rest of the line cannot be skipped reliably, so the client is
+      // dropped
+      nlohmann::json reply;
+      reply["ok"] = false;
+      reply["error"] = "request longer than " + std::to_string(max_request) + " bytes";
+      send_reply(client, reply.dump() + "\n");
+      break;
+    }
+  }
+  close(client);
+}
+
+// A count of clients that may still be served at once.
+class client_slots {
+private:
+  std::mutex mutex_;
+  std::condition_variable released_;
+  size_t available_;
+
+public:
+
+  explicit client_slots(size_t count)
+  : available_(count) { }
+
+  // Waits for a free slot and takes it.
+  void acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_.wait(lock, [this]() { return available_ > 0; });
+    --available_;
+  }
+
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++available_;
+    }
+    released_.notify_one();
+  }
+};
+
+int main(int argc, const char** argv) {
+
+  std::vector<std::string> arguments(argv + 1, argv + argc);
+
+  if ((arguments.size() == 1) && ((arguments[0] == "-h") || (arguments[0] == "--help"))) {
+    print_usage();
+    return EXIT_CODE_SUCCESS;
+  }
+
+  size_t capacity = 16, clients = 64, max_request = size_t(64) << 20;
+  if ((arguments.size() % 2) != 1) {
+    print_usage();
+    return EXIT_CODE_BAD_USAGE;
+  }
+  for (size_t i = 1; i < arguments.size(); i += 2) {
+    auto value = std::strtoull(arguments[i + 1].c_str(), nullptr, 10);
+    if (arguments[i] == "--cache") {
+      capacity = value;
+    } else if (arguments[i] == "--clients") {
+      clients = value;
+    } else if (arguments[i] == "--max-request") {
+      max_request = value;
+    } else {
+      value = 0;
+    }
+    if (value == 0) {
+      print_usage();
+      return EXIT_CODE_BAD_USAGE;
+    }
+  }
+
+  const auto& socket_path = arguments[0];
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "rayson-served: socket path too long" << std::endl;
+    return EXIT_CODE_RUNTIME_ERROR;
+  }
+  socket_path.copy(address.sun_path, socket_path.size());
+
+  // a client that disconnects before its reply must not kill the server
+  std::signal(SIGPIPE, SIG_IGN);
+
+  // replace a socket left behind by an earlier server, but nothing else
+  struct stat existing;
+  if (lstat(socket_path.c_str(), &existing) == 0) {
+    if (!S_ISSOCK(existing.st_mode)) {
+      std::cerr << "rayson-served: \"" << socket_path << "\" exists and is not a socket" << std::endl;
+      return EXIT_CODE_RUNTIME_ERROR;
+    }
+    unlink(socket_path.c_str());
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ((listener < 0) ||
+      (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) ||
+      (listen(listener, SOMAXCONN) != 0)) {
+    std::cerr << "rayson-served: could not listen on \"" << socket_path << "\"" << std::endl;
+    return EXIT_CODE_RUNTIME_ERROR;
+  }
+
+  // Up to clients clients are served concurrently, each on its own
+  // thread, and share the cache; further connections wait in the listen
+  // backlog. Their renders share one worker pool, tile by tile, so
+  // concurrent requests never use more threads than the machine has.
+  rayson::scene_cache cache(capacity);
+  rayson::worker_pool pool;
+  client_slots slots(clients);
+  for (;;) {
+    slots.acquire();
+    int client = accept(listener, nullptr, nullptr);
+    if (client < 0) {
+      slots.release();
+      continue;
+    }
+    try {
+      std::thread([&cache, &pool, &slots, max_request, client]() {
+        serve_client(cache, pool, max_request, client);
+        slots.release();
+      }).detach();
+    } catch (std::system_error&) {
+      close(client);
+      slots.release();
+    }
+  }
+
+  return EXIT_CODE_SUCCESS;
+}
@@ -6,9 +6,15 @@
 //
 ///////////////////////////////////////////////////////////////////////////////
 
+#include <cstring>
+#include <sstream>
+
 #include "gtest/gtest.h"
 
 #include "rayson.hpp"
+// generated by rayson-embed
+#include "scene_2spheres_ortho_flat.hpp"
+#include "scene_gtri_persp_phong.hpp"
 
 TEST(vector3, ConstructorSettersAndGetters) {
 
@@ -1163,3 +1169,2004 @@ TEST(read_file, SampleFiles) {
     EXPECT_EQ(1, scene.triangles().size());
   }
 }
+
+TEST(read_file, Options) {
+  auto full = rayson::read_file("teatime.json");
+
+  auto header = rayson::read_file("teatime.json", rayson::read_options().skip_geometry());
+  EXPECT_EQ(full.camera(), header.camera());
+  EXPECT_EQ(full.materials().size(), header.materials().size());
+  EXPECT_EQ(full.point_lights().size(), header.point_lights().size());
+  EXPECT_TRUE(header.spheres().empty());
+  EXPECT_TRUE(header.triangles().empty());
+
+  // keeps exactly the primitives overlapping the region, here the lower
+  // half of the teapot
+  rayson::aabb teapot;
+  for (auto& tri : full.triangles()) {
+    teapot = teapot.merged(rayson::bounds(tri));
+  }
+  rayson::aabb region(teapot.min(), rayson::vector3(teapot.max().x(), teapot.centroid().y(), teapot.max().z()));
+  auto clipped = rayson::read_file("teatime.json", rayson::read_options().only_within(region));
+  size_t spheres = 0, triangles = 0;
+  for (auto& sph : full.spheres()) {
+    spheres += rayson::bounds(sph).overlaps(region);
+  }
+  for (auto& tri : full.triangles()) {
+    triangles += rayson::bounds(tri).overlaps(region);
+  }
+  EXPECT_EQ(spheres, clipped.spheres().size());
+  EXPECT_EQ(triangles, clipped.triangles().size());
+  EXPECT_LT(0, clipped.triangles().size());
+  EXPECT_GT(full.triangles().size(), clipped.triangles().size());
+  for (auto& tri : clipped.triangles()) {
+    EXPECT_TRUE(rayson::bounds(tri).overlaps(region));
+  }
+
+  // counts the geometry up front, and loads it on first use
+  rayson::scene_file file("teatime.json");
+  EXPECT_EQ("teatime.json", file.path());
+  EXPECT_EQ(full.spheres().size(), file.counts().spheres());
+  EXPECT_EQ(full.triangles().size(), file.counts().triangles());
+  EXPECT_EQ(0, file.counts().instances());
+  EXPECT_TRUE(file.header().triangles().empty());
+  EXPECT_EQ(full.background(), file.header().background());
+  EXPECT_EQ(full.triangles().size(), file.scene().triangles().size());
+  EXPECT_EQ(&file.scene(), &file.scene());
+  EXPECT_THROW(rayson::scene_file("no-such-file.json"), rayson::read_exception);
+
+  // instances are kept when their world-space bounds overlap the region
+  auto j = nlohmann::json::parse(R"({
+    "camera_eye" : [0, 0, -5], "camera_up" : [0, 1, 0], "camera_view" : [0, 0, 1],
+    "x_resolution" : 8, "y_resolution" : 8,
+    "viewport_left" : -1.0, "viewport_top" : 1.0, "viewport_right" : 1.0, "viewport_bottom" : -1.0,
+    "background" : [0.0, 0.0, 0.0], "ortho_projection" : true, "flat_shader" : true,
+    "materials" : [ { "name" : "red", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 } ],
+    "objects" : [
+      { "name" : "ball", "spheres" : [ { "material" : "red", "center" : [0.0, 0.0, 0.0], "radius" : 0.5 } ] }
+    ],
+    "instances" : [
+      { "object" : "ball" },
+      { "object" : "ball", "transform" : [[1, 0, 0, 5], [0, 1, 0, 0], [0, 0, 1, 0]] }
+    ]
+  })");
+  rayson::aabb unit(rayson::vector3(-1, -1, -1), rayson::vector3(1, 1, 1));
+  auto s = rayson::read_json(j, "", rayson::read_options().only_within(unit));
+  ASSERT_EQ(1, s.objects().size());
+  ASSERT_EQ(1, s.instances().size());
+  EXPECT_EQ(rayson::transform(), s.instances()[0].to_world());
+  EXPECT_TRUE(rayson::read_json(j, "", rayson::read_options().skip_geometry()).objects().empty());
+}
+
+TEST(read_stream, Stream) {
+  std::ifstream f("teatime.json");
+  std::stringstream text;
+  text << f.rdbuf();
+  auto s = rayson::read_stream(text);
+  EXPECT_EQ(rayson::hash(rayson::read_file("teatime.json")).value(), rayson::hash(s).value());
+
+  text.clear();
+  text.seekg(0);
+  auto header = rayson::read_stream(text, "", rayson::read_options().skip_geometry());
+  EXPECT_TRUE(header.triangles().empty());
+  EXPECT_EQ(s.materials(), header.materials());
+
+  std::istringstream truncated(text.str().substr(0, text.str().size() / 2));
+  EXPECT_THROW(rayson::read_stream(truncated), rayson::read_exception);
+  EXPECT_THROW(rayson::scene_file("-"), rayson::read_exception);
+}
+
+TEST(vector3, Arithmetic) {
+  rayson::vector3 a(1, 2, 3), b(4, 5, 6);
+
+  EXPECT_EQ(rayson::vector3(5, 7, 9), a + b);
+  EXPECT_EQ(rayson::vector3(-3, -3, -3), a - b);
+  EXPECT_EQ(rayson::vector3(-1, -2, -3), -a);
+  EXPECT_EQ(rayson::vector3(2, 4, 6), a * 2);
+  EXPECT_DOUBLE_EQ(1, a[0]);
+  EXPECT_DOUBLE_EQ(2, a[1]);
+  EXPECT_DOUBLE_EQ(3, a[2]);
+  EXPECT_DOUBLE_EQ(32, a.dot(b));
+  EXPECT_EQ(rayson::vector3(-3, 6, -3), a.cross(b));
+  EXPECT_DOUBLE_EQ(5, rayson::vector3(3, 4, 0).magnitude());
+  EXPECT_TRUE(a.normalized().is_normalized());
+}
+
+TEST(aabb, ConstructorSettersAndGetters) {
+  using rayson::vector3;
+
+  rayson::aabb empty;
+  EXPECT_TRUE(empty.empty());
+  EXPECT_DOUBLE_EQ(0, empty.surface_area());
+
+  auto box = empty.merged(vector3(0, 0, 0)).merged(vector3(1, 2, 3));
+  EXPECT_FALSE(box.empty());
+  EXPECT_EQ(vector3(0, 0, 0), box.min());
+  EXPECT_EQ(vector3(1, 2, 3), box.max());
+  EXPECT_EQ(vector3(.5, 1, 1.5), box.centroid());
+  EXPECT_DOUBLE_EQ(22, box.surface_area());
+  EXPECT_TRUE(box.contains(vector3(.5, .5, .5)));
+  EXPECT_FALSE(box.contains(vector3(-.5, .5, .5)));
+  EXPECT_TRUE(box.overlaps(rayson::aabb(vector3(.5, .5, .5), vector3(4, 4, 4))));
+  EXPECT_FALSE(box.overlaps(rayson::aabb(vector3(2, 2, 4), vector3(4, 4, 4))));
+  EXPECT_EQ(box.min(), box.merged(empty).min());
+  EXPECT_EQ(box.max(), box.merged(empty).max());
+
+  rayson::ray toward(vector3(.5, .5, -1), vector3(0, 0, 1)),
+              away(vector3(.5, .5, -1), vector3(0, 0, -1));
+  EXPECT_TRUE(box.intersects(toward, 0, 10));
+  EXPECT_FALSE(box.intersects(toward, 0, .5));
+  EXPECT_FALSE(box.intersects(away, 0, 10));
+
+  auto mat = rayson::material("paper", 2, rayson::color(1, 1, 1));
+  auto sb = rayson::bounds(rayson::sphere(&mat, vector3(1, 1, 1), 2));
+  EXPECT_EQ(vector3(-1, -1, -1), sb.min());
+  EXPECT_EQ(vector3(3, 3, 3), sb.max());
+  auto tb = rayson::bounds(rayson::triangle(&mat, vector3(0, 5, 0), vector3(1, 0, 0), vector3(0, 0, -1)));
+  EXPECT_EQ(vector3(0, 0, -1), tb.min());
+  EXPECT_EQ(vector3(1, 5, 0), tb.max());
+}
+
+// A scene with a grid of spheres and triangles, for acceleration tests.
+static rayson::scene make_grid_scene(int n) {
+  using rayson::vector3;
+  rayson::scene s(rayson::camera(vector3(0, 0, -10), vector3(0, 1, 0), vector3(0, 0, 1)),
+                  rayson::viewport(32, 32, -1, 1, 1, -1),
+                  rayson::persp_projection(1.0),
+                  rayson::phong_shader(.1, .5, .25, rayson::color(1, 1, 1)),
+                  rayson::color(0, 0, 0));
+  s.emplace_material(rayson::material("a", 4, rayson::color(1, 0, 0)));
+  s.emplace_material(rayson::material("b", 8, rayson::color(0, 1, 0)));
+  s.emplace_point_light(rayson::point_light(vector3(0, 10, -10), rayson::color(1, 1, 1), 1));
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      double x = i - n / 2.0, y = j - n / 2.0;
+      if ((i + j) % 2 == 0) {
+        s.emplace_sphere(rayson::sphere(&s.materials()[0], vector3(x, y, (i * 7 + j) % 5), .4));
+      } else {
+        s.emplace_triangle(rayson::triangle(&s.materials()[1],
+                                            vector3(x - .4, y - .4, j % 3),
+                                            vector3(x + .4, y - .4, j % 3),
+                                            vector3(x, y + .4, i % 3)));
+      }
+    }
+  }
+  return s;
+}
+
+// Closest hit distance by testing every primitive, for checking bvh::intersect.
+static double brute_force_closest(const rayson::scene& s, const rayson::ray& r) {
+  double closest = std::numeric_limits<double>::infinity();
+  rayson::bvh single;
+  for (auto& sph : s.spheres()) {
+    rayson::scene one(rayson::camera(s.camera()), rayson::viewport(s.viewport()),
+                      rayson::projection(s.projection()), rayson::shader(s.shader()), s.background());
+    one.emplace_sphere(rayson::sphere(sph));
+    single.build(one);
+    if (auto h = single.intersect(r)) {
+      closest = std::min(closest, h->t());
+    }
+  }
+  for (auto& tri : s.triangles()) {
+    rayson::scene one(rayson::camera(s.camera()), rayson::viewport(s.viewport()),
+                      rayson::projection(s.projection()), rayson::shader(s.shader()), s.background());
+    one.emplace_triangle(rayson::triangle(tri));
+    single.build(one);
+    if (auto h = single.intersect(r)) {
+      closest = std::min(closest, h->t());
+    }
+  }
+  return closest;
+}
+
+TEST(bvh, Intersect) {
+  using rayson::vector3;
+
+  rayson::bvh empty;
+  EXPECT_FALSE(empty.intersect(rayson::ray(vector3(), vector3(0, 0, 1))).has_value());
+
+  auto s = make_grid_scene(12);
+  rayson::bvh tree(s);
+  EXPECT_EQ(s.spheres().size() + s.triangles().size(), tree.primitive_count());
+  EXPECT_GT(tree.node_count(), 1);
+  EXPECT_DOUBLE_EQ(tree.sah_cost(), tree.built_sah_cost());
+
+  // direct hit on the sphere at grid cell (6, 6), centered at (0, 0, 3)
+  auto h = tree.intersect(rayson::ray(vector3(0, 0, -10), vector3(0, 0, 1)));
+  ASSERT_TRUE(h.has_value());
+  EXPECT_EQ(rayson::primitive_kind::sphere, h->kind());
+  EXPECT_EQ(&s.materials()[0], &s.materials()[h->material_index()]);
+  EXPECT_NEAR(12.6, h->t(), 1e-9);
+  EXPECT_NEAR(-1, h->normal().z(), 1e-9);
+
+  // t_max cuts off the hit
+  EXPECT_FALSE(tree.intersect(rayson::ray(vector3(0, 0, -10), vector3(0, 0, 1)), 0, 12).has_value());
+
+  for (int i = 0; i < 200; ++i) {
+    rayson::ray r(vector3(-8 + (i % 17), -8 + (i % 13), -10),
+                  vector3(.01 * (i % 7), -.01 * (i % 5), 1));
+    auto found = tree.intersect(r);
+    double expected = brute_force_closest(s, r);
+    if (expected == std::numeric_limits<double>::infinity()) {
+      EXPECT_FALSE(found.has_value());
+    } else {
+      ASSERT_TRUE(found.has_value());
+      EXPECT_DOUBLE_EQ(expected, found->t());
+    }
+  }
+}
+
+TEST(bvh, RefitAndUpdate) {
+  using rayson::vector3;
+
+  auto s = make_grid_scene(10);
+  rayson::bvh tree(s);
+  auto nodes = tree.node_count();
+
+  // move every primitive along +x, as in one animation frame
+  for (auto& sph : s.spheres()) {
+    sph.set_center(sph.center() + vector3(.25, 0, 0));
+  }
+  for (auto& tri : s.triangles()) {
+    tri.set_vertices(tri.a() + vector3(.25, 0, 0),
+                     tri.b() + vector3(.25, 0, 0),
+                     tri.c() + vector3(.25, 0, 0));
+  }
+  tree.refit(s);
+  EXPECT_EQ(nodes, tree.node_count());
+  EXPECT_DOUBLE_EQ(-5.4 + .25, tree.bounds().min().x());
+  for (int i = 0; i < 100; ++i) {
+    rayson::ray r(vector3(-6 + (i % 11), -6 + (i % 9), -10), vector3(0, 0, 1));
+    auto found = tree.intersect(r);
+    double expected = brute_force_closest(s, r);
+    if (expected == std::numeric_limits<double>::infinity()) {
+      EXPECT_FALSE(found.has_value());
+    } else {
+      ASSERT_TRUE(found.has_value());
+      EXPECT_DOUBLE_EQ(expected, found->t());
+    }
+  }
+
+  // a small motion keeps the tree
+  EXPECT_FALSE(tree.update(s));
+
+  // scrambling the spheres degrades the SAH cost past the threshold
+  for (size_t i = 0; i < s.spheres().size(); ++i) {
+    auto& sph = s.spheres()[i];
+    sph.set_center(vector3(-sph.center().x() * 3, sph.center().z(), sph.center().y() * 3));
+    sph.set_radius(2.0);
+  }
+  EXPECT_TRUE(tree.update(s));
+  EXPECT_DOUBLE_EQ(tree.sah_cost(), tree.built_sah_cost());
+
+  // changing the primitive count forces a rebuild
+  s.spheres().pop_back();
+  EXPECT_TRUE(tree.update(s));
+  EXPECT_EQ(s.spheres().size() + s.triangles().size(), tree.primitive_count());
+}
+
+TEST(ray_generator, PrimaryRays) {
+  using rayson::vector3;
+
+  auto s = make_grid_scene(2);
+  rayson::ray_generator persp(s);
+
+  // the center of the image looks straight down the view direction
+  auto center = persp(16, 16);
+  EXPECT_EQ(s.camera().eye(), center.origin());
+  EXPECT_NEAR(0, center.direction().x(), 1e-12);
+  EXPECT_NEAR(0, center.direction().y(), 1e-12);
+  EXPECT_NEAR(1, center.direction().z(), 1e-12);
+
+  // pixel (0, 0) is at the top-left, where up is +y and left is +x,
+  // because u = up x w with w = -view
+  auto corner = persp.pixel(0, 0);
+  EXPECT_GT(corner.direction().x(), 0);
+  EXPECT_GT(corner.direction().y(), 0);
+
+  auto tile = persp.tile<8>(4, 6, 4);
+  EXPECT_EQ(persp.pixel(4, 6).direction(), tile[0].direction());
+  EXPECT_EQ(persp.pixel(7, 6).direction(), tile[3].direction());
+  EXPECT_EQ(persp.pixel(4, 7).direction(), tile[4].direction());
+
+  rayson::scene ortho_scene(rayson::camera(s.camera()), rayson::viewport(s.viewport()),
+                            rayson::ortho_projection(), rayson::flat_shader(), s.background());
+  rayson::ray_generator ortho(ortho_scene);
+  auto a = ortho.pixel(0, 0), b = ortho.pixel(31, 31);
+  EXPECT_EQ(a.direction(), b.direction());
+  EXPECT_NE(a.origin(), b.origin());
+  EXPECT_NEAR(0, ortho(16, 16).origin().x(), 1e-12);
+}
+
+TEST(bvh, IntersectPacket) {
+  using rayson::vector3;
+
+  auto s = make_grid_scene(12);
+  rayson::bvh tree(s);
+  rayson::ray_generator eye(s);
+
+  auto expect_same = [&](auto& rays, auto& hits, double t_max) {
+    for (size_t i = 0; i < rays.size(); ++i) {
+      auto single = tree.intersect(rays[i], 0.0, t_max);
+      ASSERT_EQ(single.has_value(), hits[i].has_value());
+      if (single) {
+        EXPECT_EQ(single->t(), hits[i]->t());
+        EXPECT_EQ(single->kind(), hits[i]->kind());
+        EXPECT_EQ(single->index(), hits[i]->index());
+      }
+    }
+  };
+
+  // primary visibility in 4x2 and 4x4 tiles over the whole image
+  for (unsigned y = 0; y < 32; y += 4) {
+    for (unsigned x = 0; x < 32; x += 4) {
+      auto rays8 = eye.tile<8>(x, y, 4);
+      auto hits8 = tree.intersect(rays8);
+      expect_same(rays8, hits8, std::numeric_limits<double>::infinity());
+      auto rays16 = eye.tile<16>(x, y, 4);
+      auto hits16 = tree.intersect(rays16);
+      expect_same(rays16, hits16, std::numeric_limits<double>::infinity());
+    }
+  }
+
+  // shadow rays from a patch of points toward a point light, limited to t < 1
+  vector3 light(0, 10, -10);
+  std::array<rayson::ray, 8> shadows;
+  for (size_t i = 0; i < shadows.size(); ++i) {
+    vector3 p(-2 + .5 * i, -1, -1);
+    shadows[i] = rayson::ray(p, light - p);
+  }
+  auto shadow_hits = tree.intersect(shadows, 1e-9, 1.0);
+  expect_same(shadows, shadow_hits, 1.0);
+
+  // incoherent rays diverge and fall back to single-ray traversal
+  std::array<rayson::ray, 16> scattered;
+  for (size_t i = 0; i < scattered.size(); ++i) {
+    double angle = i * 0.4;
+    scattered[i] = rayson::ray(vector3(0, 0, 1), vector3(std::cos(angle), std::sin(angle), (i % 3) - 1.0));
+  }
+  auto scattered_hits = tree.intersect(scattered);
+  expect_same(scattered, scattered_hits, std::numeric_limits<double>::infinity());
+
+  // axis-parallel rays whose origins lie on the slab planes of
+  // grid-aligned geometry, as orthographic primary rays often do
+  rayson::scene grid(rayson::camera(vector3(0, 0, -5), vector3(0, 1, 0), vector3(0, 0, 1)),
+                     rayson::viewport(8, 8, -1, 1, 1, -1),
+                     rayson::ortho_projection(),
+                     rayson::flat_shader(),
+                     rayson::color(0, 0, 0));
+  grid.emplace_material(rayson::material("a", 4, rayson::color(1, 0, 0)));
+  for (int i = 0; i < 4; ++i) {
+    grid.emplace_triangle(rayson::triangle(&grid.materials()[0],
+                                           vector3(i, 0, 0), vector3(i + 1, 0, 0), vector3(i, 1, 0)));
+  }
+  rayson::bvh grid_tree(grid);
+  std::array<rayson::ray, 8> aligned;
+  for (size_t i = 0; i < aligned.size(); ++i) {
+    aligned[i] = rayson::ray(vector3(i / 2, (i % 2) ? 0.0 : 0.25, -5), vector3(0, 0, 1));
+  }
+  auto aligned_hits = grid_tree.intersect(aligned);
+  for (size_t i = 0; i < aligned.size(); ++i) {
+    auto single = grid_tree.intersect(aligned[i]);
+    ASSERT_EQ(single.has_value(), aligned_hits[i].has_value()) << i;
+    EXPECT_TRUE(single.has_value()) << i;
+  }
+  EXPECT_EQ((std::array<bool, 8>{true, true, true, true, true, true, true, true}), grid_tree.occluded(aligned, 0.0, 10.0));
+
+  rayson::bvh empty;
+  auto none = empty.intersect(scattered);
+  EXPECT_FALSE(none[0].has_value());
+}
+
+TEST(bvh, Occluded) {
+  using rayson::vector3;
+
+  auto s = make_grid_scene(12);
+  rayson::bvh tree(s);
+
+  rayson::bvh empty;
+  EXPECT_FALSE(empty.occluded(rayson::ray(vector3(), vector3(0, 0, 1))));
+
+  // the sphere centered at (0, 0, 3) blocks the segment, but only within reach
+  rayson::ray r(vector3(0, 0, -10), vector3(0, 0, 1));
+  EXPECT_TRUE(tree.occluded(r));
+  EXPECT_FALSE(tree.occluded(r, 0, 12));
+  EXPECT_TRUE(tree.occluded(r, 0, 13));
+
+  // single rays agree with closest-hit queries
+  std::vector<rayson::ray> batch;
+  for (int i = 0; i < 301; ++i) {
+    vector3 from(-6 + (i % 13), -6 + (i % 11), -2 + (i % 5));
+    vector3 to(3 - (i % 7), 2 - (i % 3), 8);
+    batch.push_back(rayson::ray(from, to - from));
+    EXPECT_EQ(tree.intersect(batch.back(), 1e-9, 1.0).has_value(),
+              tree.occluded(batch.back(), 1e-9, 1.0));
+  }
+
+  // packets and batches agree with single rays
+  std::array<rayson::ray, 8> packet;
+  std::copy(batch.begin(), batch.begin() + 8, packet.begin());
+  auto packet_result = tree.occluded(packet, 1e-9, 1.0);
+  for (size_t i = 0; i < packet.size(); ++i) {
+    EXPECT_EQ(tree.occluded(packet[i], 1e-9, 1.0), packet_result[i]);
+  }
+  auto batch_result = tree.occluded(batch, 1e-9, 1.0);
+  ASSERT_EQ(batch.size(), batch_result.size());
+  size_t blocked = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    EXPECT_EQ(tree.occluded(batch[i], 1e-9, 1.0), batch_result[i]);
+    blocked += batch_result[i];
+  }
+  EXPECT_GT(blocked, 0);
+  EXPECT_LT(blocked, batch.size());
+  EXPECT_TRUE(tree.occluded(std::vector<rayson::ray>(), 0, 1).empty());
+}
+
+TEST(bvh, Quantized) {
+  auto s = rayson::read_file("teatime.json");
+  rayson::bvh exact(s), quantized(s, rayson::vertex_storage::quantized);
+  EXPECT_EQ(rayson::vertex_storage::quantized, quantized.storage());
+  EXPECT_EQ(exact.primitive_count(), quantized.primitive_count());
+  EXPECT_EQ(0.0, exact.max_vertex_error());
+  EXPECT_GT(quantized.max_vertex_error(), 0.0);
+  EXPECT_LT(quantized.max_vertex_error(), 1e-4);
+  EXPECT_LT(2 * quantized.primitive_bytes(), exact.primitive_bytes());
+  EXPECT_EQ(exact.node_bytes(), quantized.node_bytes());
+  EXPECT_TRUE(quantized.matches(s));
+
+  // hits move by no more than the vertices do, apart from rays grazing an
+  // edge
+  rayson::ray_generator eye(s);
+  size_t rays = 0, disagree = 0;
+  for (unsigned y = 0; y < s.viewport().y_resolution(); y += 4) {
+    for (unsigned x = 0; x < s.viewport().x_resolution(); x += 4) {
+      auto r = eye.pixel(x, y);
+      auto a = exact.intersect(r), b = quantized.intersect(r);
+      ++rays;
+      if ((a.has_value() != b.has_value()) || (a && (std::abs(a->t() - b->t()) > 1e-2))) {
+        ++disagree;
+      }
+      if (a && b && (a->index() == b->index())) {
+        EXPECT_EQ(a->material_index(), b->material_index());
+      }
+      EXPECT_EQ(quantized.occluded(r), b.has_value());
+    }
+  }
+  EXPECT_LT(disagree * 100, rays);
+
+  auto exact_image = rayson::render(s, exact), quantized_image = rayson::render(s, quantized);
+  size_t differ = 0;
+  for (size_t i = 0; i < exact_image.pixels().size(); ++i) {
+    auto& a = exact_image.pixels()[i];
+    auto& b = quantized_image.pixels()[i];
+    differ += std::max(std::max(std::abs(a.r() - b.r()), std::abs(a.g() - b.g())), std::abs(a.b() - b.b())) > .05;
+  }
+  EXPECT_LT(differ * 50, exact_image.pixels().size());
+
+  // a tiny triangle far from the origin, where a float cluster origin alone
+  // would be off by more than the triangle is wide
+  {
+    using rayson::vector3;
+    rayson::scene far(rayson::camera(s.camera()), rayson::viewport(s.viewport()),
+                      rayson::projection(s.projection()), rayson::shader(s.shader()), s.background());
+    far.emplace_material(rayson::material("a", 4, rayson::color(1, 0, 0)));
+    far.emplace_triangle(rayson::triangle(&far.materials()[0],
+                                          vector3(1000.4, 0, 5),
+                                          vector3(1000.4005, 0, 5.0005),
+                                          vector3(1000.4, .0005, 5.0005)));
+    rayson::bvh far_exact(far), far_quantized(far, rayson::vertex_storage::quantized);
+    EXPECT_LT(far_quantized.max_vertex_error(), 1e-8);
+    rayson::ray r(vector3(1000.4001, .0001, 0), vector3(0, 0, 1));
+    auto a = far_exact.intersect(r), b = far_quantized.intersect(r);
+    ASSERT_TRUE(a.has_value());
+    ASSERT_TRUE(b.has_value());
+    EXPECT_LE(std::abs(a->t() - b->t()), 4 * far_quantized.max_vertex_error() + 1e-12);
+  }
+
+  // quantized trees rebuild instead of refitting
+  s.triangles()[0].set_vertices(s.triangles()[0].a() + rayson::vector3(0, 1, 0),
+                                s.triangles()[0].b(),
+                                s.triangles()[0].c());
+  EXPECT_FALSE(quantized.matches(s));
+  EXPECT_TRUE(quantized.update(s));
+  EXPECT_TRUE(quantized.matches(s));
+}
+
+TEST(light_tree, Query) {
+  using rayson::vector3;
+
+  auto s = make_grid_scene(2);
+  rayson::light_tree empty;
+  EXPECT_TRUE(empty.query(vector3(), vector3(0, 0, 1)).empty());
+
+  for (int i = 0; i < 500; ++i) {
+    s.emplace_point_light(rayson::point_light(vector3((i * 37) % 101 - 50.0,
+                                                      (i * 53) % 97 - 48.0,
+                                                      (i * 71) % 89 - 44.0),
+                                              rayson::color(1, 1, 1),
+                                              .1 + (i % 10)));
+  }
+  rayson::light_tree tree(s);
+  EXPECT_EQ(s.point_lights().size(), tree.light_count());
+
+  // white lights under phong_shader(.1, .5, .25)
+  EXPECT_DOUBLE_EQ(.75 * s.point_lights()[3].intensity(), tree.weight(3));
+
+  auto in_front = [&](const vector3& p, const vector3& n) {
+    std::vector<size_t> result;
+    for (size_t i = 0; i < s.point_lights().size(); ++i) {
+      if (n.dot(s.point_lights()[i].location() - p) > 0.0) {
+        result.push_back(i);
+      }
+    }
+    return result;
+  };
+
+  std::vector<vector3> normals{vector3(0, 0, 1), vector3(1, 0, 0), vector3(0, -1, 0),
+                               vector3(1, 1, 1).normalized()};
+  for (int i = 0; i < 40; ++i) {
+    vector3 p(i - 20.0, (i * 7) % 30 - 15.0, (i * 3) % 20 - 10.0);
+    auto& n = normals[i % normals.size()];
+    auto expected = in_front(p, n);
+    auto found = tree.query(p, n);
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(expected, found);
+    // an error bound leaves out lights in front, weighing at most the bound
+    for (double max_error : {1.0, 10.0}) {
+      found = tree.query(p, n, max_error);
+      std::sort(found.begin(), found.end());
+      EXPECT_TRUE(std::includes(expected.begin(), expected.end(), found.begin(), found.end()));
+      double left_out = 0.0;
+      for (auto light : expected) {
+        if (!std::binary_search(found.begin(), found.end(), light)) {
+          left_out += tree.weight(light);
+        }
+      }
+      EXPECT_LE(left_out, max_error);
+      EXPECT_LT(found.size(), expected.size());
+    }
+  }
+
+  // rendering with the tree gives the same image, and an error bound moves
+  // no channel of any pixel by more than the bound
+  auto lit = make_grid_scene(6);
+  for (int i = 0; i < 100; ++i) {
+    lit.emplace_point_light(rayson::point_light(vector3((i * 37) % 101 - 50.0,
+                                                        (i * 53) % 97 - 48.0,
+                                                        -((i * 71) % 89) - 5.0),
+                                                rayson::color(1, 1, 1),
+                                                .002 * (1 + i % 10)));
+  }
+  rayson::bvh primitives(lit);
+  rayson::light_tree lights(lit);
+  auto all = rayson::render(lit, primitives);
+  EXPECT_EQ(all.pixels(), rayson::render(lit, primitives, lights).pixels());
+  const double max_error = .02;
+  auto bounded = rayson::render(lit, primitives, lights, max_error);
+  size_t differ = 0;
+  for (size_t i = 0; i < all.pixels().size(); ++i) {
+    auto& a = all.pixels()[i];
+    auto& b = bounded.pixels()[i];
+    EXPECT_LE(std::abs(a.r() - b.r()), max_error + 1e-12);
+    EXPECT_LE(std::abs(a.g() - b.g()), max_error + 1e-12);
+    EXPECT_LE(std::abs(a.b() - b.b()), max_error + 1e-12);
+    differ += b != a;
+  }
+  EXPECT_GT(differ, 0);
+}
+
+TEST(equality, SceneParameters) {
+  using rayson::vector3;
+  using rayson::color;
+
+  EXPECT_EQ(color(.1, .2, .3), color(.1, .2, .3));
+  EXPECT_NE(color(.1, .2, .3), color(.1, .2, .4));
+  rayson::camera cam(vector3(1, 2, 3), vector3(0, 1, 0), vector3(0, 0, 1));
+  EXPECT_EQ(cam, rayson::camera(cam));
+  EXPECT_NE(cam, rayson::camera(vector3(1, 2, 4), vector3(0, 1, 0), vector3(0, 0, 1)));
+  rayson::viewport vp(640, 480, -1, 1, 1, -1);
+  EXPECT_EQ(vp, rayson::viewport(640, 480, -1, 1, 1, -1));
+  EXPECT_NE(vp, rayson::viewport(640, 481, -1, 1, 1, -1));
+  EXPECT_EQ(rayson::projection(rayson::ortho_projection()), rayson::projection(rayson::ortho_projection()));
+  EXPECT_NE(rayson::projection(rayson::ortho_projection()), rayson::projection(rayson::persp_projection(1)));
+  EXPECT_NE(rayson::persp_projection(1), rayson::persp_projection(2));
+  EXPECT_EQ(rayson::shader(rayson::flat_shader()), rayson::shader(rayson::flat_shader()));
+  EXPECT_NE(rayson::phong_shader(1, 2, 3, color()), rayson::phong_shader(1, 2, 4, color()));
+  EXPECT_EQ(rayson::material("a", 2, color(1, 0, 0)), rayson::material("a", 2, color(1, 0, 0)));
+  EXPECT_NE(rayson::material("a", 2, color(1, 0, 0)), rayson::material("b", 2, color(1, 0, 0)));
+  EXPECT_NE(rayson::material("a", 2, color(1, 0, 0)), rayson::material("a", 3, color(1, 0, 0)));
+  rayson::point_light light(vector3(1, 2, 3), color(1, 1, 1), 1);
+  EXPECT_EQ(light, rayson::point_light(light));
+  EXPECT_NE(light, rayson::point_light(vector3(1, 2, 3), color(1, 1, 1), 2));
+}
+
+TEST(parallel_for, Throw) {
+  // every chunk runs, and the last chunk's exception reaches the caller
+  std::vector<char> visited(1000, 0);
+  EXPECT_THROW(rayson::detail::parallel_for(visited.size(), 1, [&](size_t begin, size_t end) {
+                 for (auto i = begin; i < end; ++i) {
+                   visited[i] = 1;
+                 }
+                 if (end == visited.size()) {
+                   throw std::runtime_error("last chunk");
+                 }
+               }),
+               std::runtime_error);
+  EXPECT_EQ(visited.size(), std::count(visited.begin(), visited.end(), 1));
+}
+
+TEST(render, SampleFiles) {
+  {
+    // ortho flat: the red sphere covers the left half, the blue one the right
+    auto scene = rayson::read_file("scene_2spheres_ortho_flat.json");
+    auto image = rayson::render(scene);
+    EXPECT_EQ(400, image.width());
+    EXPECT_EQ(400, image.height());
+    EXPECT_EQ(rayson::color(1, 0, 0), image.at(50, 200));
+    EXPECT_EQ(rayson::color(0, 0, 1), image.at(350, 200));
+    EXPECT_EQ(scene.background(), image.at(200, 200));
+    EXPECT_EQ(scene.background(), image.at(0, 0));
+  }
+
+  {
+    // phong: lit pixels differ from the flat material color, misses are background
+    auto scene = rayson::read_file("scene_gtri_persp_phong.json");
+    auto image = rayson::render(scene);
+    auto center = image.at(200, 200);
+    EXPECT_GT(center.g(), center.r());
+    EXPECT_NE(scene.materials()[0].color(), center);
+    EXPECT_EQ(scene.background(), image.at(0, 0));
+  }
+}
+
+TEST(relight_cache, Render) {
+  auto base = rayson::read_file("teatime.json");
+  auto reference = [](const rayson::scene& s) { return rayson::render(s).pixels(); };
+
+  rayson::relight_cache cache;
+  auto first = cache.render(base);
+  EXPECT_TRUE(cache.last_retraced());
+  EXPECT_EQ(2, cache.last_shadow_lights());
+  EXPECT_EQ(reference(base), first.pixels());
+
+  // rendering again reuses everything
+  auto again = cache.render(base);
+  EXPECT_FALSE(cache.last_retraced());
+  EXPECT_EQ(0, cache.last_shadow_lights());
+  EXPECT_EQ(first.pixels(), again.pixels());
+
+  auto j = nlohmann::json::parse(std::ifstream("teatime.json"));
+
+  // new light intensity and material color: re-shade only
+  {
+    auto edited = j;
+    edited["point_lights"][0]["intensity"] = 0.6;
+    edited["materials"][2]["color"] = {0.3, 0.5, 0.9};
+    edited["phong_shader"]["specular_coeff"] = 0.5;
+    auto s = rayson::read_json(edited);
+    auto image = cache.render(s);
+    EXPECT_FALSE(cache.last_retraced());
+    EXPECT_EQ(0, cache.last_shadow_lights());
+    EXPECT_EQ(reference(s), image.pixels());
+    EXPECT_NE(first.pixels(), image.pixels());
+  }
+
+  // a moved light and an added one: trace shadow rays for those two only
+  {
+    auto edited = j;
+    edited["point_lights"][1]["location"] = {-150.0, 50.0, 20.0};
+    edited["point_lights"][2]["location"] = {-250.0, 0.0, 150.0};
+    edited["point_lights"][2]["intensity"] = 0.3;
+    edited["point_lights"][2]["color"] = {1.0, 0.5, 0.5};
+    auto s = rayson::read_json(edited);
+    auto image = cache.render(s);
+    EXPECT_FALSE(cache.last_retraced());
+    EXPECT_EQ(2, cache.last_shadow_lights());
+    EXPECT_EQ(reference(s), image.pixels());
+  }
+
+  // moving geometry or the camera retraces
+  {
+    auto edited = j;
+    edited["spheres"][0]["radius"] = 25.0;
+    auto s = rayson::read_json(edited);
+    auto image = cache.render(s);
+    EXPECT_TRUE(cache.last_retraced());
+    EXPECT_EQ(reference(s), image.pixels());
+  }
+  {
+    auto edited = j;
+    edited["camera_eye"] = {-210.0, 100.0, 100.0};
+    auto s = rayson::read_json(edited);
+    auto image = cache.render(s);
+    EXPECT_TRUE(cache.last_retraced());
+    EXPECT_EQ(reference(s), image.pixels());
+  }
+}
+
+TEST(scanline_writer, Formats) {
+  rayson::framebuffer image(3, 2);
+  image.set(0, 0, rayson::color(1, 0, 0));
+  image.set(1, 0, rayson::color(0, 1, 0));
+  image.set(2, 0, rayson::color(0, 0, 1));
+  image.set(0, 1, rayson::color(1, 1, 1));
+  image.set(1, 1, rayson::color(.5, .5, .5));
+  image.set(2, 1, rayson::color(0, 0, 0));
+  const std::string top = {'\xFF', 0, 0, 0, '\xFF', 0, 0, 0, '\xFF'},
+                    bottom = {'\xFF', '\xFF', '\xFF', '\x80', '\x80', '\x80', 0, 0, 0};
+
+  {
+    std::ostringstream out;
+    rayson::write_image(image, out, rayson::image_format::ppm);
+    EXPECT_EQ("P6\n3 2\n255\n" + top + bottom, out.str());
+  }
+
+  {
+    // PFM rows run bottom to top
+    std::ostringstream out;
+    rayson::scanline_writer writer(out, 3, 2, rayson::image_format::pfm);
+    EXPECT_EQ(1, writer.next_row());
+    writer.write_row(image.row(1));
+    EXPECT_EQ(0, writer.next_row());
+    EXPECT_FALSE(writer.done());
+    writer.write_row(image.row(0));
+    EXPECT_TRUE(writer.done());
+    auto bytes = out.str();
+    auto header_end = bytes.find("1.0\n") + 4;
+    EXPECT_EQ(0, bytes.find("PF\n3 2\n"));
+    ASSERT_EQ(header_end + 18 * sizeof(float), bytes.size());
+    float first[3];
+    std::memcpy(first, bytes.data() + header_end + 3 * sizeof(float), sizeof(first));
+    EXPECT_FLOAT_EQ(.5f, first[0]);
+  }
+
+  {
+    // PNG rows are stored deflate blocks inside one IDAT chunk per row
+    std::ostringstream out;
+    rayson::write_image(image, out, rayson::image_format::png);
+    auto bytes = out.str();
+    EXPECT_EQ(std::string("\x89PNG\r\n\x1A\n", 8), bytes.substr(0, 8));
+    EXPECT_EQ("IHDR", bytes.substr(12, 4));
+    EXPECT_EQ("IEND", bytes.substr(bytes.size() - 8, 4));
+    auto first_row = bytes.find("IDAT") + 4;
+    // zlib header, then a non-final stored block of 10 bytes: filter byte and 9 channel bytes
+    EXPECT_EQ(std::string("\x78\x01\x00\x0A\x00\xF5\xFF\x00", 8), bytes.substr(first_row, 8));
+    EXPECT_EQ(top, bytes.substr(first_row + 8, 9));
+    auto second_row = bytes.find("IDAT", first_row) + 4;
+    EXPECT_EQ(std::string("\x01\x0A\x00\xF5\xFF\x00", 6), bytes.substr(second_row, 6));
+    EXPECT_EQ(bottom, bytes.substr(second_row + 6, 9));
+  }
+}
+
+TEST(render, Streaming) {
+  auto scene = rayson::read_file("scene_2spheres_persp_phong.json");
+  rayson::bvh tree(scene);
+  auto image = rayson::render(scene, tree);
+  for (auto format : {rayson::image_format::ppm, rayson::image_format::pfm, rayson::image_format::png}) {
+    std::ostringstream streamed, whole;
+    rayson::scanline_writer writer(streamed, scene.viewport(), format);
+    rayson::render(scene, tree, writer);
+    EXPECT_TRUE(writer.done());
+    rayson::write_image(image, whole, format);
+    EXPECT_EQ(whole.str(), streamed.str());
+  }
+}
+
+TEST(render, Progressive) {
+  auto scene = rayson::read_file("teatime.json");
+  rayson::bvh tree(scene);
+  auto reference = rayson::render(scene, tree);
+
+  std::vector<unsigned> steps;
+  auto image = rayson::render_progressive(scene, tree, [&](const rayson::framebuffer& level, unsigned step) {
+    steps.push_back(step);
+    EXPECT_EQ(reference.width(), level.width());
+    // traced pixels are already final
+    for (unsigned y = 0; y < level.height(); y += step) {
+      for (unsigned x = 0; x < level.width(); x += step) {
+        EXPECT_EQ(reference.at(x, y), level.at(x, y));
+      }
+    }
+    // the rest are upsampled from them
+    if (step > 1) {
+      EXPECT_EQ(level.at(0, 0), level.at(step - 1, step - 1));
+    }
+  });
+  EXPECT_EQ(std::vector<unsigned>({16, 8, 4, 2, 1}), steps);
+  EXPECT_EQ(reference.pixels(), image.pixels());
+}
+
+TEST(render, Antialiased) {
+  auto scene = rayson::read_file("scene_2spheres_ortho_phong.json");
+  rayson::bvh tree(scene);
+  auto reference = rayson::render(scene, tree);
+  const size_t pixels = reference.pixels().size();
+
+  // one sample per pixel is a plain render
+  auto single = rayson::render_antialiased(scene, tree, rayson::antialiasing(0.1, 1));
+  EXPECT_EQ(pixels, single.samples());
+  EXPECT_EQ(reference.pixels(), single.image().pixels());
+
+  // silhouettes are refined, background and sphere interiors are not
+  auto adaptive = rayson::render_antialiased(scene, tree, rayson::antialiasing(0.1, 3));
+  EXPECT_GT(adaptive.refined_pixels(), 0);
+  EXPECT_LT(adaptive.refined_pixels(), pixels / 10);
+  EXPECT_EQ(pixels + 8 * adaptive.refined_pixels(), adaptive.samples());
+  EXPECT_EQ(reference.at(0, 0), adaptive.image().at(0, 0));
+  EXPECT_EQ(reference.at(50, 200), adaptive.image().at(50, 200));
+
+  // the red sphere, centered on the left image edge with a radius of 100
+  // pixels, has edge pixels that blend red and background
+  size_t blended = 0;
+  for (unsigned x = 95; x < 105; ++x) {
+    auto& c = adaptive.image().at(x, 200);
+    if (c != reference.at(x, 200)) {
+      ++blended;
+    }
+  }
+  EXPECT_GT(blended, 0);
+
+  // a looser threshold spends fewer samples
+  auto loose = rayson::render_antialiased(scene, tree, rayson::antialiasing(0.5, 3));
+  EXPECT_LE(loose.samples(), adaptive.samples());
+
+  // an even grid cannot reuse the center sample
+  auto even = rayson::render_antialiased(scene, tree, rayson::antialiasing(0.1, 2));
+  EXPECT_EQ(pixels + 4 * even.refined_pixels(), even.samples());
+}
+
+TEST(render, AntialiasedInstance) {
+  // two triangles of one color that fill the view, meeting on a diagonal
+  auto j = nlohmann::json::parse(R"({
+    "camera_eye" : [0, 0, -5], "camera_up" : [0, 1, 0], "camera_view" : [0, 0, 1],
+    "x_resolution" : 16, "y_resolution" : 16,
+    "viewport_left" : -1.0, "viewport_top" : 1.0, "viewport_right" : 1.0, "viewport_bottom" : -1.0,
+    "background" : [0.0, 0.0, 0.0], "ortho_projection" : true, "flat_shader" : true,
+    "materials" : [ { "name" : "red", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 } ],
+    "triangles" : [ { "material" : "red", "a" : [-2, -2, 0], "b" : [2, -2, 0], "c" : [2, 2, 0] },
+                    { "material" : "red", "a" : [-2, -2, 0], "b" : [2, 2, 0], "c" : [-2, 2, 0] } ]
+  })");
+  auto flat = rayson::read_json(j);
+  rayson::bvh flat_tree(flat);
+  auto expected = rayson::render_antialiased(flat, flat_tree, rayson::antialiasing(0.1, 3));
+  EXPECT_GT(expected.refined_pixels(), 0);
+
+  // the same triangles in an instance are still told apart
+  j["objects"] = {{{"name", "quad"}, {"triangles", j["triangles"]}}};
+  j["instances"] = {{{"object", "quad"}}};
+  j.erase("triangles");
+  auto instanced = rayson::read_json(j);
+  rayson::bvh instanced_tree(instanced);
+  auto h = instanced_tree.intersect(rayson::ray(rayson::vector3(.5, -.5, -5), rayson::vector3(0, 0, 1)));
+  ASSERT_TRUE(h.has_value());
+  EXPECT_EQ(rayson::primitive_kind::instance, h->kind());
+  EXPECT_EQ(0, h->index());
+  EXPECT_EQ(rayson::primitive_kind::triangle, h->local_kind());
+  EXPECT_EQ(0, h->local_index());
+  h = instanced_tree.intersect(rayson::ray(rayson::vector3(-.5, .5, -5), rayson::vector3(0, 0, 1)));
+  ASSERT_TRUE(h.has_value());
+  EXPECT_EQ(1, h->local_index());
+  auto actual = rayson::render_antialiased(instanced, instanced_tree, rayson::antialiasing(0.1, 3));
+  EXPECT_EQ(expected.refined_pixels(), actual.refined_pixels());
+}
+
+TEST(view_from, Render) {
+  std::ifstream f("scene_2spheres_persp_phong.json");
+  auto j = nlohmann::json::parse(f);
+  auto s = rayson::read_json(j);
+  j["camera_eye"] = {.5, .2, -1};
+  auto moved = rayson::read_json(j);
+
+  // the original bvh, seen from the moved camera
+  auto view = rayson::view_from(s, moved.camera());
+  EXPECT_EQ(0, view.spheres().size());
+  EXPECT_EQ(s.materials().size(), view.materials().size());
+  EXPECT_EQ(s.point_lights().size(), view.point_lights().size());
+  auto expected = rayson::render(moved), actual = rayson::render(view, rayson::bvh(s));
+  for (unsigned y = 0; y < expected.height(); ++y) {
+    for (unsigned x = 0; x < expected.width(); ++x) {
+      ASSERT_EQ(expected.at(x, y), actual.at(x, y));
+    }
+  }
+}
+
+TEST(render_job, Async) {
+  auto scene = std::make_shared<const rayson::scene>(rayson::read_file("scene_2spheres_persp_phong.json"));
+  auto tree = std::make_shared<const rayson::bvh>(*scene);
+  auto reference = rayson::render(*scene, *tree);
+
+  rayson::worker_pool pool(4);
+  EXPECT_EQ(4, pool.size());
+
+  // a complete job, streaming tiles as they finish
+  {
+    std::atomic<unsigned> tiles(0);
+    std::atomic<size_t> tile_pixels(0);
+    rayson::render_job job(pool, scene, tree, 0, std::nullopt,
+                           [&](const rayson::tile& t, const rayson::framebuffer& image) {
+                             ++tiles;
+                             tile_pixels += size_t(t.width()) * t.height();
+                             EXPECT_EQ(reference.at(t.x(), t.y()), image.at(t.x(), t.y()));
+                           });
+    EXPECT_EQ(13 * 13, job.tiles());
+    auto image = job.future().get();
+    EXPECT_TRUE(job.done());
+    EXPECT_DOUBLE_EQ(1.0, job.progress());
+    EXPECT_EQ(job.tiles(), tiles.load());
+    EXPECT_EQ(reference.pixels().size(), tile_pixels.load());
+    EXPECT_EQ(reference.pixels(), image.pixels());
+  }
+
+  // cancelled from a tile callback, checked before the next tile
+  {
+    std::optional<rayson::render_job> job;
+    std::promise<void> started;
+    auto started_future = started.get_future();
+    job.emplace(pool, scene, tree, 1, std::nullopt,
+                [&](const rayson::tile&, const rayson::framebuffer&) {
+                  started_future.wait();
+                  job->cancel();
+                });
+    started.set_value();
+    EXPECT_THROW(job->future().get(), rayson::render_exception);
+    EXPECT_TRUE(job->cancelled());
+    EXPECT_EQ(1, job->tiles_done());
+    EXPECT_LT(job->progress(), 1.0);
+  }
+
+  // a deadline that has already passed
+  {
+    rayson::render_job job(pool, scene, tree, 0, rayson::render_job::clock::now());
+    try {
+      job.future().get();
+      ADD_FAILURE() << "expected render_exception";
+    } catch (const rayson::render_exception& e) {
+      EXPECT_EQ("render deadline exceeded", e.message());
+    }
+  }
+
+  // concurrent jobs share the pool, each within its thread budget
+  {
+    std::atomic<int> active_a(0), active_b(0), max_a(0), max_b(0);
+    auto limited = [](std::atomic<int>& active, std::atomic<int>& max) {
+      return [&](const rayson::tile&, const rayson::framebuffer&) {
+        int now = ++active;
+        int seen = max.load();
+        while ((now > seen) && !max.compare_exchange_weak(seen, now)) { }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        --active;
+      };
+    };
+    rayson::render_job a(pool, scene, tree, 1, std::nullopt, limited(active_a, max_a)),
+                       b(pool, scene, tree, 2, std::nullopt, limited(active_b, max_b));
+    EXPECT_EQ(reference.pixels(), a.future().get().pixels());
+    EXPECT_EQ(reference.pixels(), b.future().get().pixels());
+    EXPECT_EQ(1, max_a.load());
+    EXPECT_LE(max_b.load(), 2);
+  }
+
+  // a job using the whole pool still takes turns with a later one
+  {
+    std::optional<rayson::render_job> a;
+    std::atomic<unsigned> a_done_at_b(0);
+    std::atomic<bool> b_started(false);
+    a.emplace(pool, scene, tree);
+    rayson::render_job b(pool, scene, tree, 0, std::nullopt,
+                         [&](const rayson::tile&, const rayson::framebuffer&) {
+                           if (!b_started.exchange(true)) {
+                             a_done_at_b = a->tiles_done();
+                           }
+                         });
+    EXPECT_EQ(reference.pixels(), a->future().get().pixels());
+    EXPECT_EQ(reference.pixels(), b.future().get().pixels());
+    EXPECT_LT(2 * a_done_at_b.load(), a->tiles());
+  }
+
+  // a throwing tile callback fails the job with its exception
+  {
+    std::atomic<unsigned> calls(0);
+    rayson::render_job job(pool, scene, tree, 0, std::nullopt,
+                           [&](const rayson::tile&, const rayson::framebuffer&) {
+                             if (++calls == 3) {
+                               throw std::runtime_error("callback failed");
+                             }
+                           });
+    EXPECT_THROW(job.future().get(), std::runtime_error);
+    EXPECT_LT(job.tiles_done(), job.tiles());
+  }
+}
+
+TEST(hash, Xxh64) {
+  auto hash = [](const std::string& s, std::uint64_t seed = 0) {
+    return rayson::detail::xxh64(s.data(), s.size(), seed);
+  };
+  EXPECT_EQ(0xef46db3751d8e999ULL, hash(""));
+  EXPECT_EQ(0x44bc2cf5ad770999ULL, hash("abc"));
+  EXPECT_EQ(0xb97967d02e227e7bULL, hash(std::string(100, 'a'), 7));
+  EXPECT_EQ(0xdde9d7f125de8f22ULL, hash("0123456789abcdefghijklmnopqrstuvwxyz!"));
+}
+
+TEST(scene_cache, LoadFile) {
+  rayson::scene_cache cache(2);
+
+  auto first = cache.load_file("teatime.json");
+  EXPECT_FALSE(first.hit());
+  EXPECT_EQ(rayson::read_file("teatime.json").triangles().size(),
+            first.scene()->triangles().size());
+  EXPECT_TRUE(first.tree()->matches(*first.scene()));
+
+  auto second = cache.load_file("teatime.json");
+  EXPECT_TRUE(second.hit());
+  EXPECT_EQ(first.scene(), second.scene());
+  EXPECT_EQ(first.tree(), second.tree());
+
+  // the least recently used scene is evicted
+  cache.load_file("scene_2spheres_ortho_flat.json");
+  cache.load_file("teatime.json");
+  cache.load_file("scene_gtri_ortho_flat.json");
+  EXPECT_EQ(2, cache.size());
+  EXPECT_TRUE(cache.load_file("teatime.json").hit());
+  EXPECT_FALSE(cache.load_file("scene_2spheres_ortho_flat.json").hit());
+  EXPECT_EQ(3, cache.hits());
+  EXPECT_EQ(4, cache.misses());
+
+  EXPECT_THROW(cache.load_file("nonexistent.json"), rayson::read_exception);
+  EXPECT_THROW(cache.load_text("{"), rayson::read_exception);
+
+  // editing only a mesh the scene references reloads it
+  const std::string mesh_path = "/tmp/rayson-test-cache.obj";
+  std::ofstream(mesh_path) << "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n";
+  const std::string text = R"({
+    "camera_eye" : [0, 0, -5], "camera_up" : [0, 1, 0], "camera_view" : [0, 0, 1],
+    "x_resolution" : 8, "y_resolution" : 8,
+    "viewport_left" : -1.0, "viewport_top" : 1.0, "viewport_right" : 1.0, "viewport_bottom" : -1.0,
+    "background" : [0.0, 0.0, 0.0], "ortho_projection" : true, "flat_shader" : true,
+    "materials" : [ { "name" : "red", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 } ],
+    "objects" : [ { "name" : "o", "meshes" : [ { "path" : "rayson-test-cache.obj", "material" : "red" } ] } ]
+  })";
+  auto before = cache.load_text(text, "/tmp/");
+  EXPECT_FALSE(before.hit());
+  EXPECT_TRUE(cache.load_text(text, "/tmp/").hit());
+  std::ofstream(mesh_path) << "v 0 0 0\nv 1 0 0\nv 0 1 0\nv 1 1 0\nf 1 2 3\nf 2 4 3\n";
+  auto after = cache.load_text(text, "/tmp/");
+  EXPECT_FALSE(after.hit());
+  EXPECT_EQ(1, before.scene()->objects()[0].triangles().size());
+  EXPECT_EQ(2, after.scene()->objects()[0].triangles().size());
+  EXPECT_TRUE(cache.load_text(text, "/tmp/").hit());
+  // the same text from another directory is another scene
+  EXPECT_THROW(cache.load_text(text, "/nonexistent/"), rayson::read_exception);
+  std::remove(mesh_path.c_str());
+  EXPECT_THROW(cache.load_text(text, "/tmp/"), rayson::read_exception);
+}
+
+TEST(hash, Scene) {
+  auto s = make_grid_scene(50);
+  auto original = rayson::hash(s);
+  EXPECT_EQ(original, rayson::hash(make_grid_scene(50)));
+  EXPECT_EQ(original.value(), rayson::hash(make_grid_scene(50)).value());
+  EXPECT_EQ(rayson::hash(rayson::read_file("teatime.json")),
+            rayson::hash(rayson::read_file("teatime.json")));
+
+  // moving one sphere past the first chunk changes only the spheres hash
+  auto& sph = s.spheres()[1100];
+  sph.set_radius(sph.radius() * 2);
+  auto moved = rayson::hash(s);
+  EXPECT_NE(original, moved);
+  EXPECT_NE(original.value(), moved.value());
+  EXPECT_NE(original.spheres(), moved.spheres());
+  EXPECT_FALSE(original.same_geometry(moved));
+  EXPECT_EQ(original.triangles(), moved.triangles());
+  EXPECT_EQ(original.camera(), moved.camera());
+  EXPECT_EQ(original.projection(), moved.projection());
+  EXPECT_EQ(original.materials(), moved.materials());
+  EXPECT_EQ(original.lights(), moved.lights());
+
+  // other sections are independent of the geometry
+  auto lit = make_grid_scene(50);
+  lit.emplace_point_light(rayson::point_light(rayson::vector3(1, 2, 3), rayson::color(1, 1, 1), 1));
+  auto relit = rayson::hash(lit);
+  EXPECT_NE(original.lights(), relit.lights());
+  EXPECT_TRUE(original.same_geometry(relit));
+  EXPECT_EQ(original.materials(), relit.materials());
+
+  EXPECT_NE(rayson::hash(rayson::read_file("scene_2spheres_ortho_flat.json")).projection(),
+            rayson::hash(rayson::read_file("scene_2spheres_persp_flat.json")).projection());
+}
+
+TEST(scene_diff, Compare) {
+  auto before = make_grid_scene(6);
+  EXPECT_TRUE(rayson::scene_diff(before, make_grid_scene(6)).empty());
+
+  auto after = make_grid_scene(6);
+  after.spheres()[2].set_radius(.3);
+  after.emplace_point_light(rayson::point_light(rayson::vector3(1, 2, 3), rayson::color(1, 1, 1), 1));
+  rayson::scene_diff moved(before, after);
+  EXPECT_FALSE(moved.empty());
+  EXPECT_FALSE(moved.camera_changed());
+  EXPECT_FALSE(moved.shading_changed());
+  EXPECT_TRUE(moved.materials().empty());
+  EXPECT_EQ(std::vector<size_t>{1}, moved.point_lights().added());
+  EXPECT_EQ(std::vector<size_t>{2}, moved.spheres().changed());
+  EXPECT_TRUE(moved.triangles().empty());
+  EXPECT_TRUE(moved.geometry_changed());
+  EXPECT_FALSE(moved.topology_changed());
+
+  rayson::scene_diff grown(before, make_grid_scene(7));
+  EXPECT_TRUE(grown.topology_changed());
+  EXPECT_FALSE(grown.spheres().added().empty());
+
+  rayson::scene_diff shrunk(make_grid_scene(7), before);
+  EXPECT_EQ(grown.spheres().added(), shrunk.spheres().removed());
+  EXPECT_EQ(grown.spheres().changed(), shrunk.spheres().changed());
+
+  auto camera = rayson::scene_diff(rayson::read_file("scene_2spheres_ortho_flat.json"),
+                                   rayson::read_file("scene_2spheres_persp_phong.json"));
+  EXPECT_TRUE(camera.camera_changed());
+  EXPECT_TRUE(camera.shading_changed());
+}
+
+TEST(scene_dedup, Dedup) {
+  auto j = nlohmann::json::parse(R"({
+    "camera_eye" : [0, 0, -5], "camera_up" : [0, 1, 0], "camera_view" : [0, 0, 1],
+    "x_resolution" : 8, "y_resolution" : 8,
+    "viewport_left" : -1.0, "viewport_top" : 1.0, "viewport_right" : 1.0, "viewport_bottom" : -1.0,
+    "background" : [0.0, 0.0, 0.0], "ortho_projection" : true, "flat_shader" : true,
+    "materials" : [ { "name" : "red", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 },
+                    { "name" : "scarlet", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 },
+                    { "name" : "blue", "color" : [0.0, 0.0, 1.0], "shininess" : 4.0 } ],
+    "spheres" : [ { "material" : "red", "center" : [0, 0, 0], "radius" : 1.0 },
+                  { "material" : "scarlet", "center" : [0, 0, 0], "radius" : 1.0 },
+                  { "material" : "blue", "center" : [0, 0, 0], "radius" : 1.0 } ],
+    "triangles" : [ { "material" : "red", "a" : [0, 0, 0], "b" : [1, 0, 0], "c" : [0, 1, 0] },
+                    { "material" : "scarlet", "a" : [1, 0, 0], "b" : [0, 1, 0], "c" : [0, 0, 0] },
+                    { "material" : "red", "a" : [0, 0, 0], "b" : [0, 1, 0], "c" : [1, 0, 0] },
+                    { "material" : "red", "a" : [1e-9, 0, 0], "b" : [1, 0, 0], "c" : [0, 1, 0] },
+                    { "material" : "red", "a" : [0, 0, 0], "b" : [0, 1e-9, 0], "c" : [0, 1, 0] } ],
+    "objects" : [ { "name" : "pair", "spheres" : [ { "material" : "blue", "center" : [0, 0, 0], "radius" : 1.0 },
+                                                   { "material" : "blue", "center" : [0, 0, 0], "radius" : 1.0 } ] } ],
+    "instances" : [ { "object" : "pair", "material" : "scarlet" } ]
+  })");
+  auto s = rayson::read_json(j);
+
+  rayson::scene_dedup exact(s);
+  EXPECT_EQ(1, exact.materials_merged());
+  EXPECT_EQ(2, exact.scene().materials().size());
+  EXPECT_EQ(1 + 1, exact.spheres_removed());
+  EXPECT_EQ(2, exact.scene().spheres().size());
+  // a rotation is a duplicate, but the reversed winding is not
+  EXPECT_EQ(1, exact.triangles_removed());
+  EXPECT_EQ(0, exact.vertices_welded());
+  ASSERT_EQ(1, exact.scene().instances().size());
+  EXPECT_EQ(&exact.scene().objects()[0], &exact.scene().instances()[0].object());
+  EXPECT_EQ(&exact.scene().materials()[0], &exact.scene().instances()[0].material());
+  EXPECT_EQ(1, exact.scene().objects()[0].spheres().size());
+
+  rayson::scene_dedup welded(s, 1e-6);
+  EXPECT_EQ(2, welded.vertices_welded());
+  // the nearby triangle welds into a duplicate, and the thin one collapses
+  EXPECT_EQ(3, welded.triangles_removed());
+  ASSERT_EQ(2, welded.scene().triangles().size());
+  EXPECT_EQ(rayson::vector3(0, 1, 0), welded.scene().triangles()[1].b());
+  EXPECT_EQ(sizeof(rayson::material) + 2 * sizeof(rayson::sphere) + 3 * sizeof(rayson::triangle),
+            welded.bytes_saved());
+
+  // doubling teatime's triangles, rotated, leaves the same triangles
+  auto teapot = rayson::read_file("teatime.json");
+  rayson::scene_dedup once(teapot);
+  auto doubled = teapot;
+  for (auto& t : teapot.triangles()) {
+    doubled.emplace_triangle(rayson::triangle(&doubled.materials()[&t.material() - teapot.materials().data()],
+                                              t.c(), t.a(), t.b()));
+  }
+  rayson::scene_dedup twice(doubled);
+  EXPECT_EQ(once.scene().triangles().size(), twice.scene().triangles().size());
+  EXPECT_EQ(once.triangles_removed() + teapot.triangles().size(), twice.triangles_removed());
+  EXPECT_TRUE(rayson::hash(once.scene()).same_geometry(rayson::hash(twice.scene())));
+}
+
+TEST(write_json, RoundTrip) {
+  const std::string path = "/tmp/rayson-test-written.json";
+  auto round_trip = [&](const rayson::scene& s, rayson::json_style style) {
+    {
+      std::ofstream f(path);
+      rayson::write_json(s, f, style);
+    }
+    return rayson::read_file(path);
+  };
+
+  for (auto name : { "scene_2spheres_ortho_flat.json", "scene_gtri_persp_phong.json", "teatime.json" }) {
+    auto s = rayson::read_file(name);
+    for (auto style : { rayson::json_style::pretty, rayson::json_style::compact }) {
+      auto back = round_trip(s, style);
+      EXPECT_EQ(rayson::hash(s).value(), rayson::hash(back).value()) << name;
+      EXPECT_EQ(s.materials(), back.materials());
+      ASSERT_EQ(s.triangles().size(), back.triangles().size());
+      for (size_t i = 0; i < s.triangles().size(); ++i) {
+        ASSERT_EQ(s.triangles()[i].a(), back.triangles()[i].a());
+        ASSERT_EQ(s.triangles()[i].b(), back.triangles()[i].b());
+        ASSERT_EQ(s.triangles()[i].c(), back.triangles()[i].c());
+        ASSERT_EQ(s.triangles()[i].material(), back.triangles()[i].material());
+      }
+    }
+  }
+
+  // compact output has no whitespace
+  std::ostringstream compact;
+  rayson::write_json(rayson::read_file("scene_2spheres_ortho_flat.json"), compact, rayson::json_style::compact);
+  EXPECT_EQ(std::string::npos, compact.str().find_first_of(" \n"));
+
+  // doubles that need every digit, objects, instances, and escaped names
+  auto j = nlohmann::json::parse(R"({
+    "camera_eye" : [0.1, 0.2, -5.0], "camera_up" : [0, 1, 0], "camera_view" : [0, 0, 1],
+    "x_resolution" : 8, "y_resolution" : 8,
+    "viewport_left" : -1.0, "viewport_top" : 1.0, "viewport_right" : 1.0, "viewport_bottom" : -1.0,
+    "background" : [0.0, 0.0, 0.0], "ortho_projection" : true, "flat_shader" : true,
+    "materials" : [ { "name" : "say \"red\"\n", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 } ],
+    "objects" : [ { "name" : "ball", "spheres" : [ { "material" : "say \"red\"\n", "center" : [0, 0, 0], "radius" : 0.5 } ] } ],
+    "instances" : [ { "object" : "ball", "material" : "say \"red\"\n",
+                      "transform" : [[0.5, 0, 0, 0.3], [0, 0.5, 0, 1e-300], [0, 0, 0.5, -7]] } ]
+  })");
+  auto s = rayson::read_json(j);
+  s.emplace_sphere(rayson::sphere(&s.materials()[0], rayson::vector3(1.0 / 3.0, -0.0, 6.02214076e23), 1e-3));
+  auto back = round_trip(s, rayson::json_style::pretty);
+  EXPECT_EQ(rayson::hash(s).value(), rayson::hash(back).value());
+  EXPECT_EQ(s.materials()[0].name(), back.materials()[0].name());
+  ASSERT_EQ(1, back.instances().size());
+  EXPECT_EQ(s.instances()[0].to_world(), back.instances()[0].to_world());
+  EXPECT_EQ(&back.materials()[0], &back.instances()[0].material());
+  EXPECT_EQ(s.spheres()[0].center(), back.spheres()[0].center());
+
+  std::ostringstream ignored;
+  s.emplace_material(rayson::material(s.materials()[0]));
+  EXPECT_THROW(rayson::write_json(s, ignored), rayson::write_exception);
+  std::remove(path.c_str());
+}
+
+TEST(embedded_scene, ReadAndWrite) {
+  // the fixtures are rayson-embed's output for the sample files, compiled
+  // into this test alongside rayson.hpp
+  static_assert(scene_2spheres_ortho_flat::scene.sphere_count() == 2);
+  static_assert(scene_2spheres_ortho_flat::scene.spheres()[1].material() == 1);
+  static_assert(scene_gtri_persp_phong::scene.triangle_count() == 1);
+
+  for (auto [path, embedded] : { std::make_pair("scene_2spheres_ortho_flat", &scene_2spheres_ortho_flat::scene),
+                                 std::make_pair("scene_gtri_persp_phong", &scene_gtri_persp_phong::scene) }) {
+    auto expected = rayson::read_file(std::string(path) + ".json");
+    auto s = rayson::read_embedded(*embedded);
+    EXPECT_EQ(rayson::hash(expected).value(), rayson::hash(s).value()) << path;
+    EXPECT_EQ(expected.materials(), s.materials());
+
+    // and they are up to date
+    std::ifstream f(std::string(path) + ".hpp");
+    std::stringstream committed;
+    committed << f.rdbuf();
+    std::ostringstream header;
+    rayson::write_embedded(expected, path, header);
+    EXPECT_EQ(committed.str(), header.str()) << path;
+  }
+  auto s = rayson::read_embedded(scene_2spheres_ortho_flat::scene);
+  EXPECT_EQ(&s.materials()[1], &s.spheres()[1].material());
+
+  // the generated header holds every double exactly
+  auto teapot = rayson::read_file("teatime.json");
+  std::ostringstream header;
+  rayson::write_embedded(teapot, "teatime", header);
+  auto text = header.str();
+  EXPECT_NE(std::string::npos, text.find("namespace teatime {"));
+  EXPECT_NE(std::string::npos, text.find("std::array<rayson::embedded_triangle, 4032> triangles"));
+  EXPECT_NE(std::string::npos, text.find("rayson::embedded_material(\"purple\", 4, rayson::color(0.8, 0.2, 0.95))"));
+  EXPECT_NE(std::string::npos, text.find("rayson::persp_projection(1)"));
+  for (double x : { 0.1, 1.0 / 3.0, -2.5e-300, 6.02214076e23, std::nextafter(1.0, 2.0) }) {
+    std::string digits;
+    rayson::detail::append_double(digits, x);
+    EXPECT_EQ(x, std::strtod(digits.c_str(), nullptr));
+  }
+
+  std::ostringstream ignored;
+  EXPECT_THROW(rayson::write_embedded(teapot, "2pots", ignored), rayson::write_exception);
+  EXPECT_THROW(rayson::write_embedded(teapot, "tea-time", ignored), rayson::write_exception);
+  auto instanced = teapot;
+  rayson::object o("ball");
+  o.emplace_sphere(rayson::sphere(&instanced.materials()[0], rayson::vector3(0, 0, 0), 1.0));
+  instanced.emplace_object(std::move(o));
+  EXPECT_THROW(rayson::write_embedded(instanced, "teatime", ignored), rayson::write_exception);
+}
+
+TEST(view_cull, Cull) {
+  auto j = nlohmann::json::parse(std::ifstream("teatime.json"));
+  j["x_resolution"] = 64;
+  j["y_resolution"] = 64;
+  // a close-up of the middle of the view
+  j["viewport_left"] = -0.1;
+  j["viewport_right"] = 0.1;
+  j["viewport_top"] = 0.1;
+  j["viewport_bottom"] = -0.1;
+  auto phong = rayson::read_json(j);
+  j.erase("phong_shader");
+  j["flat_shader"] = true;
+  auto flat = rayson::read_json(j);
+
+  rayson::view_volume volume(flat);
+  auto behind = flat.camera().eye() - flat.camera().view().normalized() * 10.0;
+  EXPECT_FALSE(volume.overlaps(rayson::sphere(&flat.materials()[0], behind, 1.0)));
+  EXPECT_TRUE(volume.overlaps(rayson::sphere(&flat.materials()[0], behind, 20.0)));
+  EXPECT_FALSE(volume.overlaps(rayson::aabb(behind, behind)));
+  auto ahead = flat.camera().eye() + flat.camera().view().normalized() * 10.0;
+  EXPECT_TRUE(volume.overlaps(rayson::aabb(ahead, ahead)));
+
+  // flat shading sees only what primary rays hit
+  rayson::view_cull culled(flat);
+  EXPECT_LT(0, culled.triangles_culled());
+  EXPECT_EQ(flat.triangles().size(), culled.triangles_culled() + culled.scene().triangles().size());
+  EXPECT_EQ(flat.spheres().size(), culled.spheres_culled() + culled.scene().spheres().size());
+  auto before = rayson::render(flat), after = rayson::render(culled.scene());
+  for (unsigned y = 0; y < before.height(); ++y) {
+    for (unsigned x = 0; x < before.width(); ++x) {
+      ASSERT_EQ(before.at(x, y), after.at(x, y));
+    }
+  }
+
+  // shadow rays may hit anything
+  rayson::view_cull kept(phong);
+  EXPECT_EQ(0, kept.triangles_culled());
+  EXPECT_EQ(phong.triangles().size(), kept.scene().triangles().size());
+
+  // an instance outside the view is dropped, with the object it places
+  auto k = nlohmann::json::parse(R"({
+    "camera_eye" : [0, 0, -5], "camera_up" : [0, 1, 0], "camera_view" : [0, 0, 1],
+    "x_resolution" : 8, "y_resolution" : 8,
+    "viewport_left" : -1.0, "viewport_top" : 1.0, "viewport_right" : 1.0, "viewport_bottom" : -1.0,
+    "background" : [0.0, 0.0, 0.0], "ortho_projection" : true, "flat_shader" : true,
+    "materials" : [ { "name" : "red", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 } ],
+    "objects" : [ { "name" : "ball", "spheres" : [ { "material" : "red", "center" : [0, 0, 0], "radius" : 0.5 } ] },
+                  { "name" : "dot", "spheres" : [ { "material" : "red", "center" : [0, 0, 0], "radius" : 0.1 } ] } ],
+    "instances" : [ { "object" : "dot", "transform" : [[1, 0, 0, 5], [0, 1, 0, 0], [0, 0, 1, 0]] },
+                    { "object" : "ball", "material" : "red" },
+                    { "object" : "ball", "transform" : [[1, 0, 0, 0], [0, 1, 0, 0], [0, 0, 1, -10]] } ]
+  })");
+  rayson::view_cull instances(rayson::read_json(k));
+  EXPECT_EQ(2, instances.instances_culled());
+  ASSERT_EQ(1, instances.scene().objects().size());
+  ASSERT_EQ(1, instances.scene().instances().size());
+  EXPECT_EQ(&instances.scene().objects()[0], &instances.scene().instances()[0].object());
+  EXPECT_EQ(&instances.scene().materials()[0], &instances.scene().instances()[0].material());
+}
+
+#ifdef __linux__
+TEST(scene_watcher, Poll) {
+  auto read_text = [](const std::string& path) {
+    std::ifstream f(path);
+    return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  };
+  auto text = read_text("scene_2spheres_ortho_flat.json");
+  const std::string path = "/tmp/rayson-test-watch.json";
+  std::ofstream(path) << text;
+
+  rayson::scene_watcher watcher(path);
+  EXPECT_EQ(2, watcher.current().spheres().size());
+  EXPECT_FALSE(watcher.poll(std::chrono::milliseconds(0)));
+
+  auto moved = text;
+  moved.replace(moved.find("[1.0, 0.0, 8.0]"), 15, "[1.0, 0.5, 8.0]");
+  std::ofstream(path) << moved;
+  auto diff = watcher.poll(std::chrono::seconds(5));
+  ASSERT_TRUE(diff);
+  EXPECT_EQ(std::vector<size_t>{1}, diff->spheres().changed());
+  EXPECT_FALSE(diff->topology_changed());
+  EXPECT_EQ(rayson::vector3(1, .5, 8), watcher.current().spheres()[1].center());
+
+  std::ofstream(path) << "{";
+  EXPECT_THROW(watcher.poll(std::chrono::seconds(5)), rayson::read_exception);
+  EXPECT_EQ(rayson::vector3(1, .5, 8), watcher.current().spheres()[1].center());
+
+  std::remove(path.c_str());
+}
+#endif
+
+TEST(scene, CopyRebindsMaterials) {
+  auto original = rayson::read_file("scene_2spheres_ortho_flat.json");
+  auto copy = std::make_unique<rayson::scene>(original);
+  EXPECT_EQ(&copy->materials()[0], &copy->spheres()[0].material());
+  EXPECT_EQ(&copy->materials()[1], &copy->spheres()[1].material());
+
+  rayson::scene assigned = make_grid_scene(2);
+  assigned = *copy;
+  copy.reset();
+  EXPECT_EQ(&assigned.materials()[1], &assigned.spheres()[1].material());
+  EXPECT_EQ("blue", assigned.spheres()[1].material().name());
+
+  auto triangles = make_grid_scene(4);
+  rayson::scene copied(triangles);
+  rayson::scene moved(std::move(copied));
+  EXPECT_EQ(&moved.materials()[1], &moved.triangles()[0].material());
+}
+
+TEST(scene_publisher, Publish) {
+  rayson::scene_publisher publisher(make_grid_scene(4));
+  auto first = publisher.acquire();
+  EXPECT_EQ(0, first->version());
+  EXPECT_TRUE(first->tree().matches(first->scene()));
+
+  // readers keep rendering consistent snapshots while the updater publishes
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> readers;
+  std::atomic<size_t> renders(0);
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&]() {
+      std::uint64_t last = 0;
+      while (!stop) {
+        auto snapshot = publisher.acquire();
+        EXPECT_GE(snapshot->version(), last);
+        last = snapshot->version();
+        EXPECT_EQ(snapshot->scene().spheres().size() + snapshot->scene().triangles().size(),
+                  snapshot->tree().primitive_count());
+        rayson::render(snapshot->scene(), snapshot->tree());
+        ++renders;
+      }
+    });
+  }
+  for (int n = 5; n < 10; ++n) {
+    auto published = publisher.publish(make_grid_scene(n));
+    EXPECT_EQ(n - 4, published->version());
+  }
+  while (renders < 8) {
+    std::this_thread::yield();
+  }
+  stop = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  EXPECT_EQ(5, publisher.acquire()->version());
+  EXPECT_EQ(4 * 4, first->scene().spheres().size() + first->scene().triangles().size());
+  std::weak_ptr<const rayson::scene_snapshot> old(first);
+  first.reset();
+  EXPECT_TRUE(old.expired());
+}
+
+TEST(scene_variant, Render) {
+  auto base = std::make_shared<const rayson::scene_snapshot>(rayson::read_file("scene_2spheres_persp_phong.json"), 0);
+  rayson::scene_variant same(base), relit(base), recolored(base);
+  EXPECT_TRUE(same.shading().spheres().empty());
+  EXPECT_EQ(rayson::render(base->scene()).pixels(), rayson::render(same).pixels());
+
+  relit.point_lights().pop_back();
+  relit.set_shader(rayson::phong_shader(.2, .5, .25, rayson::color(1, 1, 1)));
+  auto reference = base->scene();
+  reference.point_lights().pop_back();
+  reference.set_shader(rayson::phong_shader(.2, .5, .25, rayson::color(1, 1, 1)));
+  EXPECT_EQ(rayson::render(reference).pixels(), rayson::render(relit).pixels());
+
+  recolored.set_material(0, rayson::material("green", 4, rayson::color(0, 1, 0)));
+  reference = base->scene();
+  reference.set_material(0, rayson::material("green", 4, rayson::color(0, 1, 0)));
+  EXPECT_EQ("green", reference.spheres()[0].material().name());
+  EXPECT_EQ(rayson::render(reference).pixels(), rayson::render(recolored).pixels());
+  EXPECT_NE(rayson::render(same).pixels(), rayson::render(recolored).pixels());
+
+  // the variants leave the base and each other alone
+  EXPECT_EQ(2, base->scene().point_lights().size());
+  EXPECT_EQ("red", base->scene().materials()[0].name());
+  EXPECT_EQ(2, recolored.shading().point_lights().size());
+}
+
+TEST(chunked_geometry, Trace) {
+  auto s = make_grid_scene(12);
+  auto teapot = rayson::read_file("teatime.json");
+  for (auto& t : teapot.triangles()) {
+    s.emplace_triangle(rayson::triangle(&s.materials()[0], t.a() * .2, t.b() * .2, t.c() * .2));
+  }
+  const std::string path = "/tmp/rayson-test.chunked";
+  rayson::write_chunked(s, path, 256);
+
+  // the shading half of s: its camera, lights, and materials
+  auto shading = s;
+  shading.spheres().clear();
+  shading.triangles().clear();
+
+  rayson::chunked_geometry geometry(path, shading, 4);
+  EXPECT_GT(geometry.chunk_count(), 16);
+  rayson::bvh tree(s);
+
+  rayson::ray_generator eye(s);
+  std::vector<rayson::ray> rays;
+  for (unsigned y = 0; y < s.viewport().y_resolution(); y += 5) {
+    for (unsigned x = 0; x < s.viewport().x_resolution(); x += 5) {
+      rays.push_back(eye.pixel(x, y));
+    }
+  }
+  auto batch = geometry.intersect(rays);
+  size_t hits = 0;
+  for (size_t i = 0; i < rays.size(); ++i) {
+    auto expected = tree.intersect(rays[i]);
+    auto single = geometry.intersect(rays[i]);
+    ASSERT_EQ(expected.has_value(), single.has_value());
+    ASSERT_EQ(expected.has_value(), batch[i].has_value());
+    if (expected) {
+      ++hits;
+      EXPECT_EQ(expected->t(), single->t());
+      EXPECT_EQ(expected->kind(), single->kind());
+      EXPECT_EQ(expected->index(), single->index());
+      EXPECT_EQ(expected->material_index(), single->material_index());
+      EXPECT_EQ(expected->t(), batch[i]->t());
+      EXPECT_EQ(expected->index(), batch[i]->index());
+    }
+    EXPECT_EQ(tree.occluded(rays[i], 0, 20), geometry.occluded(rays[i], 0, 20));
+  }
+  EXPECT_GT(hits, 0);
+  EXPECT_EQ(tree.occluded(rays, 0, 20), geometry.occluded(rays, 0, 20));
+
+  // aiming at every chunk pages each in, evicting all but the last few
+  for (size_t i = 0; i < geometry.chunk_count(); ++i) {
+    auto& eye_point = s.camera().eye();
+    geometry.intersect(rayson::ray(eye_point, geometry.chunk_bounds(i).centroid() - eye_point));
+  }
+  EXPECT_EQ(geometry.capacity(), geometry.resident());
+  EXPECT_GT(geometry.loads(), geometry.capacity());
+
+  auto expected = rayson::render(s, tree), image = rayson::render(shading, geometry, 16);
+  size_t differ = 0;
+  for (size_t i = 0; i < image.pixels().size(); ++i) {
+    differ += image.pixels()[i] != expected.pixels()[i];
+  }
+  EXPECT_LT(differ * 1000, image.pixels().size());
+
+  // a tree whose root's second child points back at its first
+  {
+    std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
+    std::uint32_t second = 1;
+    f.seekp(32 + 48);
+    f.write(reinterpret_cast<const char*>(&second), sizeof(second));
+  }
+  EXPECT_THROW(rayson::chunked_geometry(path, shading), rayson::read_exception);
+  rayson::write_chunked(s, path, 256);
+
+  shading.emplace_material(rayson::material("extra", 1.0, rayson::color(1, 1, 1)));
+  EXPECT_THROW(rayson::chunked_geometry(path, shading), rayson::read_exception);
+  std::ofstream(path) << "RAYSONCK";
+  EXPECT_THROW(rayson::chunked_geometry(path, s), rayson::read_exception);
+  std::remove(path.c_str());
+}
+
+// A scene with one object placed by each of to_world, and the same scene
+// with every placement flattened into world-space primitives.
+static std::pair<rayson::scene, rayson::scene> make_instanced_scenes(const std::vector<rayson::transform>& to_world,
+                                                                       double scale) {
+  using rayson::vector3;
+  auto empty = [] {
+    rayson::scene s(rayson::camera(vector3(0, 0, -8), vector3(0, 1, 0), vector3(0, 0, 1)),
+                    rayson::viewport(48, 48, -1, 1, 1, -1),
+                    rayson::persp_projection(1.0),
+                    rayson::phong_shader(.1, .5, .25, rayson::color(1, 1, 1)),
+                    rayson::color(0, 0, 0));
+    s.emplace_material(rayson::material("a", 4, rayson::color(1, 0, 0)));
+    s.emplace_material(rayson::material("b", 8, rayson::color(0, 1, 0)));
+    s.emplace_point_light(rayson::point_light(vector3(0, 10, -10), rayson::color(1, 1, 1), 1));
+    return s;
+  };
+  auto instanced = empty(), flat = empty();
+
+  rayson::object o("thing");
+  o.emplace_sphere(rayson::sphere(&instanced.materials()[0], vector3(0, 0, 0), .5));
+  o.emplace_triangle(rayson::triangle(&instanced.materials()[1],
+                                      vector3(-1, -1, .5), vector3(1, -1, .5), vector3(0, 1, 1)));
+  instanced.emplace_object(std::move(o));
+  for (auto& t : to_world) {
+    instanced.emplace_instance(rayson::instance(&instanced.objects()[0], t));
+    flat.emplace_sphere(rayson::sphere(&flat.materials()[0], t.point(vector3(0, 0, 0)), .5 * scale));
+    flat.emplace_triangle(rayson::triangle(&flat.materials()[1],
+                                           t.point(vector3(-1, -1, .5)),
+                                           t.point(vector3(1, -1, .5)),
+                                           t.point(vector3(0, 1, 1))));
+  }
+  return {std::move(instanced), std::move(flat)};
+}
+
+TEST(instance, Transform) {
+  using rayson::vector3;
+  auto rotate = rayson::transform({0, -1, 0, 0,
+                                   1,  0, 0, 0,
+                                   0,  0, 1, 0});
+  auto t = rayson::transform::scaling(2).then(rotate).then(rayson::transform::translation(vector3(1, 2, 3)));
+  EXPECT_EQ(vector3(1, 4, 3), t.point(vector3(1, 0, 0)));
+  EXPECT_EQ(vector3(0, 2, 0), t.direction(vector3(1, 0, 0)));
+  EXPECT_DOUBLE_EQ(8, t.determinant());
+  auto back = t.inverse();
+  auto p = back.point(t.point(vector3(.25, -3, 7)));
+  EXPECT_NEAR(.25, p.x(), 1e-12);
+  EXPECT_NEAR(-3, p.y(), 1e-12);
+  EXPECT_NEAR(7, p.z(), 1e-12);
+  EXPECT_EQ(rayson::transform(), rayson::transform::translation(vector3(1, 2, 3)).then(
+                                   rayson::transform::translation(vector3(-1, -2, -3))));
+}
+
+TEST(instance, ReadJson) {
+  auto j = nlohmann::json::parse(R"({
+    "camera_eye" : [0, 0, -5], "camera_up" : [0, 1, 0], "camera_view" : [0, 0, 1],
+    "x_resolution" : 8, "y_resolution" : 8,
+    "viewport_left" : -1.0, "viewport_top" : 1.0, "viewport_right" : 1.0, "viewport_bottom" : -1.0,
+    "background" : [0.0, 0.0, 0.0], "ortho_projection" : true, "flat_shader" : true,
+    "materials" : [
+      { "name" : "red", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 },
+      { "name" : "blue", "color" : [0.0, 0.0, 1.0], "shininess" : 4.0 }
+    ],
+    "objects" : [
+      { "name" : "ball", "spheres" : [ { "material" : "red", "center" : [0.0, 0.0, 0.0], "radius" : 0.5 } ] }
+    ],
+    "instances" : [
+      { "object" : "ball" },
+      { "object" : "ball", "material" : "blue",
+        "transform" : [[1, 0, 0, 2], [0, 1, 0, 0], [0, 0, 1, 0]] }
+    ]
+  })");
+  auto s = rayson::read_json(j);
+  ASSERT_EQ(1, s.objects().size());
+  ASSERT_EQ(2, s.instances().size());
+  EXPECT_TRUE(s.spheres().empty());
+  EXPECT_EQ("ball", s.instances()[0].object().name());
+  EXPECT_EQ(rayson::transform(), s.instances()[0].to_world());
+  EXPECT_FALSE(s.instances()[0].has_material());
+  EXPECT_EQ("blue", s.instances()[1].material().name());
+  EXPECT_EQ(rayson::vector3(2, 0, 0), s.instances()[1].to_world().point(rayson::vector3(0, 0, 0)));
+
+  rayson::bvh tree(s);
+  auto h = tree.intersect(rayson::ray(rayson::vector3(2, 0, -5), rayson::vector3(0, 0, 1)));
+  ASSERT_TRUE(h);
+  EXPECT_EQ(rayson::primitive_kind::instance, h->kind());
+  EXPECT_EQ(1, h->index());
+  EXPECT_EQ(1, h->material_index());
+  EXPECT_DOUBLE_EQ(4.5, h->t());
+  h = tree.intersect(rayson::ray(rayson::vector3(0, 0, -5), rayson::vector3(0, 0, 1)));
+  ASSERT_TRUE(h);
+  EXPECT_EQ(0, h->material_index());
+
+  // copies point at their own objects and materials
+  auto copy = std::make_unique<rayson::scene>(s);
+  EXPECT_EQ(&copy->objects()[0], &copy->instances()[1].object());
+  EXPECT_EQ(&copy->materials()[1], &copy->instances()[1].material());
+  EXPECT_EQ(&copy->materials()[0], &copy->objects()[0].spheres()[0].material());
+
+  auto bad = j;
+  bad["instances"][0]["object"] = "cube";
+  EXPECT_THROW(rayson::read_json(bad), rayson::read_exception);
+  bad = j;
+  bad["instances"][1]["transform"] = {{1, 0, 0, 0}, {1, 0, 0, 0}, {0, 0, 1, 0}};
+  EXPECT_THROW(rayson::read_json(bad), rayson::read_exception);
+  bad = j;
+  bad["instances"][1]["transform"] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+  EXPECT_THROW(rayson::read_json(bad), rayson::read_exception);
+  bad = j;
+  bad["objects"][0].erase("spheres");
+  EXPECT_THROW(rayson::read_json(bad), rayson::read_exception);
+}
+
+TEST(instance, MatchesFlattenedScene) {
+  using rayson::vector3;
+  auto rotate = rayson::transform({0, 0, 1, 0,
+                                   0, 1, 0, 0,
+                                  -1, 0, 0, 0});
+  std::vector<rayson::transform> placements;
+  for (int i = 0; i < 5; ++i) {
+    for (int j = 0; j < 5; ++j) {
+      placements.push_back(rayson::transform::scaling(.8)
+                             .then(rotate)
+                             .then(rayson::transform::translation(vector3(i * 2.37 - 5.1, j * 2.41 - 4.9, i + j + .3))));
+    }
+  }
+  auto [instanced, flat] = make_instanced_scenes(placements, .8);
+  rayson::bvh instanced_tree(instanced), flat_tree(flat);
+  EXPECT_EQ(placements.size(), instanced_tree.primitive_count());
+  EXPECT_TRUE(instanced_tree.matches(instanced));
+
+  rayson::ray_generator eye(instanced);
+  size_t hits = 0;
+  for (unsigned y = 0; y < 48; ++y) {
+    for (unsigned x = 0; x < 48; x += 8) {
+      auto rays = eye.tile<8>(x, y, 8);
+      auto packet = instanced_tree.intersect(rays);
+      auto occluded = instanced_tree.occluded(rays, 0, 25);
+      for (size_t lane = 0; lane < 8; ++lane) {
+        auto a = instanced_tree.intersect(rays[lane]), b = flat_tree.intersect(rays[lane]);
+        ASSERT_EQ(bool(a), bool(b));
+        ASSERT_EQ(bool(a), bool(packet[lane]));
+        EXPECT_EQ(flat_tree.occluded(rays[lane], 0, 25), occluded[lane]);
+        if (!a) {
+          continue;
+        }
+        ++hits;
+        EXPECT_NEAR(b->t(), a->t(), 1e-9);
+        EXPECT_EQ(a->t(), packet[lane]->t());
+        EXPECT_EQ(b->material_index(), a->material_index());
+        EXPECT_NEAR(1.0, a->normal().dot(b->normal()), 1e-9);
+      }
+    }
+  }
+  EXPECT_GT(hits, 100);
+
+  auto instanced_image = rayson::render(instanced), flat_image = rayson::render(flat);
+  for (size_t i = 0; i < flat_image.pixels().size(); ++i) {
+    EXPECT_NEAR(flat_image.pixels()[i].r(), instanced_image.pixels()[i].r(), 1e-6);
+    EXPECT_NEAR(flat_image.pixels()[i].g(), instanced_image.pixels()[i].g(), 1e-6);
+  }
+
+  // moving an instance only needs a refit
+  auto before = instanced;
+  instanced.instances()[0].set_transform(rayson::transform::translation(vector3(0, 0, -3)));
+  EXPECT_FALSE(instanced_tree.matches(instanced));
+  rayson::scene_diff diff(before, instanced);
+  EXPECT_EQ(std::vector<size_t>{0}, diff.instances().changed());
+  EXPECT_FALSE(diff.topology_changed());
+  EXPECT_FALSE(rayson::hash(before).same_geometry(rayson::hash(instanced)));
+  instanced_tree.refit(instanced);
+  EXPECT_TRUE(instanced_tree.matches(instanced));
+  auto h = instanced_tree.intersect(rayson::ray(vector3(0, 0, -20), vector3(0, 0, 1)));
+  ASSERT_TRUE(h);
+  EXPECT_EQ(0, h->index());
+  EXPECT_NEAR(16.5, h->t(), 1e-9);
+}
+
+TEST(instance, Forest) {
+  auto teapot = rayson::read_file("teatime.json");
+  rayson::object o("teapot");
+  for (auto& tri : teapot.triangles()) {
+    o.emplace_triangle(rayson::triangle(tri));
+  }
+  teapot.emplace_object(std::move(o));
+  teapot.triangles().clear();
+  teapot.spheres().clear();
+  for (int i = 0; i < 100; ++i) {
+    for (int j = 0; j < 100; ++j) {
+      teapot.emplace_instance(rayson::instance(&teapot.objects()[0],
+        rayson::transform::translation(rayson::vector3(i * 10.0, 0, j * 10.0))));
+    }
+  }
+  rayson::bvh tree(teapot);
+  EXPECT_EQ(10000, tree.primitive_count());
+  EXPECT_LT(tree.node_count(), 2 * 10000);
+  auto center = tree.bounds().centroid();
+  auto h = tree.intersect(rayson::ray(rayson::vector3(center.x(), center.y() + 1000, center.z()),
+                                      rayson::vector3(0, -1, 0)));
+  EXPECT_TRUE(h);
+}
+
+TEST(mesh, ReadObj) {
+  // teatime's triangles, with enough lines to be parsed in several chunks
+  auto teapot = rayson::read_file("teatime.json");
+  const std::string path = "/tmp/rayson-test-teapot.obj";
+  {
+    std::ofstream f(path);
+    f.precision(17);
+    f << "# teapot\no teapot\n";
+    for (size_t i = 0; i < teapot.triangles().size(); ++i) {
+      auto& t = teapot.triangles()[i];
+      for (auto& v : { t.a(), t.b(), t.c() }) {
+        f << "v " << v.x() << " " << v.y() << " " << v.z() << "\n";
+      }
+      if (i % 2 == 0) {
+        f << "f -3/1/1 -2/2/2 -1/3/3\n";
+      } else {
+        f << "f " << 3 * i + 1 << " " << 3 * i + 2 << "\t" << 3 * i + 3 << "\r\n";
+      }
+    }
+  }
+  auto m = rayson::read_obj(path);
+  ASSERT_EQ(teapot.triangles().size(), m.triangles().size());
+  EXPECT_EQ(3 * teapot.triangles().size(), m.vertices().size());
+  for (size_t i = 0; i < m.triangles().size(); ++i) {
+    auto& t = teapot.triangles()[i];
+    ASSERT_EQ(t.a(), m.vertices()[m.triangles()[i][0]]);
+    ASSERT_EQ(t.b(), m.vertices()[m.triangles()[i][1]]);
+    ASSERT_EQ(t.c(), m.vertices()[m.triangles()[i][2]]);
+  }
+
+  // referenced from a scene, relative to the scene file
+  auto j = nlohmann::json::parse(R"({
+    "camera_eye" : [0, 0, -5], "camera_up" : [0, 1, 0], "camera_view" : [0, 0, 1],
+    "x_resolution" : 8, "y_resolution" : 8,
+    "viewport_left" : -1.0, "viewport_top" : 1.0, "viewport_right" : 1.0, "viewport_bottom" : -1.0,
+    "background" : [0.0, 0.0, 0.0], "ortho_projection" : true, "flat_shader" : true,
+    "materials" : [ { "name" : "red", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 } ],
+    "meshes" : [ { "path" : "rayson-test-teapot.obj", "material" : "red" } ]
+  })");
+  std::ofstream("/tmp/rayson-test-meshes.json") << j;
+  auto s = rayson::read_file("/tmp/rayson-test-meshes.json");
+  EXPECT_EQ(teapot.triangles().size(), s.triangles().size());
+  EXPECT_EQ(teapot.triangles().back().c(), s.triangles().back().c());
+  EXPECT_EQ("red", s.triangles()[0].material().name());
+
+  // a quad becomes a fan of two triangles
+  std::ofstream(path) << "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nvn 0 0 1\nf 1 2 3 4\n";
+  m = rayson::read_obj(path);
+  ASSERT_EQ(2, m.triangles().size());
+  EXPECT_EQ((rayson::mesh::index_triangle{0, 2, 3}), m.triangles()[1]);
+
+  std::ofstream(path) << "v 0 0 0\nv 1 0 0\nf 1 2 3\n";
+  EXPECT_THROW(rayson::read_obj(path), rayson::read_exception);
+  std::ofstream(path) << "v 0 0\nv 1 0 0\n";
+  EXPECT_THROW(rayson::read_obj(path), rayson::read_exception);
+  EXPECT_THROW(rayson::read_obj("/tmp/nonexistent.obj"), rayson::read_exception);
+  std::remove(path.c_str());
+  std::remove("/tmp/rayson-test-meshes.json");
+}
+
+TEST(mesh, ReadPly) {
+  const std::string path = "/tmp/rayson-test-quad.ply";
+  for (auto [little, eol] : { std::make_pair(true, "\n"), std::make_pair(false, "\n"), std::make_pair(true, "\r\n") }) {
+    std::ofstream f(path, std::ios::binary);
+    f << "ply" << eol
+      << "format " << (little ? "binary_little_endian" : "binary_big_endian") << " 1.0" << eol
+      << "comment a unit quad" << eol
+      << "element vertex 4" << eol
+      << "property float x" << eol << "property float y" << eol << "property float z" << eol
+      << "property uchar red" << eol
+      << "element face 1" << eol
+      << "property list uchar int vertex_indices" << eol
+      << "property short flags" << eol
+      << "end_header" << eol;
+    auto put = [&](const void* data, size_t size) {
+      auto bytes = static_cast<const unsigned char*>(data);
+      // the test host is little-endian
+      for (size_t i = 0; i < size; ++i) {
+        f.put(static_cast<char>(bytes[little ? i : size - 1 - i]));
+      }
+    };
+    const float xyz[4][3] = { {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, -0.5f} };
+    for (auto& v : xyz) {
+      for (float c : v) {
+        put(&c, sizeof(c));
+      }
+      unsigned char red = 255;
+      put(&red, 1);
+    }
+    unsigned char count = 4;
+    put(&count, 1);
+    for (std::int32_t i : { 0, 1, 2, 3 }) {
+      put(&i, sizeof(i));
+    }
+    std::int16_t flags = -1;
+    put(&flags, sizeof(flags));
+    f.close();
+
+    auto m = rayson::read_mesh(path);
+    ASSERT_EQ(4, m.vertices().size());
+    EXPECT_EQ(rayson::vector3(0, 1, -0.5), m.vertices()[3]);
+    ASSERT_EQ(2, m.triangles().size());
+    EXPECT_EQ((rayson::mesh::index_triangle{0, 1, 2}), m.triangles()[0]);
+    EXPECT_EQ((rayson::mesh::index_triangle{0, 2, 3}), m.triangles()[1]);
+  }
+
+  std::ofstream(path) << "ply\nformat ascii 1.0\nelement vertex 0\nend_header\n";
+  EXPECT_THROW(rayson::read_ply(path), rayson::read_exception);
+  std::ofstream(path) << "ply\nformat binary_little_endian 1.0\nelement vertex 1\n"
+                         "property float x\nproperty float y\nproperty float z\nend_header\n";
+  EXPECT_THROW(rayson::read_ply(path), rayson::read_exception);
+  // a corrupt count fails as a read, not as an allocation
+  std::ofstream(path) << "ply\nformat binary_little_endian 1.0\nelement vertex 18446744073709551615\n"
+                         "property float x\nproperty float y\nproperty float z\nend_header\n";
+  EXPECT_THROW(rayson::read_ply(path), rayson::read_exception);
+  std::ofstream(path) << "ply\nformat binary_little_endian 1.0\nelement face 4000000000000000000\n"
+                         "property list uchar int vertex_indices\nend_header\n";
+  EXPECT_THROW(rayson::read_ply(path), rayson::read_exception);
+  std::remove(path.c_str());
+}
+
+TEST(mesh, ReadGlb) {
+  // a unit quad indexed by ushorts, with a material, and an unindexed
+  // triangle without one, sharing an interleaved position buffer
+  std::string bin;
+  auto put = [&](const void* data, size_t size) {
+    bin.append(static_cast<const char*>(data), size);
+  };
+  const float xyz[7][3] = { {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, -0.5f},
+                            {0, 0, 2}, {1, 0, 2}, {0, 1, 2} };
+  for (auto& v : xyz) {
+    put(v, sizeof(v));
+    std::uint32_t padding = 0;
+    put(&padding, sizeof(padding));
+  }
+  for (std::uint16_t i : { 0, 1, 2, 0, 2, 3 }) {
+    put(&i, sizeof(i));
+  }
+  auto gltf = nlohmann::json::parse(R"({
+    "asset" : { "version" : "2.0" },
+    "buffers" : [ { "byteLength" : 124 } ],
+    "bufferViews" : [ { "buffer" : 0, "byteOffset" : 0, "byteLength" : 112, "byteStride" : 16 },
+                      { "buffer" : 0, "byteOffset" : 112, "byteLength" : 12 } ],
+    "accessors" : [ { "bufferView" : 0, "componentType" : 5126, "count" : 4, "type" : "VEC3" },
+                    { "bufferView" : 0, "byteOffset" : 64, "componentType" : 5126, "count" : 3, "type" : "VEC3" },
+                    { "bufferView" : 1, "componentType" : 5123, "count" : 6, "type" : "SCALAR" } ],
+    "materials" : [ { "name" : "green",
+                      "pbrMetallicRoughness" : { "baseColorFactor" : [0, 1, 0, 1], "roughnessFactor" : 0 } } ],
+    "meshes" : [ { "primitives" : [ { "attributes" : { "POSITION" : 0 }, "indices" : 2, "material" : 0 },
+                                    { "attributes" : { "POSITION" : 1 } } ] } ]
+  })");
+  auto write = [&](const std::string& path, const nlohmann::json& j) {
+    auto text = j.dump();
+    text.resize((text.size() + 3) & ~size_t(3), ' ');
+    std::ofstream f(path, std::ios::binary);
+    auto u32 = [&](std::uint32_t x) { f.write(reinterpret_cast<const char*>(&x), sizeof(x)); };
+    u32(0x46546C67);
+    u32(2);
+    u32(static_cast<std::uint32_t>(12 + 8 + text.size() + 8 + bin.size()));
+    u32(static_cast<std::uint32_t>(text.size()));
+    u32(0x4E4F534A);
+    f << text;
+    u32(static_cast<std::uint32_t>(bin.size()));
+    u32(0x004E4942);
+    f << bin;
+  };
+  const std::string path = "/tmp/rayson-test-quad.glb";
+  write(path, gltf);
+
+  rayson::glb_file file(path);
+  ASSERT_EQ(2, file.primitives().size());
+  ASSERT_EQ(1, file.materials().size());
+  EXPECT_EQ("green", file.materials()[0].name());
+  EXPECT_EQ(rayson::color(0, 1, 0), file.materials()[0].color());
+  auto& quad = file.primitives()[0];
+  EXPECT_EQ(2, quad.triangle_count());
+  EXPECT_EQ(rayson::vector3(0, 1, -0.5), quad.vertex(3));
+  EXPECT_EQ((rayson::mesh::index_triangle{0, 2, 3}), quad.triangle(1));
+  EXPECT_EQ(0, *quad.material());
+  EXPECT_FALSE(file.primitives()[1].material());
+
+  auto m = rayson::read_mesh(path);
+  ASSERT_EQ(7, m.vertices().size());
+  ASSERT_EQ(3, m.triangles().size());
+  EXPECT_EQ((rayson::mesh::index_triangle{4, 5, 6}), m.triangles()[2]);
+  EXPECT_EQ(rayson::vector3(0, 1, 2), m.vertices()[6]);
+
+  // referenced from a scene, glTF materials are added to the scene's, and
+  // a "material" overrides them
+  auto j = nlohmann::json::parse(R"({
+    "camera_eye" : [0, 0, -5], "camera_up" : [0, 1, 0], "camera_view" : [0, 0, 1],
+    "x_resolution" : 8, "y_resolution" : 8,
+    "viewport_left" : -1.0, "viewport_top" : 1.0, "viewport_right" : 1.0, "viewport_bottom" : -1.0,
+    "background" : [0.0, 0.0, 0.0], "ortho_projection" : true, "flat_shader" : true,
+    "materials" : [ { "name" : "red", "color" : [1.0, 0.0, 0.0], "shininess" : 4.0 } ],
+    "meshes" : [ { "path" : "rayson-test-quad.glb", "material" : "red" } ],
+    "objects" : [ { "name" : "quad", "meshes" : [ { "path" : "rayson-test-quad.glb" } ] } ]
+  })");
+  EXPECT_THROW(rayson::read_json(j, "/tmp/"), rayson::read_exception);
+  gltf["meshes"][0]["primitives"][1]["material"] = 0;
+  write(path, gltf);
+  auto s = rayson::read_json(j, "/tmp/");
+  ASSERT_EQ(2, s.materials().size());
+  EXPECT_EQ("rayson-test-quad.glb#green", s.materials()[1].name());
+  ASSERT_EQ(3, s.triangles().size());
+  EXPECT_EQ("red", s.triangles()[0].material().name());
+  auto& o = s.objects()[0];
+  ASSERT_EQ(3, o.triangles().size());
+  EXPECT_EQ(&s.materials()[1], &o.triangles()[2].material());
+  EXPECT_EQ(rayson::vector3(0, 1, 2), o.triangles()[2].c());
+
+  gltf["accessors"][2]["count"] = 7;
+  write(path, gltf);
+  EXPECT_THROW(rayson::glb_file{path}, rayson::read_exception);
+  // sizes chosen so that the sums and products of a naive bounds check wrap
+  // around to something in bounds
+  {
+    auto malformed = gltf;
+    malformed["accessors"][2]["count"] = 6;
+    malformed["bufferViews"][0]["byteOffset"] = std::numeric_limits<std::uint64_t>::max() - 7;
+    write(path, malformed);
+    EXPECT_THROW(rayson::glb_file{path}, rayson::read_exception);
+    malformed = gltf;
+    malformed["accessors"][2]["count"] = 6;
+    malformed["accessors"][0]["count"] = (std::uint64_t(1) << 60) + 1;
+    write(path, malformed);
+    EXPECT_THROW(rayson::glb_file{path}, rayson::read_exception);
+    malformed["accessors"][0]["count"] = 4;
+    malformed["accessors"][0]["byteOffset"] = std::numeric_limits<std::uint64_t>::max() - 3;
+    write(path, malformed);
+    EXPECT_THROW(rayson::glb_file{path}, rayson::read_exception);
+    malformed["accessors"][0]["byteOffset"] = 0;
+    malformed["bufferViews"][0]["byteStride"] = 0;
+    write(path, malformed);
+    EXPECT_THROW(rayson::glb_file{path}, rayson::read_exception);
+  }
+  std::ofstream(path) << "glTF";
+  EXPECT_THROW(rayson::read_glb(path), rayson::read_exception);
+  EXPECT_THROW(rayson::read_glb("/tmp/nonexistent.glb"), rayson::read_exception);
+  std::remove(path.c_str());
+}
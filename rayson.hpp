@@ -3,12 +3,37 @@
 // rayson.hpp
 ///////////////////////////////////////////////////////////////////////////////
 
+#pragma once
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <cctype>
+#include <filesystem>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
+#include <list>
 #include <optional>
+#include <sstream>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -17,6 +42,19 @@
 
 #include <nlohmann/json.hpp>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 namespace rayson {
 
   class vector3 {
@@ -48,6 +86,40 @@ namespace rayson {
     constexpr bool operator!=(const vector3& rhs) const noexcept {
       return !(*this == rhs);
     }
+
+    constexpr vector3 operator+(const vector3& rhs) const noexcept {
+      return vector3(x_ + rhs.x_, y_ + rhs.y_, z_ + rhs.z_);
+    }
+    constexpr vector3 operator-(const vector3& rhs) const noexcept {
+      return vector3(x_ - rhs.x_, y_ - rhs.y_, z_ - rhs.z_);
+    }
+    constexpr vector3 operator-() const noexcept {
+      return vector3(-x_, -y_, -z_);
+    }
+    constexpr vector3 operator*(double s) const noexcept {
+      return vector3(x_ * s, y_ * s, z_ * s);
+    }
+
+    constexpr double operator[](unsigned axis) const noexcept {
+      return (axis == 0) ? x_ : ((axis == 1) ? y_ : z_);
+    }
+
+    constexpr double dot(const vector3& rhs) const noexcept {
+      return x_*rhs.x_ + y_*rhs.y_ + z_*rhs.z_;
+    }
+    constexpr vector3 cross(const vector3& rhs) const noexcept {
+      return vector3(y_*rhs.z_ - z_*rhs.y_,
+                     z_*rhs.x_ - x_*rhs.z_,
+                     x_*rhs.y_ - y_*rhs.x_);
+    }
+
+    double magnitude() const noexcept { return std::sqrt(dot(*this)); }
+
+    vector3 normalized() const noexcept {
+      auto m = magnitude();
+      assert(m > 0.0);
+      return *this * (1.0 / m);
+    }
   };
 
   class color {
@@ -69,6 +141,13 @@ namespace rayson {
     constexpr double r() const noexcept { return r_; }
     constexpr double g() const noexcept { return g_; }
     constexpr double b() const noexcept { return b_; }
+
+    constexpr bool operator==(const color& rhs) const noexcept {
+      return (r_ == rhs.r_) && (g_ == rhs.g_) && (b_ == rhs.b_);
+    }
+    constexpr bool operator!=(const color& rhs) const noexcept {
+      return !(*this == rhs);
+    }
   };
 
   class camera {
@@ -87,6 +166,13 @@ namespace rayson {
     constexpr const vector3& eye () const noexcept { return eye_   ; }
     constexpr const vector3& up  () const noexcept { return up_    ; }
     constexpr const vector3& view() const noexcept { return view_  ; }
+
+    constexpr bool operator==(const camera& rhs) const noexcept {
+      return (eye_ == rhs.eye_) && (up_ == rhs.up_) && (view_ == rhs.view_);
+    }
+    constexpr bool operator!=(const camera& rhs) const noexcept {
+      return !(*this == rhs);
+    }
   };
 
   class viewport {
@@ -128,10 +214,22 @@ namespace rayson {
     constexpr double top   () const noexcept { return top_   ; }
     constexpr double right () const noexcept { return right_ ; }
     constexpr double bottom() const noexcept { return bottom_; }
+
+    constexpr bool operator==(const viewport& rhs) const noexcept {
+      return (x_resolution_ == rhs.x_resolution_) && (y_resolution_ == rhs.y_resolution_) &&
+             (left_ == rhs.left_) && (top_ == rhs.top_) &&
+             (right_ == rhs.right_) && (bottom_ == rhs.bottom_);
+    }
+    constexpr bool operator!=(const viewport& rhs) const noexcept {
+      return !(*this == rhs);
+    }
   };
 
   class ortho_projection {
+  public:
 
+    constexpr bool operator==(const ortho_projection&) const noexcept { return true; }
+    constexpr bool operator!=(const ortho_projection&) const noexcept { return false; }
   };
 
   class persp_projection {
@@ -146,12 +244,22 @@ namespace rayson {
     }
 
     constexpr double focal_length() const noexcept { return focal_length_; }
+
+    constexpr bool operator==(const persp_projection& rhs) const noexcept {
+      return focal_length_ == rhs.focal_length_;
+    }
+    constexpr bool operator!=(const persp_projection& rhs) const noexcept {
+      return !(*this == rhs);
+    }
   };
 
   using projection = std::variant<ortho_projection, persp_projection>;
 
   class flat_shader {
+  public:
 
+    constexpr bool operator==(const flat_shader&) const noexcept { return true; }
+    constexpr bool operator!=(const flat_shader&) const noexcept { return false; }
   };
 
   class phong_shader {
@@ -160,7 +268,7 @@ namespace rayson {
     color ambient_color_;
 
   public:
-    phong_shader(
+    constexpr phong_shader(
       double ambient_coeff,
       double diffuse_coeff,
       double specular_coeff,
@@ -180,6 +288,16 @@ namespace rayson {
     constexpr double specular_coeff() const noexcept { return specular_coeff_; }
 
     constexpr const color& ambient_color() const noexcept { return ambient_color_; }
+
+    constexpr bool operator==(const phong_shader& rhs) const noexcept {
+      return (ambient_coeff_ == rhs.ambient_coeff_) &&
+             (diffuse_coeff_ == rhs.diffuse_coeff_) &&
+             (specular_coeff_ == rhs.specular_coeff_) &&
+             (ambient_color_ == rhs.ambient_color_);
+    }
+    constexpr bool operator!=(const phong_shader& rhs) const noexcept {
+      return !(*this == rhs);
+    }
   };
 
   using shader = std::variant<flat_shader, phong_shader>;
@@ -213,6 +331,13 @@ namespace rayson {
     constexpr const std::string& name() const noexcept { return name_; }
     constexpr double shininess() const noexcept { return shininess_; }
     constexpr const color& color() const noexcept { return color_; }
+
+    bool operator==(const material& rhs) const noexcept {
+      return (name_ == rhs.name_) && (shininess_ == rhs.shininess_) && (color_ == rhs.color_);
+    }
+    bool operator!=(const material& rhs) const noexcept {
+      return !(*this == rhs);
+    }
   };
 
   class point_light {
@@ -235,6 +360,13 @@ namespace rayson {
     constexpr const vector3& location() const noexcept { return location_; }
     constexpr const color& color() const noexcept { return color_; }
     constexpr double intensity() const noexcept { return intensity_; }
+
+    constexpr bool operator==(const point_light& rhs) const noexcept {
+      return (location_ == rhs.location_) && (color_ == rhs.color_) && (intensity_ == rhs.intensity_);
+    }
+    constexpr bool operator!=(const point_light& rhs) const noexcept {
+      return !(*this == rhs);
+    }
   };
 
   class sphere {
@@ -258,6 +390,18 @@ namespace rayson {
     constexpr const material& material() const noexcept { return *material_; }
     constexpr const vector3& center() const noexcept { return center_; }
     constexpr double radius() const noexcept { return radius_; }
+
+    void set_material(const rayson::material* material) noexcept {
+      assert(material != nullptr);
+      material_ = material;
+    }
+
+    void set_center(const vector3& center) noexcept { center_ = center; }
+
+    void set_radius(double radius) noexcept {
+      assert(radius > 0.0);
+      radius_ = radius;
+    }
   };
 
   class triangle {
@@ -282,6 +426,195 @@ namespace rayson {
     constexpr const vector3& a() const noexcept { return a_; }
     constexpr const vector3& b() const noexcept { return b_; }
     constexpr const vector3& c() const noexcept { return c_; }
+
+    void set_material(const rayson::material* material) noexcept {
+      assert(material != nullptr);
+      material_ = material;
+    }
+
+    void set_vertices(const vector3& a, const vector3& b, const vector3& c) noexcept {
+      assert(a != b);
+      assert(a != c);
+      assert(b != c);
+      a_ = a;
+      b_ = b;
+      c_ = c;
+    }
+  };
+
+  // An affine transformation, stored as the top three rows of a 4x4
+  // matrix, so that a point (x, y, z) maps to the rows times (x, y, z, 1).
+  class transform {
+  private:
+    // row-major
+    std::array<double, 12> m_;
+
+  public:
+
+    // the identity
+    constexpr transform() noexcept
+    : m_{1, 0, 0, 0,
+         0, 1, 0, 0,
+         0, 0, 1, 0} { }
+
+    constexpr explicit transform(const std::array<double, 12>& rows) noexcept
+    : m_(rows) { }
+
+    static constexpr transform translation(const vector3& offset) noexcept {
+      return transform({1, 0, 0, offset.x(),
+                        0, 1, 0, offset.y(),
+                        0, 0, 1, offset.z()});
+    }
+
+    static constexpr transform scaling(double factor) noexcept {
+      return transform({factor, 0, 0, 0,
+                        0, factor, 0, 0,
+                        0, 0, factor, 0});
+    }
+
+    constexpr double operator()(unsigned row, unsigned column) const noexcept {
+      assert((row < 3) && (column < 4));
+      return m_[row * 4 + column];
+    }
+
+    constexpr vector3 point(const vector3& p) const noexcept {
+      return direction(p) + vector3(m_[3], m_[7], m_[11]);
+    }
+
+    constexpr vector3 direction(const vector3& d) const noexcept {
+      return vector3(m_[0] * d.x() + m_[1] * d.y() + m_[2]  * d.z(),
+                     m_[4] * d.x() + m_[5] * d.y() + m_[6]  * d.z(),
+                     m_[8] * d.x() + m_[9] * d.y() + m_[10] * d.z());
+    }
+
+    // d times the linear part, which maps normals back through the inverse
+    // of this transformation.
+    constexpr vector3 transposed_direction(const vector3& d) const noexcept {
+      return vector3(m_[0] * d.x() + m_[4] * d.y() + m_[8]  * d.z(),
+                     m_[1] * d.x() + m_[5] * d.y() + m_[9]  * d.z(),
+                     m_[2] * d.x() + m_[6] * d.y() + m_[10] * d.z());
+    }
+
+    constexpr double determinant() const noexcept {
+      return m_[0] * (m_[5] * m_[10] - m_[6] * m_[9]) -
+             m_[1] * (m_[4] * m_[10] - m_[6] * m_[8]) +
+             m_[2] * (m_[4] * m_[9]  - m_[5] * m_[8]);
+    }
+
+    // this transformation followed by next
+    constexpr transform then(const transform& next) const noexcept {
+      auto x = next.direction(vector3(m_[0], m_[4], m_[8])),
+           y = next.direction(vector3(m_[1], m_[5], m_[9])),
+           z = next.direction(vector3(m_[2], m_[6], m_[10])),
+           t = next.point(vector3(m_[3], m_[7], m_[11]));
+      return transform({x.x(), y.x(), z.x(), t.x(),
+                        x.y(), y.y(), z.y(), t.y(),
+                        x.z(), y.z(), z.z(), t.z()});
+    }
+
+    transform inverse() const noexcept {
+      double det = determinant();
+      assert(det != 0.0);
+      double s = 1.0 / det;
+      std::array<double, 12> r{
+        (m_[5] * m_[10] - m_[6] * m_[9]) * s,
+        (m_[2] * m_[9]  - m_[1] * m_[10]) * s,
+        (m_[1] * m_[6]  - m_[2] * m_[5]) * s,
+        0,
+        (m_[6] * m_[8]  - m_[4] * m_[10]) * s,
+        (m_[0] * m_[10] - m_[2] * m_[8]) * s,
+        (m_[2] * m_[4]  - m_[0] * m_[6]) * s,
+        0,
+        (m_[4] * m_[9]  - m_[5] * m_[8]) * s,
+        (m_[1] * m_[8]  - m_[0] * m_[9]) * s,
+        (m_[0] * m_[5]  - m_[1] * m_[4]) * s,
+        0};
+      transform linear(r);
+      auto t = linear.direction(vector3(m_[3], m_[7], m_[11]));
+      r[3] = -t.x();
+      r[7] = -t.y();
+      r[11] = -t.z();
+      return transform(r);
+    }
+
+    constexpr bool operator==(const transform& rhs) const noexcept {
+      for (size_t i = 0; i < m_.size(); ++i) {
+        if (m_[i] != rhs.m_[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+    constexpr bool operator!=(const transform& rhs) const noexcept {
+      return !(*this == rhs);
+    }
+  };
+
+  // A named group of spheres and triangles in their own coordinate space,
+  // placed into a scene any number of times by instances. Its primitives'
+  // materials belong to the scene.
+  class object {
+  private:
+    std::string name_;
+    std::vector<sphere> spheres_;
+    std::vector<triangle> triangles_;
+
+  public:
+
+    explicit object(const std::string& name)
+    : name_(name) { }
+
+    constexpr const std::string& name() const noexcept { return name_; }
+
+    constexpr const std::vector<sphere>&   spheres  () const noexcept { return spheres_;   }
+    constexpr const std::vector<triangle>& triangles() const noexcept { return triangles_; }
+    constexpr std::vector<sphere>&   spheres  () noexcept { return spheres_;   }
+    constexpr std::vector<triangle>& triangles() noexcept { return triangles_; }
+
+    void emplace_sphere  (sphere&&   x) noexcept { spheres_  .emplace_back(x); }
+    void emplace_triangle(triangle&& x) noexcept { triangles_.emplace_back(x); }
+  };
+
+  // One placement of an object in a scene, transformed from object to
+  // world space, and optionally drawn in a single material instead of its
+  // primitives' own.
+  class instance {
+  private:
+    const rayson::object* object_;
+    transform to_world_, to_object_;
+    // nullptr for no override
+    const rayson::material* material_;
+
+  public:
+
+    instance(const rayson::object* object,
+             const transform& to_world,
+             const rayson::material* material = nullptr) noexcept
+    : object_(object), to_world_(to_world), to_object_(to_world.inverse()), material_(material) {
+      assert(object != nullptr);
+    }
+
+    constexpr const rayson::object& object() const noexcept { return *object_; }
+    constexpr const transform& to_world() const noexcept { return to_world_; }
+    constexpr const transform& to_object() const noexcept { return to_object_; }
+
+    constexpr bool has_material() const noexcept { return material_ != nullptr; }
+    constexpr const rayson::material& material() const noexcept {
+      assert(has_material());
+      return *material_;
+    }
+
+    void set_object(const rayson::object* object) noexcept {
+      assert(object != nullptr);
+      object_ = object;
+    }
+
+    void set_material(const rayson::material* material) noexcept { material_ = material; }
+
+    void set_transform(const transform& to_world) noexcept {
+      to_world_ = to_world;
+      to_object_ = to_world.inverse();
+    }
   };
 
   class scene {
@@ -291,6 +624,8 @@ namespace rayson {
     using point_light_container = std::vector<point_light>;
     using sphere_container = std::vector<sphere>;
     using triangle_container = std::vector<triangle>;
+    using object_container = std::vector<object>;
+    using instance_container = std::vector<instance>;
 
   private:
     camera camera_;
@@ -302,6 +637,41 @@ namespace rayson {
     point_light_container point_lights_;
     sphere_container spheres_;
     triangle_container triangles_;
+    object_container objects_;
+    instance_container instances_;
+
+    // Points each primitive and instance at the material and object in
+    // this scene with the same index that its own has in from.
+    void rebind(const scene& from) noexcept {
+      auto index_of = [&](const material& m) {
+        auto index = static_cast<size_t>(&m - from.materials_.data());
+        assert(index < materials_.size());
+        return index;
+      };
+      auto rebind_primitive = [&](auto& primitive) {
+        primitive.set_material(&materials_[index_of(primitive.material())]);
+      };
+      for (auto& sph : spheres_) {
+        rebind_primitive(sph);
+      }
+      for (auto& tri : triangles_) {
+        rebind_primitive(tri);
+      }
+      for (auto& o : objects_) {
+        for (auto& sph : o.spheres()) {
+          rebind_primitive(sph);
+        }
+        for (auto& tri : o.triangles()) {
+          rebind_primitive(tri);
+        }
+      }
+      for (auto& inst : instances_) {
+        inst.set_object(&objects_[static_cast<size_t>(&inst.object() - from.objects_.data())]);
+        if (inst.has_material()) {
+          inst.set_material(&materials_[index_of(inst.material())]);
+        }
+      }
+    }
 
   public:
 
@@ -318,6 +688,30 @@ namespace rayson {
       shader_(shader),
       background_(background) { }
 
+    // Copies refer to their own materials and objects, not to other's.
+    scene(const scene& other)
+    : camera_(other.camera_),
+      viewport_(other.viewport_),
+      projection_(other.projection_),
+      shader_(other.shader_),
+      background_(other.background_),
+      materials_(other.materials_),
+      point_lights_(other.point_lights_),
+      spheres_(other.spheres_),
+      triangles_(other.triangles_),
+      objects_(other.objects_),
+      instances_(other.instances_) {
+      rebind(other);
+    }
+
+    scene(scene&&) noexcept = default;
+
+    scene& operator=(const scene& other) {
+      return *this = scene(other);
+    }
+
+    scene& operator=(scene&&) noexcept = default;
+
     constexpr const camera&     camera    () const noexcept { return camera_;     }
     constexpr const viewport&   viewport  () const noexcept { return viewport_;   }
     constexpr const projection& projection() const noexcept { return projection_; }
@@ -328,11 +722,33 @@ namespace rayson {
     constexpr const material_container&    materials   () const noexcept { return materials_;    }
     constexpr const sphere_container&      spheres     () const noexcept { return spheres_;      }
     constexpr const triangle_container&    triangles   () const noexcept { return triangles_;    }
+    constexpr const object_container&      objects     () const noexcept { return objects_;      }
+    constexpr const instance_container&    instances   () const noexcept { return instances_;    }
+
+    // Mutable geometry, for animating primitives between frames. Moving
+    // primitives invalidates the bounds of any bvh built over this scene
+    // until bvh::refit or bvh::update is called.
+    constexpr sphere_container&   spheres  () noexcept { return spheres_;   }
+    constexpr triangle_container& triangles() noexcept { return triangles_; }
+    constexpr instance_container& instances() noexcept { return instances_; }
+
+    // Mutable shading, for variants of one scene. Replacing a material
+    // keeps its address, so primitives that use it see the replacement.
+    constexpr point_light_container& point_lights() noexcept { return point_lights_; }
+
+    void set_shader(const rayson::shader& x) noexcept { shader_ = x; }
+
+    void set_material(size_t index, const rayson::material& x) {
+      assert(index < materials_.size());
+      materials_[index] = x;
+    }
 
     void emplace_point_light (point_light&& x) noexcept { point_lights_.emplace_back(x); }
     void emplace_material    (material&&    x) noexcept { materials_   .emplace_back(x); }
     void emplace_sphere      (sphere&&      x) noexcept { spheres_     .emplace_back(x); }
     void emplace_triangle    (triangle&&    x) noexcept { triangles_   .emplace_back(x); }
+    void emplace_object      (object&&      x) noexcept { objects_     .emplace_back(x); }
+    void emplace_instance    (instance&&    x) noexcept { instances_   .emplace_back(x); }
   };
 
   // An error encountered while trying to read and parse a scene file.
@@ -351,87 +767,1062 @@ namespace rayson {
     constexpr const std::string& message() const noexcept { return message_; }
   };
 
-  scene read_json(const nlohmann::json& j) {
+  // An error encountered while trying to write an image or scene.
+  class write_exception {
+  private:
+    std::string message_;
+
+  public:
 
-    if (!j.is_object()) {
-      throw read_exception("rayson must be comprised of one JSON object");
+    write_exception(const std::string& message)
+    : message_(message) { }
+
+    write_exception(std::string&& message)
+    : message_(message) { }
+
+    constexpr const std::string& message() const noexcept { return message_; }
+  };
+
+  class ray {
+  private:
+    vector3 origin_, direction_;
+
+  public:
+
+    constexpr ray() noexcept { }
+
+    // direction need not be normalized; hit distances are in units of
+    // its length.
+    constexpr ray(const vector3& origin, const vector3& direction) noexcept
+    : origin_(origin), direction_(direction) { }
+
+    constexpr const vector3& origin   () const noexcept { return origin_   ; }
+    constexpr const vector3& direction() const noexcept { return direction_; }
+
+    constexpr vector3 at(double t) const noexcept { return origin_ + direction_ * t; }
+  };
+
+  // Axis-aligned bounding box.
+  class aabb {
+  private:
+    vector3 min_, max_;
+
+  public:
+
+    // An empty box that contains nothing.
+    constexpr aabb() noexcept
+    : min_( std::numeric_limits<double>::infinity(),
+            std::numeric_limits<double>::infinity(),
+            std::numeric_limits<double>::infinity()),
+      max_(-std::numeric_limits<double>::infinity(),
+           -std::numeric_limits<double>::infinity(),
+           -std::numeric_limits<double>::infinity()) { }
+
+    constexpr aabb(const vector3& min, const vector3& max) noexcept
+    : min_(min), max_(max) { }
+
+    constexpr const vector3& min() const noexcept { return min_; }
+    constexpr const vector3& max() const noexcept { return max_; }
+
+    constexpr bool empty() const noexcept {
+      return (min_.x() > max_.x()) || (min_.y() > max_.y()) || (min_.z() > max_.z());
     }
 
-    auto has = [](auto& j_obj, const std::string& key) noexcept {
-      return j_obj.find(key) != j_obj.end();
-    };
+    constexpr vector3 centroid() const noexcept { return (min_ + max_) * 0.5; }
 
-    auto check_has_key = [&](auto& j_obj, const std::string& key) {
-      if (!has(j_obj, key)) {
-        throw read_exception("missing key \"" + key + "\"");
+    constexpr double surface_area() const noexcept {
+      if (empty()) {
+        return 0.0;
       }
-    };
+      auto d = max_ - min_;
+      return 2.0 * (d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+    }
 
-    auto get_bool = [&](auto& j_obj, const std::string& key) {
-      check_has_key(j_obj, key);
-      if (!j_obj[key].is_boolean()) {
-        throw read_exception("key \"" + key + "\" must be a bool");
-      }
-      return j_obj[key].template get<bool>();
-    };
+    constexpr aabb merged(const vector3& p) const noexcept {
+      return aabb(vector3(std::min(min_.x(), p.x()), std::min(min_.y(), p.y()), std::min(min_.z(), p.z())),
+                  vector3(std::max(max_.x(), p.x()), std::max(max_.y(), p.y()), std::max(max_.z(), p.z())));
+    }
 
-    auto get_double = [&](auto& j_obj, const std::string& key) {
-      check_has_key(j_obj, key);
-      if (!j_obj[key].is_number_float()) {
-        throw read_exception("key \"" + key + "\" must be a float");
-      }
-      return j_obj[key].template get<double>();
-    };
+    constexpr aabb merged(const aabb& other) const noexcept {
+      return other.empty() ? *this : merged(other.min_).merged(other.max_);
+    }
 
-    auto get_string = [&](auto& j_obj, const std::string& key) {
-      check_has_key(j_obj, key);
-      if (!j_obj[key].is_string()) {
-        throw read_exception("key \"" + key + "\" must be a string");
-      }
-      return j_obj[key].template get<std::string>();
-    };
+    constexpr bool contains(const vector3& p) const noexcept {
+      return (p.x() >= min_.x()) && (p.x() <= max_.x()) &&
+             (p.y() >= min_.y()) && (p.y() <= max_.y()) &&
+             (p.z() >= min_.z()) && (p.z() <= max_.z());
+    }
 
-    auto get_positive_unsigned = [&](auto& j_obj, const std::string& key) {
-      check_has_key(j_obj, key);
-      if (!j_obj[key].is_number_integer()) {
-        throw read_exception("key \"" + key + "\" must be an integer");
-      }
-      int x = j_obj[key].template get<int>();
-      if (x <= 0) {
-        throw read_exception("key \"" + key + "\" must be positive");
+    constexpr bool overlaps(const aabb& other) const noexcept {
+      return (min_.x() <= other.max_.x()) && (max_.x() >= other.min_.x()) &&
+             (min_.y() <= other.max_.y()) && (max_.y() >= other.min_.y()) &&
+             (min_.z() <= other.max_.z()) && (max_.z() >= other.min_.z());
+    }
+
+    // Slab test. Returns the distance at which r enters this box, clamped
+    // to t_min, or infinity when r misses the box within [t_min, t_max].
+    // inverse_direction holds the reciprocals of r's direction components.
+    double entry(const ray& r,
+                 const vector3& inverse_direction,
+                 double t_min,
+                 double t_max) const noexcept {
+      for (unsigned axis = 0; axis < 3; ++axis) {
+        double t0 = (min_[axis] - r.origin()[axis]) * inverse_direction[axis],
+               t1 = (max_[axis] - r.origin()[axis]) * inverse_direction[axis];
+        if (t0 > t1) {
+          std::swap(t0, t1);
+        }
+        t_min = (t0 > t_min) ? t0 : t_min;
+        t_max = (t1 < t_max) ? t1 : t_max;
+        if (t_min > t_max) {
+          return std::numeric_limits<double>::infinity();
+        }
       }
-      return static_cast<unsigned>(x);
-    };
+      return t_min;
+    }
 
-    auto get_vector3 = [&](auto& j_obj, const std::string& key) {
-      check_has_key(j_obj, key);
-      auto& a = j_obj.at(key);
-      if (!a.is_array()) {
-        throw read_exception("expected " + key + " to be an array");
+    bool intersects(const ray& r, double t_min, double t_max) const noexcept {
+      vector3 inverse(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+      return entry(r, inverse, t_min, t_max) != std::numeric_limits<double>::infinity();
+    }
+  };
+
+  aabb bounds(const sphere& s) noexcept {
+    vector3 extent(s.radius(), s.radius(), s.radius());
+    return aabb(s.center() - extent, s.center() + extent);
+  }
+
+  aabb bounds(const triangle& t) noexcept {
+    return aabb().merged(t.a()).merged(t.b()).merged(t.c());
+  }
+
+  // Bounds of box after transforming it by to.
+  aabb transformed(const aabb& box, const transform& to) noexcept {
+    if (box.empty()) {
+      return box;
+    }
+    aabb result;
+    for (unsigned corner = 0; corner < 8; ++corner) {
+      result = result.merged(to.point(vector3((corner & 1) ? box.max().x() : box.min().x(),
+                                              (corner & 2) ? box.max().y() : box.min().y(),
+                                              (corner & 4) ? box.max().z() : box.min().z())));
+    }
+    return result;
+  }
+
+  namespace detail {
+
+    // Calls f(begin, end) on contiguous chunks of [0, n), one chunk per
+    // hardware thread, and waits for them all. Ranges shorter than
+    // min_chunk run entirely on the calling thread. If f throws, every
+    // chunk still finishes, and then the exception of the first chunk
+    // that threw is rethrown on the calling thread.
+    template <typename Function>
+    void parallel_for(size_t n, size_t min_chunk, Function f) {
+      size_t threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+      threads = std::min(threads, std::max<size_t>(1, n / std::max<size_t>(1, min_chunk)));
+      if (threads <= 1) {
+        f(size_t(0), n);
+        return;
       }
-      if (a.size() != 3) {
-        throw read_exception("expected array " + key + " to have 3 elements, but found " +
-                             std::to_string(j_obj.size()) + " elements");
+      size_t chunk = (n + threads - 1) / threads;
+      std::vector<std::exception_ptr> errors((n + chunk - 1) / chunk);
+      auto run = [&](size_t part) {
+        try {
+          f(part * chunk, std::min(n, (part + 1) * chunk));
+        } catch (...) {
+          errors[part] = std::current_exception();
+        }
+      };
+      std::vector<std::thread> workers;
+      for (size_t part = 1; part < errors.size(); ++part) {
+        try {
+          workers.emplace_back(run, part);
+        } catch (std::system_error&) {
+          // out of threads: run the chunk here instead
+          run(part);
+        }
       }
-      try {
-        return vector3(a.at(0).template get<double>(),
-                       a.at(1).template get<double>(),
-                       a.at(2).template get<double>());
-      } catch (std::exception& e) {
-        throw read_exception("vector3 must contain numbers");
+      run(0);
+      for (auto& w : workers) {
+        w.join();
       }
-    };
-
-    auto get_positive_double = [&](auto& j_obj, const std::string& key) {
-      double x = get_double(j_obj, key);
-      if (x <= 0.0) {
-        throw read_exception(std::string("key \"") + key + "\" must be positive");
+      for (auto& e : errors) {
+        if (e) {
+          std::rethrow_exception(e);
+        }
       }
-      return x;
-    };
+    }
+  }
 
-    auto get_negative_double = [&](auto& j_obj, const std::string& key) {
-      double x = get_double(j_obj, key);
+  // An indexed triangle mesh, as read from a mesh file.
+  class mesh {
+  public:
+
+    using index_triangle = std::array<std::uint32_t, 3>;
+
+  private:
+    std::vector<vector3> vertices_;
+    std::vector<index_triangle> triangles_;
+
+  public:
+
+    mesh() noexcept { }
+
+    // Every index in triangles must be less than vertices.size().
+    mesh(std::vector<vector3>&& vertices, std::vector<index_triangle>&& triangles) noexcept
+    : vertices_(std::move(vertices)), triangles_(std::move(triangles)) { }
+
+    const std::vector<vector3>&        vertices () const noexcept { return vertices_;  }
+    const std::vector<index_triangle>& triangles() const noexcept { return triangles_; }
+  };
+
+  namespace detail {
+
+    // The contents of the file at path. Throws read_exception.
+    std::string read_bytes(const std::string& path) {
+      std::ifstream f(path, std::ios::binary);
+      if (!f) {
+        throw read_exception("could not open \"" + path + "\"");
+      }
+      return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    }
+
+    // The vertices and faces of one chunk of an OBJ file's lines.
+    struct obj_chunk {
+      std::vector<vector3> vertices;
+      // three per triangle: a one-based index, or, for relative, an offset
+      // from the chunk's first vertex
+      std::vector<std::int64_t> corners;
+      std::vector<bool> relative;
+      std::string error;
+    };
+
+    // Parses the complete lines in [begin, end) of an OBJ file. text must
+    // be null-terminated.
+    void parse_obj_lines(const char* begin, const char* end, obj_chunk& chunk) {
+      auto is_space = [](char c) { return (c == ' ') || (c == '\t') || (c == '\r'); };
+      std::vector<std::pair<std::int64_t, bool>> polygon;
+      for (auto line = begin; line < end; ) {
+        auto line_end = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (line_end == nullptr) {
+          line_end = end;
+        }
+        auto p = line;
+        while ((p < line_end) && is_space(*p)) {
+          ++p;
+        }
+        if ((line_end - p >= 2) && (p[0] == 'v') && is_space(p[1])) {
+          double xyz[3];
+          p += 2;
+          for (auto& x : xyz) {
+            char* parsed;
+            x = std::strtod(p, &parsed);
+            if ((parsed == p) || (parsed > line_end)) {
+              chunk.error = "OBJ vertex must have three coordinates";
+              return;
+            }
+            p = parsed;
+          }
+          chunk.vertices.emplace_back(xyz[0], xyz[1], xyz[2]);
+        } else if ((line_end - p >= 2) && (p[0] == 'f') && is_space(p[1])) {
+          polygon.clear();
+          p += 2;
+          for (;;) {
+            while ((p < line_end) && is_space(*p)) {
+              ++p;
+            }
+            if (p >= line_end) {
+              break;
+            }
+            char* parsed;
+            auto index = std::strtoll(p, &parsed, 10);
+            if ((parsed == p) || (parsed > line_end) || (index == 0)) {
+              chunk.error = "OBJ face has an invalid vertex index";
+              return;
+            }
+            if (index < 0) {
+              polygon.emplace_back(static_cast<std::int64_t>(chunk.vertices.size()) + index, true);
+            } else {
+              polygon.emplace_back(index, false);
+            }
+            // skip texture and normal indices
+            p = parsed;
+            while ((p < line_end) && !is_space(*p)) {
+              ++p;
+            }
+          }
+          if (polygon.size() < 3) {
+            chunk.error = "OBJ face must have at least three vertices";
+            return;
+          }
+          // triangulate as a fan
+          for (size_t i = 1; i + 1 < polygon.size(); ++i) {
+            for (auto& corner : { polygon[0], polygon[i], polygon[i + 1] }) {
+              chunk.corners.push_back(corner.first);
+              chunk.relative.push_back(corner.second);
+            }
+          }
+        }
+        line = line_end + 1;
+      }
+    }
+  }
+
+  // Reads the vertices and faces of the Wavefront OBJ file at path; other
+  // statements are ignored, and polygons are split into triangle fans.
+  // Lines are parsed in parallel chunks. Throws read_exception.
+  mesh read_obj(const std::string& path) {
+    auto text = detail::read_bytes(path);
+
+    // split at line boundaries into chunks of at least 64 KiB
+    const size_t min_chunk = 1 << 16;
+    size_t wanted = std::max<size_t>(1, std::min<size_t>(4 * std::max(1u, std::thread::hardware_concurrency()),
+                                                         text.size() / min_chunk));
+    std::vector<size_t> starts{0};
+    for (size_t i = 1; i < wanted; ++i) {
+      auto newline = text.find('\n', std::max(starts.back(), text.size() * i / wanted));
+      if (newline == std::string::npos) {
+        break;
+      }
+      starts.push_back(newline + 1);
+    }
+    starts.push_back(text.size());
+
+    std::vector<detail::obj_chunk> chunks(starts.size() - 1);
+    detail::parallel_for(chunks.size(), 1, [&](size_t begin, size_t end) {
+      for (auto c = begin; c < end; ++c) {
+        detail::parse_obj_lines(text.data() + starts[c], text.data() + starts[c + 1], chunks[c]);
+      }
+    });
+
+    size_t vertex_count = 0, corner_count = 0;
+    for (auto& chunk : chunks) {
+      if (!chunk.error.empty()) {
+        throw read_exception(chunk.error + " in \"" + path + "\"");
+      }
+      vertex_count += chunk.vertices.size();
+      corner_count += chunk.corners.size();
+    }
+
+    std::vector<vector3> vertices;
+    std::vector<mesh::index_triangle> triangles(corner_count / 3);
+    vertices.reserve(vertex_count);
+    size_t corner = 0;
+    for (auto& chunk : chunks) {
+      auto offset = static_cast<std::int64_t>(vertices.size());
+      vertices.insert(vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+      for (size_t i = 0; i < chunk.corners.size(); ++i, ++corner) {
+        auto index = chunk.relative[i] ? offset + chunk.corners[i] : chunk.corners[i] - 1;
+        if ((index < 0) || (index >= static_cast<std::int64_t>(vertex_count))) {
+          throw read_exception("OBJ face references an undefined vertex in \"" + path + "\"");
+        }
+        triangles[corner / 3][corner % 3] = static_cast<std::uint32_t>(index);
+      }
+    }
+    return mesh(std::move(vertices), std::move(triangles));
+  }
+
+  // Reads the vertex positions and faces of the binary PLY file at path
+  // straight from its bytes; other elements and properties are skipped,
+  // and polygons are split into triangle fans. Throws read_exception.
+  mesh read_ply(const std::string& path) {
+    auto bytes = detail::read_bytes(path);
+    auto fail = [&](const std::string& message) {
+      return read_exception(message + " in \"" + path + "\"");
+    };
+
+    struct property {
+      std::string name;
+      // byte sizes, with list_size 0 for scalar properties
+      unsigned size, list_size;
+      bool is_float, is_signed, list_is_signed;
+    };
+    struct element {
+      std::string name;
+      size_t count;
+      std::vector<property> properties;
+    };
+
+    // sets size, is_float, and is_signed for a PLY type name
+    auto parse_type = [&](const std::string& type, unsigned& size, bool& is_float, bool& is_signed) {
+      is_float = (type == "float") || (type == "float32") || (type == "double") || (type == "float64");
+      is_signed = (type[0] != 'u');
+      if ((type == "char") || (type == "uchar") || (type == "int8") || (type == "uint8")) {
+        size = 1;
+      } else if ((type == "short") || (type == "ushort") || (type == "int16") || (type == "uint16")) {
+        size = 2;
+      } else if ((type == "int") || (type == "uint") || (type == "int32") || (type == "uint32") ||
+                 (type == "float") || (type == "float32")) {
+        size = 4;
+      } else if ((type == "double") || (type == "float64")) {
+        size = 8;
+      } else {
+        throw fail("unknown PLY property type \"" + type + "\"");
+      }
+    };
+
+    // header, whose lines may end with LF or CRLF
+    auto header_end = bytes.find("\nend_header");
+    size_t body_start = std::string::npos;
+    if (header_end != std::string::npos) {
+      auto after = header_end + std::strlen("\nend_header");
+      if (bytes.compare(after, 1, "\n") == 0) {
+        body_start = after + 1;
+      } else if (bytes.compare(after, 2, "\r\n") == 0) {
+        body_start = after + 2;
+      }
+    }
+    if (((bytes.compare(0, 4, "ply\n") != 0) && (bytes.compare(0, 5, "ply\r\n") != 0)) ||
+        (body_start == std::string::npos)) {
+      throw fail("missing PLY header");
+    }
+    std::istringstream header(bytes.substr(0, header_end));
+    std::vector<element> elements;
+    bool little_endian = true;
+    for (std::string line; std::getline(header, line); ) {
+      std::istringstream words(line);
+      std::string keyword;
+      words >> keyword;
+      if (keyword == "format") {
+        std::string format;
+        words >> format;
+        if (format == "binary_little_endian") {
+          little_endian = true;
+        } else if (format == "binary_big_endian") {
+          little_endian = false;
+        } else {
+          throw fail("unsupported PLY format \"" + format + "\"");
+        }
+      } else if (keyword == "element") {
+        element e;
+        words >> e.name >> e.count;
+        elements.push_back(e);
+      } else if (keyword == "property") {
+        if (elements.empty()) {
+          throw fail("PLY property outside of an element");
+        }
+        std::string type;
+        words >> type;
+        property p{"", 0, 0, false, false, false};
+        if (type == "list") {
+          std::string count_type;
+          bool count_is_float;
+          words >> count_type >> type;
+          parse_type(count_type, p.list_size, count_is_float, p.list_is_signed);
+          if (count_is_float) {
+            throw fail("PLY list lengths must be integers");
+          }
+        }
+        parse_type(type, p.size, p.is_float, p.is_signed);
+        words >> p.name;
+        elements.back().properties.push_back(p);
+      }
+    }
+
+    // body, decoded byte by byte in the file's byte order
+    const char* p = bytes.data() + body_start;
+    const char* end = bytes.data() + bytes.size();
+    auto skip = [&](size_t size) {
+      if (static_cast<size_t>(end - p) < size) {
+        throw fail("truncated PLY data");
+      }
+      p += size;
+    };
+    auto read_bits = [&](unsigned size) {
+      auto start = p;
+      skip(size);
+      std::uint64_t bits = 0;
+      for (unsigned i = 0; i < size; ++i) {
+        auto byte = static_cast<unsigned char>(start[little_endian ? i : size - 1 - i]);
+        bits |= std::uint64_t(byte) << (8 * i);
+      }
+      return bits;
+    };
+    auto read_integer = [&](unsigned size, bool is_signed) {
+      auto bits = read_bits(size);
+      if (is_signed && (size < 8) && ((bits >> (8 * size - 1)) & 1)) {
+        bits |= ~std::uint64_t(0) << (8 * size);
+      }
+      return static_cast<std::int64_t>(bits);
+    };
+    auto read_number = [&](const property& prop) {
+      if (!prop.is_float) {
+        return static_cast<double>(read_integer(prop.size, prop.is_signed));
+      }
+      auto bits = read_bits(prop.size);
+      if (prop.size == 4) {
+        auto bits32 = static_cast<std::uint32_t>(bits);
+        float x;
+        std::memcpy(&x, &bits32, sizeof(x));
+        return double(x);
+      }
+      double x;
+      std::memcpy(&x, &bits, sizeof(x));
+      return x;
+    };
+
+    std::vector<vector3> vertices;
+    std::vector<mesh::index_triangle> triangles;
+    std::vector<std::int64_t> polygon;
+    for (auto& e : elements) {
+      int x = -1, y = -1, z = -1, indices = -1;
+      for (int i = 0; i < static_cast<int>(e.properties.size()); ++i) {
+        auto& name = e.properties[i].name;
+        if (e.name == "vertex") {
+          x = (name == "x") ? i : x;
+          y = (name == "y") ? i : y;
+          z = (name == "z") ? i : z;
+        } else if ((e.name == "face") && ((name == "vertex_indices") || (name == "vertex_index"))) {
+          indices = i;
+        }
+      }
+      if ((e.name == "vertex") && ((x < 0) || (y < 0) || (z < 0))) {
+        throw fail("PLY vertices must have x, y, and z properties");
+      }
+      if ((e.name == "face") && ((indices < 0) || (e.properties[indices].list_size == 0))) {
+        throw fail("PLY faces must have a vertex_indices list");
+      }
+      // the header's count is not trusted beyond what the remaining bytes
+      // could hold, at the least bytes per record
+      size_t record_size = 0;
+      for (auto& prop : e.properties) {
+        record_size += (prop.list_size > 0) ? prop.list_size : prop.size;
+      }
+      auto capacity = std::min(e.count, static_cast<size_t>(end - p) / std::max<size_t>(1, record_size));
+      if (e.name == "vertex") {
+        vertices.reserve(capacity);
+      } else if (e.name == "face") {
+        triangles.reserve(capacity);
+      }
+
+      for (size_t record = 0; (record < e.count) && !e.properties.empty(); ++record) {
+        double xyz[3] = {0, 0, 0};
+        for (int i = 0; i < static_cast<int>(e.properties.size()); ++i) {
+          auto& prop = e.properties[i];
+          if (prop.list_size > 0) {
+            auto count = read_integer(prop.list_size, prop.list_is_signed);
+            if (count < 0) {
+              throw fail("negative PLY list length");
+            }
+            if (i == indices) {
+              polygon.clear();
+              for (std::int64_t k = 0; k < count; ++k) {
+                polygon.push_back(static_cast<std::int64_t>(read_number(prop)));
+              }
+              for (auto index : polygon) {
+                if ((index < 0) || (index > std::numeric_limits<std::uint32_t>::max())) {
+                  throw fail("PLY face references an undefined vertex");
+                }
+              }
+              for (size_t k = 1; k + 1 < polygon.size(); ++k) {
+                triangles.push_back({static_cast<std::uint32_t>(polygon[0]),
+                                     static_cast<std::uint32_t>(polygon[k]),
+                                     static_cast<std::uint32_t>(polygon[k + 1])});
+              }
+            } else {
+              if (static_cast<std::uint64_t>(count) > static_cast<size_t>(end - p) / prop.size) {
+                throw fail("truncated PLY data");
+              }
+              skip(static_cast<size_t>(count) * prop.size);
+            }
+          } else if ((i == x) || (i == y) || (i == z)) {
+            xyz[(i == x) ? 0 : ((i == y) ? 1 : 2)] = read_number(prop);
+          } else {
+            skip(prop.size);
+          }
+        }
+        if (e.name == "vertex") {
+          vertices.emplace_back(xyz[0], xyz[1], xyz[2]);
+        }
+      }
+    }
+
+    for (auto& t : triangles) {
+      for (auto index : t) {
+        if (index >= vertices.size()) {
+          throw fail("PLY face references an undefined vertex");
+        }
+      }
+    }
+    return mesh(std::move(vertices), std::move(triangles));
+  }
+
+  // A read-only memory mapping of a whole file. Where mmap is unavailable,
+  // the file is read into memory instead.
+  class mapped_file {
+  private:
+    const unsigned char* data_;
+    size_t size_;
+#if defined(__unix__) || defined(__APPLE__)
+    bool mapped_;
+#endif
+    std::string copy_;
+
+  public:
+
+    // Throws read_exception.
+    explicit mapped_file(const std::string& path)
+    : data_(nullptr), size_(0) {
+#if defined(__unix__) || defined(__APPLE__)
+      mapped_ = false;
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        throw read_exception("could not open \"" + path + "\"");
+      }
+      struct stat status;
+      if (fstat(fd, &status) != 0) {
+        close(fd);
+        throw read_exception("could not open \"" + path + "\"");
+      }
+      size_ = static_cast<size_t>(status.st_size);
+      if (size_ > 0) {
+        void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+          close(fd);
+          throw read_exception("could not map \"" + path + "\"");
+        }
+        data_ = static_cast<const unsigned char*>(p);
+        mapped_ = true;
+      }
+      close(fd);
+#else
+      copy_ = detail::read_bytes(path);
+      data_ = reinterpret_cast<const unsigned char*>(copy_.data());
+      size_ = copy_.size();
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+#if defined(__unix__) || defined(__APPLE__)
+      if (mapped_) {
+        munmap(const_cast<unsigned char*>(data_), size_);
+      }
+#endif
+    }
+
+    const unsigned char* data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+  };
+
+  // The triangle meshes and materials of a binary glTF 2.0 (.glb) file.
+  // The file stays memory-mapped, and each primitive's positions and
+  // indices are views into its binary chunk, so nothing is copied until
+  // triangles are made from them. Meshes are in their own coordinates;
+  // node transforms are not applied.
+  class glb_file {
+  public:
+
+    // One triangle-list primitive of a glTF mesh.
+    class primitive {
+    private:
+      const unsigned char* positions_;
+      size_t vertex_count_, position_stride_;
+      // nullptr for non-indexed primitives
+      const unsigned char* indices_;
+      size_t index_count_, index_size_;
+      std::optional<size_t> material_;
+
+      size_t index(size_t i) const noexcept {
+        if (indices_ == nullptr) {
+          return i;
+        }
+        std::uint32_t x = 0;
+        // glTF data is little-endian, as are the hosts we build for
+        std::memcpy(&x, indices_ + i * index_size_, index_size_);
+        return x;
+      }
+
+    public:
+
+      primitive(const unsigned char* positions,
+                size_t vertex_count,
+                size_t position_stride,
+                const unsigned char* indices,
+                size_t index_count,
+                size_t index_size,
+                std::optional<size_t> material) noexcept
+      : positions_(positions),
+        vertex_count_(vertex_count),
+        position_stride_(position_stride),
+        indices_(indices),
+        index_count_(index_count),
+        index_size_(index_size),
+        material_(material) { }
+
+      size_t vertex_count() const noexcept { return vertex_count_; }
+
+      vector3 vertex(size_t i) const noexcept {
+        assert(i < vertex_count_);
+        float xyz[3];
+        std::memcpy(xyz, positions_ + i * position_stride_, sizeof(xyz));
+        return vector3(xyz[0], xyz[1], xyz[2]);
+      }
+
+      size_t triangle_count() const noexcept {
+        return ((indices_ == nullptr) ? vertex_count_ : index_count_) / 3;
+      }
+
+      mesh::index_triangle triangle(size_t i) const noexcept {
+        assert(i < triangle_count());
+        return {static_cast<std::uint32_t>(index(3 * i)),
+                static_cast<std::uint32_t>(index(3 * i + 1)),
+                static_cast<std::uint32_t>(index(3 * i + 2))};
+      }
+
+      // index into glb_file::materials(), if the primitive has a material
+      const std::optional<size_t>& material() const noexcept { return material_; }
+    };
+
+  private:
+    mapped_file file_;
+    std::vector<primitive> primitives_;
+    std::vector<rayson::material> materials_;
+
+  public:
+
+    // Throws read_exception.
+    explicit glb_file(const std::string& path)
+    : file_(path) {
+      auto fail = [&](const std::string& message) {
+        return read_exception(message + " in \"" + path + "\"");
+      };
+      auto data = file_.data();
+      auto size = file_.size();
+      auto u32 = [&](size_t offset) {
+        std::uint32_t x;
+        std::memcpy(&x, data + offset, sizeof(x));
+        return x;
+      };
+
+      if ((size < 20) || (u32(0) != 0x46546C67) || (u32(4) != 2)) {
+        throw fail("not a binary glTF 2.0 file");
+      }
+      size_t json_length = u32(12);
+      if ((u32(16) != 0x4E4F534A) || (json_length > size - 20)) {
+        throw fail("missing glTF JSON chunk");
+      }
+      const unsigned char* bin = nullptr;
+      size_t bin_length = 0;
+      size_t bin_offset = 20 + ((json_length + 3) & ~size_t(3));
+      if ((bin_offset + 8 <= size) && (u32(bin_offset + 4) == 0x004E4942)) {
+        bin_length = u32(bin_offset);
+        if (bin_length > size - bin_offset - 8) {
+          throw fail("truncated glTF BIN chunk");
+        }
+        bin = data + bin_offset + 8;
+      }
+
+      nlohmann::json j;
+      try {
+        j = nlohmann::json::parse(data + 20, data + 20 + json_length);
+      } catch (nlohmann::json::exception& e) {
+        throw fail("glTF JSON parse error");
+      }
+
+      try {
+        if (j.contains("materials")) {
+          for (auto& m : j["materials"]) {
+            std::array<double, 4> base{1, 1, 1, 1};
+            double roughness = 1.0;
+            if (m.contains("pbrMetallicRoughness")) {
+              auto& pbr = m["pbrMetallicRoughness"];
+              if (pbr.contains("baseColorFactor")) {
+                base = pbr["baseColorFactor"].get<std::array<double, 4>>();
+              }
+              roughness = pbr.value("roughnessFactor", 1.0);
+            }
+            auto clamp = [](double x) { return std::min(1.0, std::max(0.0, x)); };
+            // smoother surfaces get sharper highlights
+            materials_.emplace_back(m.value("name", std::string("material") + std::to_string(materials_.size())),
+                                    1.0 + 127.0 * (1.0 - clamp(roughness)),
+                                    color(clamp(base[0]), clamp(base[1]), clamp(base[2])));
+          }
+        }
+
+        // a view of accessor's elements in the BIN chunk
+        auto view = [&](size_t accessor, unsigned expected_size, const unsigned char*& start, size_t& count, size_t& stride) {
+          auto& a = j.at("accessors").at(accessor);
+          count = a.at("count").get<size_t>();
+          auto& v = j.at("bufferViews").at(a.at("bufferView").get<size_t>());
+          if (v.value("buffer", 0) != 0 || (bin == nullptr)) {
+            throw fail("glTF accessors must use the BIN chunk");
+          }
+          stride = v.value("byteStride", size_t(expected_size));
+          if (stride < expected_size) {
+            throw fail("glTF buffer view stride is smaller than its elements");
+          }
+          size_t view_offset = v.value("byteOffset", size_t(0)),
+                 length = v.at("byteLength").get<size_t>(),
+                 offset = a.value("byteOffset", size_t(0));
+          // every bound is checked against what remains, since the
+          // untrusted sizes could overflow a sum or product
+          if ((view_offset > bin_length) || (length > bin_length - view_offset) ||
+              ((count > 0) && ((expected_size > length) || (offset > length - expected_size) ||
+                               (count - 1 > (length - expected_size - offset) / stride)))) {
+            throw fail("glTF accessor is out of bounds");
+          }
+          start = bin + view_offset + offset;
+        };
+
+        if (j.contains("meshes")) {
+          for (auto& m : j["meshes"]) {
+            for (auto& p : m.at("primitives")) {
+              if (p.value("mode", 4) != 4) {
+                continue;
+              }
+              auto& position = j.at("accessors").at(p.at("attributes").at("POSITION").get<size_t>());
+              if ((position.at("componentType").get<int>() != 5126) || (position.at("type") != "VEC3")) {
+                throw fail("glTF positions must be float VEC3");
+              }
+              const unsigned char* positions;
+              size_t vertex_count, stride;
+              view(p.at("attributes").at("POSITION").get<size_t>(), 12, positions, vertex_count, stride);
+
+              const unsigned char* indices = nullptr;
+              size_t index_count = 0, index_size = 0, index_stride;
+              if (p.contains("indices")) {
+                auto& a = j.at("accessors").at(p["indices"].get<size_t>());
+                int type = a.at("componentType").get<int>();
+                index_size = (type == 5121) ? 1 : ((type == 5123) ? 2 : ((type == 5125) ? 4 : 0));
+                if (index_size == 0) {
+                  throw fail("glTF indices must be unsigned integers");
+                }
+                view(p["indices"].get<size_t>(), static_cast<unsigned>(index_size), indices, index_count, index_stride);
+                if (index_stride != index_size) {
+                  throw fail("glTF indices must be tightly packed");
+                }
+              }
+
+              std::optional<size_t> material;
+              if (p.contains("material")) {
+                material = p["material"].get<size_t>();
+                if (*material >= materials_.size()) {
+                  throw fail("glTF primitive references an undefined material");
+                }
+              }
+              primitive prim(positions, vertex_count, stride, indices, index_count, index_size, material);
+              for (size_t t = 0; t < prim.triangle_count(); ++t) {
+                for (auto i : prim.triangle(t)) {
+                  if (i >= vertex_count) {
+                    throw fail("glTF index is out of range");
+                  }
+                }
+              }
+              primitives_.push_back(prim);
+            }
+          }
+        }
+      } catch (nlohmann::json::exception& e) {
+        throw fail(std::string("invalid glTF: ") + e.what());
+      }
+    }
+
+    const std::vector<primitive>& primitives() const noexcept { return primitives_; }
+    const std::vector<rayson::material>& materials() const noexcept { return materials_; }
+  };
+
+  // The triangles of every primitive in the glTF binary file at path, as
+  // one mesh. A mesh owns its arrays, so positions and indices are copied
+  // out of the file; scenes that reference a .glb build their triangles
+  // from glb_file's views instead. Throws read_exception.
+  mesh read_glb(const std::string& path) {
+    glb_file file(path);
+    std::vector<vector3> vertices;
+    std::vector<mesh::index_triangle> triangles;
+    size_t vertex_count = 0, triangle_count = 0;
+    for (auto& p : file.primitives()) {
+      vertex_count += p.vertex_count();
+      triangle_count += p.triangle_count();
+    }
+    vertices.reserve(vertex_count);
+    triangles.reserve(triangle_count);
+    for (auto& p : file.primitives()) {
+      auto offset = static_cast<std::uint32_t>(vertices.size());
+      for (size_t i = 0; i < p.vertex_count(); ++i) {
+        vertices.push_back(p.vertex(i));
+      }
+      for (size_t t = 0; t < p.triangle_count(); ++t) {
+        auto tri = p.triangle(t);
+        triangles.push_back({tri[0] + offset, tri[1] + offset, tri[2] + offset});
+      }
+    }
+    return mesh(std::move(vertices), std::move(triangles));
+  }
+
+  namespace detail {
+
+    // The lowercase extension of path, without the dot.
+    std::string extension(const std::string& path) {
+      auto dot = path.rfind('.');
+      auto result = (dot == std::string::npos) ? std::string() : path.substr(dot + 1);
+      std::transform(result.begin(), result.end(), result.begin(),
+                     [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+      return result;
+    }
+
+    // A mesh path from a scene file, relative to directory unless absolute.
+    std::string mesh_path(const std::string& directory, const std::string& path) {
+      return (path.empty() || (path[0] == '/')) ? path : directory + path;
+    }
+  }
+
+  // read_obj, read_ply or read_glb, depending on the extension of path.
+  mesh read_mesh(const std::string& path) {
+    auto extension = detail::extension(path);
+    if (extension == "obj") {
+      return read_obj(path);
+    } else if (extension == "ply") {
+      return read_ply(path);
+    } else if (extension == "glb") {
+      return read_glb(path);
+    }
+    throw read_exception("unknown mesh format \"" + path + "\"");
+  }
+
+  // Which parts of a scene to load. By default, everything is.
+  class read_options {
+  private:
+    bool geometry_;
+    std::optional<aabb> region_;
+
+  public:
+
+    read_options() noexcept
+    : geometry_(true) { }
+
+    // Loads no spheres, triangles, meshes, objects, or instances.
+    read_options& skip_geometry() noexcept {
+      geometry_ = false;
+      return *this;
+    }
+
+    // Keeps only the spheres and triangles, including those of meshes,
+    // whose bounds overlap region, and the instances whose world-space
+    // bounds do. Objects are kept whole.
+    read_options& only_within(const aabb& region) noexcept {
+      region_ = region;
+      return *this;
+    }
+
+    constexpr bool geometry() const noexcept { return geometry_; }
+    constexpr const std::optional<aabb>& region() const noexcept { return region_; }
+
+    // whether every primitive is loaded
+    bool everything() const noexcept { return geometry_ && !region_; }
+  };
+
+  // The number of elements in each geometry array of a scene file, before
+  // any read_options filtering. Meshes count as one element each.
+  class scene_counts {
+  private:
+    size_t spheres_, triangles_, meshes_, objects_, instances_;
+
+  public:
+
+    constexpr scene_counts(size_t spheres = 0,
+                           size_t triangles = 0,
+                           size_t meshes = 0,
+                           size_t objects = 0,
+                           size_t instances = 0) noexcept
+    : spheres_(spheres), triangles_(triangles), meshes_(meshes), objects_(objects), instances_(instances) { }
+
+    constexpr size_t spheres  () const noexcept { return spheres_;   }
+    constexpr size_t triangles() const noexcept { return triangles_; }
+    constexpr size_t meshes   () const noexcept { return meshes_;    }
+    constexpr size_t objects  () const noexcept { return objects_;   }
+    constexpr size_t instances() const noexcept { return instances_; }
+  };
+
+  // Mesh paths in j are relative to directory, which, if not empty, must
+  // end with a slash. Skipped geometry is not validated, and a skipped
+  // glTF mesh adds no materials.
+  scene read_json(const nlohmann::json& j,
+                  const std::string& directory = "",
+                  const read_options& options = read_options()) {
+
+    if (!j.is_object()) {
+      throw read_exception("rayson must be comprised of one JSON object");
+    }
+
+    auto has = [](auto& j_obj, const std::string& key) noexcept {
+      return j_obj.find(key) != j_obj.end();
+    };
+
+    auto check_has_key = [&](auto& j_obj, const std::string& key) {
+      if (!has(j_obj, key)) {
+        throw read_exception("missing key \"" + key + "\"");
+      }
+    };
+
+    auto get_bool = [&](auto& j_obj, const std::string& key) {
+      check_has_key(j_obj, key);
+      if (!j_obj[key].is_boolean()) {
+        throw read_exception("key \"" + key + "\" must be a bool");
+      }
+      return j_obj[key].template get<bool>();
+    };
+
+    auto get_double = [&](auto& j_obj, const std::string& key) {
+      check_has_key(j_obj, key);
+      if (!j_obj[key].is_number_float()) {
+        throw read_exception("key \"" + key + "\" must be a float");
+      }
+      return j_obj[key].template get<double>();
+    };
+
+    auto get_string = [&](auto& j_obj, const std::string& key) {
+      check_has_key(j_obj, key);
+      if (!j_obj[key].is_string()) {
+        throw read_exception("key \"" + key + "\" must be a string");
+      }
+      return j_obj[key].template get<std::string>();
+    };
+
+    auto get_positive_unsigned = [&](auto& j_obj, const std::string& key) {
+      check_has_key(j_obj, key);
+      if (!j_obj[key].is_number_integer()) {
+        throw read_exception("key \"" + key + "\" must be an integer");
+      }
+      int x = j_obj[key].template get<int>();
+      if (x <= 0) {
+        throw read_exception("key \"" + key + "\" must be positive");
+      }
+      return static_cast<unsigned>(x);
+    };
+
+    auto get_vector3 = [&](auto& j_obj, const std::string& key) {
+      check_has_key(j_obj, key);
+      auto& a = j_obj.at(key);
+      if (!a.is_array()) {
+        throw read_exception("expected " + key + " to be an array");
+      }
+      if (a.size() != 3) {
+        throw read_exception("expected array " + key + " to have 3 elements, but found " +
+                             std::to_string(j_obj.size()) + " elements");
+      }
+      try {
+        return vector3(a.at(0).template get<double>(),
+                       a.at(1).template get<double>(),
+                       a.at(2).template get<double>());
+      } catch (std::exception& e) {
+        throw read_exception("vector3 must contain numbers");
+      }
+    };
+
+    auto get_positive_double = [&](auto& j_obj, const std::string& key) {
+      double x = get_double(j_obj, key);
+      if (x <= 0.0) {
+        throw read_exception(std::string("key \"") + key + "\" must be positive");
+      }
+      return x;
+    };
+
+    auto get_negative_double = [&](auto& j_obj, const std::string& key) {
+      double x = get_double(j_obj, key);
       if (x >= 0.0) {
         throw read_exception(std::string("key \"") + key + "\" must be negative");
       }
@@ -540,6 +1931,38 @@ namespace rayson {
       }
     }
 
+    auto mesh_path = [&](const std::string& path) {
+      return detail::mesh_path(directory, path);
+    };
+
+    // Each glb file referenced by a mesh is opened once, and its materials
+    // are added as "<path>#<name>" before any primitive points at them.
+    std::unordered_map<std::string, std::pair<std::shared_ptr<glb_file>, size_t>> glb_files;
+    auto open_glb_files = [&](auto& j_obj) {
+      if (!has(j_obj, "meshes") || !j_obj["meshes"].is_array()) {
+        return;
+      }
+      for (auto& it : j_obj["meshes"]) {
+        auto path = get_string(it, "path");
+        if ((detail::extension(path) != "glb") || (glb_files.count(path) > 0)) {
+          continue;
+        }
+        auto file = std::make_shared<glb_file>(mesh_path(path));
+        glb_files[path] = std::make_pair(file, result.materials().size());
+        for (auto& m : file->materials()) {
+          result.emplace_material(material(path + "#" + m.name(), m.shininess(), m.color()));
+        }
+      }
+    };
+    if (options.geometry()) {
+      open_glb_files(j);
+    }
+    if (options.geometry() && has(j, "objects") && j["objects"].is_array()) {
+      for (auto& it : j["objects"]) {
+        open_glb_files(it);
+      }
+    }
+
     std::unordered_map<std::string, const material*> material_map;
     for (auto& m : result.materials()) {
       auto& key = m.name();
@@ -550,60 +1973,5257 @@ namespace rayson {
       }
     }
 
-    if (has(j, "spheres")) {
+    auto get_material = [&](auto& j_obj, const std::string& what) {
+      auto material_name = get_string(j_obj, "material");
+      auto material_found = material_map.find(material_name);
+      if (material_found == material_map.end()) {
+        throw read_exception(what + " references undefined material \"" + material_name + "\"");
+      }
+      return material_found->second;
+    };
+
+    auto get_sphere = [&](auto& i) {
+      return sphere(get_material(i, "sphere"),
+                    get_vector3(i, "center"),
+                    get_positive_double(i, "radius"));
+    };
+
+    auto get_triangle = [&](auto& i) {
+      auto a = get_vector3(i, "a");
+      auto b = get_vector3(i, "b");
+      auto c = get_vector3(i, "c");
+
+      if ((a == b) || (a == c) || (b == c)) {
+        throw read_exception("triangle is degenerate due to duplicated vertices");
+      }
+
+      return triangle(get_material(i, "triangle"), a, b, c);
+    };
+
+    auto within = [&](const aabb& box) {
+      return !options.region() || options.region()->overlaps(box);
+    };
+
+    if (options.geometry() && has(j, "spheres")) {
       for (auto& i : j["spheres"]) {
-        auto material_name = get_string(i, "material");
-        auto material_found = material_map.find(material_name);
-        if (material_found == material_map.end()) {
-          throw read_exception("sphere references undefined material \"" + material_name + "\"");
+        auto sph = get_sphere(i);
+        if (within(bounds(sph))) {
+          result.emplace_sphere(std::move(sph));
         }
-        result.emplace_sphere(sphere(material_found->second,
-                                     get_vector3(i, "center"),
-                                     get_positive_double(i, "radius")));
       }
     }
 
-    if (has(j, "triangles")) {
+    if (options.geometry() && has(j, "triangles")) {
       for (auto& i : j["triangles"]) {
+        auto tri = get_triangle(i);
+        if (within(bounds(tri))) {
+          result.emplace_triangle(std::move(tri));
+        }
+      }
+    }
+
+    // adds the triangles of each mesh in j_obj to target, skipping
+    // degenerate ones, and, when clip is true, those outside the region
+    auto read_meshes = [&](auto& j_obj, auto& target, bool clip) {
+      auto emplace = [&](triangle&& tri) {
+        if (!clip || within(bounds(tri))) {
+          target.emplace_triangle(std::move(tri));
+        }
+      };
+      if (!has(j_obj, "meshes")) {
+        return;
+      }
+      auto& child = j_obj["meshes"];
+      if (!child.is_array()) {
+        throw read_exception("expected meshes to be an array");
+      }
+      for (auto& it : child) {
+        auto path = get_string(it, "path");
+        auto glb = glb_files.find(path);
+        if (glb != glb_files.end()) {
+          // triangles are read straight from the mapped file; without a
+          // "material", each glTF primitive keeps its own
+          const material* given = has(it, "material") ? get_material(it, "mesh") : nullptr;
+          for (auto& p : glb->second.first->primitives()) {
+            if ((given == nullptr) && !p.material()) {
+              throw read_exception("mesh \"" + path + "\" has a primitive without a material");
+            }
+            auto material = (given != nullptr) ? given : &result.materials()[glb->second.second + *p.material()];
+            for (size_t i = 0; i < p.triangle_count(); ++i) {
+              auto t = p.triangle(i);
+              auto a = p.vertex(t[0]), b = p.vertex(t[1]), c = p.vertex(t[2]);
+              if ((a != b) && (a != c) && (b != c)) {
+                emplace(triangle(material, a, b, c));
+              }
+            }
+          }
+          continue;
+        }
+        auto m = read_mesh(mesh_path(path));
+        auto material = get_material(it, "mesh");
+        auto& v = m.vertices();
+        for (auto& t : m.triangles()) {
+          auto &a = v[t[0]], &b = v[t[1]], &c = v[t[2]];
+          if ((a != b) && (a != c) && (b != c)) {
+            emplace(triangle(material, a, b, c));
+          }
+        }
+      }
+    };
 
-        auto material_name = get_string(i, "material");
-        auto a = get_vector3(i, "a");
-        auto b = get_vector3(i, "b");
-        auto c = get_vector3(i, "c");
+    if (options.geometry()) {
+      read_meshes(j, result, true);
+    }
 
-        if ((a == b) || (a == c) || (b == c)) {
-          throw read_exception("triangle is degenerate due to duplicated vertices");
+    std::unordered_map<std::string, const object*> object_map;
+    if (options.geometry() && has(j, "objects")) {
+      auto& child = j["objects"];
+      if (!child.is_array()) {
+        throw read_exception("expected objects to be an array");
+      }
+      for (auto& it : child) {
+        object o(get_string(it, "name"));
+        if (has(it, "spheres")) {
+          for (auto& i : it["spheres"]) {
+            o.emplace_sphere(get_sphere(i));
+          }
+        }
+        if (has(it, "triangles")) {
+          for (auto& i : it["triangles"]) {
+            o.emplace_triangle(get_triangle(i));
+          }
+        }
+        read_meshes(it, o, false);
+        if (o.spheres().empty() && o.triangles().empty()) {
+          throw read_exception("object \"" + o.name() + "\" has no primitives");
+        }
+        result.emplace_object(std::move(o));
+      }
+      for (auto& o : result.objects()) {
+        if (object_map.count(o.name()) > 0) {
+          throw read_exception("duplicate object name \"" + o.name() + "\"");
         }
+        object_map[o.name()] = &o;
+      }
+    }
 
-        auto material_found = material_map.find(material_name);
-        if (material_found == material_map.end()) {
-          throw read_exception("triangle references undefined material \"" + material_name + "\"");
+    auto get_transform = [&](auto& j_obj, const std::string& key) {
+      check_has_key(j_obj, key);
+      auto& rows = j_obj.at(key);
+      if (!rows.is_array() || (rows.size() != 3)) {
+        throw read_exception("expected " + key + " to be an array of 3 rows");
+      }
+      std::array<double, 12> m;
+      for (unsigned row = 0; row < 3; ++row) {
+        auto& r = rows.at(row);
+        if (!r.is_array() || (r.size() != 4)) {
+          throw read_exception("expected each row of " + key + " to have 4 elements");
+        }
+        for (unsigned column = 0; column < 4; ++column) {
+          if (!r.at(column).is_number()) {
+            throw read_exception(key + " must contain numbers");
+          }
+          m[row * 4 + column] = r.at(column).template get<double>();
         }
+      }
+      transform t(m);
+      if (t.determinant() == 0.0) {
+        throw read_exception(key + " must be invertible");
+      }
+      return t;
+    };
 
-        result.emplace_triangle(triangle(material_found->second, a, b, c));
+    if (options.geometry() && has(j, "instances")) {
+      auto& child = j["instances"];
+      if (!child.is_array()) {
+        throw read_exception("expected instances to be an array");
+      }
+      for (auto& it : child) {
+        auto object_name = get_string(it, "object");
+        auto object_found = object_map.find(object_name);
+        if (object_found == object_map.end()) {
+          throw read_exception("instance references undefined object \"" + object_name + "\"");
+        }
+        auto to_world = has(it, "transform") ? get_transform(it, "transform") : transform();
+        auto material = has(it, "material") ? get_material(it, "instance") : nullptr;
+        if (options.region()) {
+          aabb box;
+          for (auto& sph : object_found->second->spheres()) {
+            box = box.merged(bounds(sph));
+          }
+          for (auto& tri : object_found->second->triangles()) {
+            box = box.merged(bounds(tri));
+          }
+          if (!within(transformed(box, to_world))) {
+            continue;
+          }
+        }
+        result.emplace_instance(instance(object_found->second, to_world, material));
       }
     }
 
     return result;
   }
 
-  scene read_file(const std::string& path) {
+  namespace detail {
+
+    // Parses a scene's JSON from in. Elements of the geometry arrays that
+    // options skip are discarded by the parser as it scans them, without
+    // being built, and every element of each array is counted in counts.
+    // Spheres and triangles that are too malformed to bound are kept, so
+    // that read_json reports them.
+    nlohmann::json parse_scene(std::istream& in, const read_options& options, scene_counts& counts) {
+      using event = nlohmann::json::parse_event_t;
+      static const std::string sections[] = { "spheres", "triangles", "meshes", "objects", "instances" };
+      std::array<size_t, 5> found{};
+      // the top-level key being parsed, as an index into sections, or -1
+      int section = -1;
+
+      auto bound = [&](const nlohmann::json& element) -> std::optional<aabb> {
+        try {
+          auto point = [&](const char* key) {
+            auto xyz = element.at(key).get<std::array<double, 3>>();
+            return vector3(xyz[0], xyz[1], xyz[2]);
+          };
+          if (section == 0) {
+            auto center = point("center");
+            double radius = element.at("radius").get<double>();
+            vector3 extent(radius, radius, radius);
+            return aabb(center - extent, center + extent);
+          }
+          return aabb().merged(point("a")).merged(point("b")).merged(point("c"));
+        } catch (nlohmann::json::exception&) {
+          return std::nullopt;
+        }
+      };
+
+      auto result = nlohmann::json::parse(in, [&](int depth, event e, nlohmann::json& parsed) {
+        if ((depth == 1) && (e == event::key)) {
+          auto it = std::find(std::begin(sections), std::end(sections), parsed.get<std::string>());
+          section = (it == std::end(sections)) ? -1 : static_cast<int>(it - std::begin(sections));
+          return true;
+        }
+        if ((depth != 2) || (section < 0)) {
+          return true;
+        }
+        if (e == event::object_start) {
+          ++found[section];
+          return options.geometry();
+        }
+        if ((e == event::object_end) && options.region() && (section <= 1)) {
+          auto box = bound(parsed);
+          return !box || options.region()->overlaps(*box);
+        }
+        return true;
+      });
+      counts = scene_counts(found[0], found[1], found[2], found[3], found[4]);
+      return result;
+    }
+
+    // The directory of path, with a trailing slash, or "" for none.
+    std::string directory_of(const std::string& path) {
+      auto slash = path.rfind('/');
+      return (slash == std::string::npos) ? std::string() : path.substr(0, slash + 1);
+    }
+  }
+
+  namespace detail {
+
+    // Parses a scene's JSON from in, which is described as source in
+    // error messages.
+    nlohmann::json parse_stream(std::istream& in, const std::string& source, const read_options& options) {
+      nlohmann::json j;
+      try {
+        if (options.everything()) {
+          in >> j;
+        } else {
+          scene_counts counts;
+          j = parse_scene(in, options, counts);
+        }
+      } catch (nlohmann::json::parse_error& e) {
+        throw read_exception("JSON parse error reading " + source);
+      }
+      return j;
+    }
+  }
+
+  // Reads a scene from in, such as a pipe from a program that generates
+  // it. The JSON is parsed as it arrives, so parsing overlaps with the
+  // producer's writing, and the scene is built once the JSON is complete.
+  // Mesh paths are relative to directory, as in read_json.
+  scene read_stream(std::istream& in,
+                    const std::string& directory = "",
+                    const read_options& options = read_options()) {
+    return read_json(detail::parse_stream(in, "input stream", options), directory, options);
+  }
+
+  // Reads the scene file at path, or standard input if path is "-", in
+  // which case mesh paths are relative to the working directory. Geometry
+  // that options skip is discarded while parsing, so it costs only a scan
+  // of its text.
+  scene read_file(const std::string& path, const read_options& options = read_options()) {
+
+    if (path == "-") {
+      return read_json(detail::parse_stream(std::cin, "standard input", options), "", options);
+    }
 
     std::ifstream f(path);
     if (!f) {
       throw read_exception("could not open \"" + path + "\"");
     }
 
-    nlohmann::json j;
-    try {
-      f >> j;
-    } catch (std::invalid_argument e) {
-      f.close();
-      throw read_exception("JSON parse error reading \"" + path + "\"");
+    auto j = detail::parse_stream(f, "\"" + path + "\"", options);
+    f.close();
+
+    return read_json(j, detail::directory_of(path), options);
+  }
+
+  // A scene file opened lazily. Opening reads the camera, viewport,
+  // shading, materials, and lights, and only counts the geometry, which is
+  // scanned without being built. The geometry is read, with options, on
+  // the first call to scene(). Safe to share between threads.
+  class scene_file {
+  private:
+    std::string path_;
+    read_options options_;
+    std::unique_ptr<rayson::scene> header_;
+    scene_counts counts_;
+    std::once_flag loaded_;
+    std::unique_ptr<rayson::scene> scene_;
+
+  public:
+
+    // Throws read_exception, including when path is "-": standard input
+    // cannot be read a second time.
+    explicit scene_file(const std::string& path, const read_options& options = read_options())
+    : path_(path), options_(options) {
+      if (path == "-") {
+        throw read_exception("standard input cannot be read lazily");
+      }
+      std::ifstream f(path);
+      if (!f) {
+        throw read_exception("could not open \"" + path + "\"");
+      }
+      nlohmann::json j;
+      try {
+        j = detail::parse_scene(f, read_options().skip_geometry(), counts_);
+      } catch (nlohmann::json::parse_error& e) {
+        throw read_exception("JSON parse error reading \"" + path + "\"");
+      }
+      header_ = std::make_unique<rayson::scene>(read_json(j, detail::directory_of(path), read_options().skip_geometry()));
     }
 
-    f.close();
+    scene_file(const scene_file&) = delete;
+    scene_file& operator=(const scene_file&) = delete;
+
+    const std::string& path() const noexcept { return path_; }
+
+    // the scene without its geometry
+    const rayson::scene& header() const noexcept { return *header_; }
+
+    const scene_counts& counts() const noexcept { return counts_; }
+
+    // The whole scene, read on the first call. Throws read_exception, in
+    // which case a later call tries again.
+    const rayson::scene& scene() {
+      std::call_once(loaded_, [&]() {
+        scene_ = std::make_unique<rayson::scene>(read_file(path_, options_));
+      });
+      return *scene_;
+    }
+  };
+
+  // A material of an embedded_scene.
+  class embedded_material {
+  private:
+    const char* name_;
+    double shininess_;
+    color color_;
+
+  public:
+
+    constexpr embedded_material(const char* name, double shininess, const color& color) noexcept
+    : name_(name), shininess_(shininess), color_(color) {
+      assert(name != nullptr);
+      assert(shininess > 0.0);
+    }
+
+    constexpr const char* name() const noexcept { return name_; }
+    constexpr double shininess() const noexcept { return shininess_; }
+    constexpr const color& color() const noexcept { return color_; }
+  };
+
+  // A sphere of an embedded_scene, whose material is an index into the
+  // scene's materials.
+  class embedded_sphere {
+  private:
+    size_t material_;
+    vector3 center_;
+    double radius_;
+
+  public:
+
+    constexpr embedded_sphere(size_t material, const vector3& center, double radius) noexcept
+    : material_(material), center_(center), radius_(radius) {
+      assert(radius > 0.0);
+    }
+
+    constexpr size_t material() const noexcept { return material_; }
+    constexpr const vector3& center() const noexcept { return center_; }
+    constexpr double radius() const noexcept { return radius_; }
+  };
+
+  // A triangle of an embedded_scene, whose material is an index into the
+  // scene's materials.
+  class embedded_triangle {
+  private:
+    size_t material_;
+    vector3 a_, b_, c_;
+
+  public:
+
+    constexpr embedded_triangle(size_t material, const vector3& a, const vector3& b, const vector3& c) noexcept
+    : material_(material), a_(a), b_(b), c_(c) { }
+
+    constexpr size_t material() const noexcept { return material_; }
+    constexpr const vector3& a() const noexcept { return a_; }
+    constexpr const vector3& b() const noexcept { return b_; }
+    constexpr const vector3& c() const noexcept { return c_; }
+  };
+
+  // A scene compiled into a program, as constexpr arrays, so that loading
+  // it parses nothing. Headers defining one are generated by
+  // write_embedded, or by the rayson-embed tool. An embedded_scene refers
+  // to its arrays, and does not own them.
+  class embedded_scene {
+  private:
+    camera camera_;
+    viewport viewport_;
+    projection projection_;
+    shader shader_;
+    color background_;
+    const embedded_material* materials_;
+    const point_light* point_lights_;
+    const embedded_sphere* spheres_;
+    const embedded_triangle* triangles_;
+    size_t material_count_, point_light_count_, sphere_count_, triangle_count_;
+
+  public:
+
+    template <size_t M, size_t L, size_t S, size_t T>
+    constexpr embedded_scene(const camera& camera,
+                             const viewport& viewport,
+                             const projection& projection,
+                             const shader& shader,
+                             const color& background,
+                             const std::array<embedded_material, M>& materials,
+                             const std::array<point_light, L>& point_lights,
+                             const std::array<embedded_sphere, S>& spheres,
+                             const std::array<embedded_triangle, T>& triangles) noexcept
+    : camera_(camera),
+      viewport_(viewport),
+      projection_(projection),
+      shader_(shader),
+      background_(background),
+      materials_(materials.data()),
+      point_lights_(point_lights.data()),
+      spheres_(spheres.data()),
+      triangles_(triangles.data()),
+      material_count_(M),
+      point_light_count_(L),
+      sphere_count_(S),
+      triangle_count_(T) { }
+
+    constexpr const camera&     camera    () const noexcept { return camera_;     }
+    constexpr const viewport&   viewport  () const noexcept { return viewport_;   }
+    constexpr const projection& projection() const noexcept { return projection_; }
+    constexpr const shader&     shader    () const noexcept { return shader_;     }
+    constexpr const color&      background() const noexcept { return background_; }
+
+    constexpr const embedded_material* materials   () const noexcept { return materials_;    }
+    constexpr const point_light*       point_lights() const noexcept { return point_lights_; }
+    constexpr const embedded_sphere*   spheres     () const noexcept { return spheres_;      }
+    constexpr const embedded_triangle* triangles   () const noexcept { return triangles_;    }
+
+    constexpr size_t material_count   () const noexcept { return material_count_;    }
+    constexpr size_t point_light_count() const noexcept { return point_light_count_; }
+    constexpr size_t sphere_count     () const noexcept { return sphere_count_;      }
+    constexpr size_t triangle_count   () const noexcept { return triangle_count_;    }
+  };
+
+  // Builds the scene that e holds.
+  scene read_embedded(const embedded_scene& e) {
+    rayson::camera camera(e.camera());
+    rayson::viewport viewport(e.viewport());
+    rayson::projection projection(e.projection());
+    rayson::shader shader(e.shader());
+    scene result(std::move(camera),
+                 std::move(viewport),
+                 std::move(projection),
+                 std::move(shader),
+                 e.background());
+    for (size_t i = 0; i < e.material_count(); ++i) {
+      auto& m = e.materials()[i];
+      result.emplace_material(material(std::string(m.name()), m.shininess(), m.color()));
+    }
+    for (size_t i = 0; i < e.point_light_count(); ++i) {
+      result.emplace_point_light(point_light(e.point_lights()[i]));
+    }
+    auto material_of = [&](size_t index) {
+      assert(index < result.materials().size());
+      return &result.materials()[index];
+    };
+    for (size_t i = 0; i < e.sphere_count(); ++i) {
+      auto& sph = e.spheres()[i];
+      result.emplace_sphere(sphere(material_of(sph.material()), sph.center(), sph.radius()));
+    }
+    for (size_t i = 0; i < e.triangle_count(); ++i) {
+      auto& tri = e.triangles()[i];
+      result.emplace_triangle(triangle(material_of(tri.material()), tri.a(), tri.b(), tri.c()));
+    }
+    return result;
+  }
+
+  namespace detail {
+
+    // Appends the shortest decimal text that reads back as exactly x.
+    void append_double(std::string& out, double x) {
+      char buffer[32];
+      auto end = std::to_chars(buffer, buffer + sizeof(buffer), x).ptr;
+      out.append(buffer, end);
+    }
+  }
+
+  // Writes a C++ header that defines s as a constexpr embedded_scene named
+  // name::scene, with its arrays alongside it in namespace name. Doubles
+  // are written in their shortest round-trip form, so read_embedded gives
+  // back exactly s. Throws write_exception if name is not an identifier
+  // or s has objects, which embedded scenes cannot hold.
+  void write_embedded(const scene& s, const std::string& name, std::ostream& out) {
+    auto identifier = !name.empty() && !std::isdigit(static_cast<unsigned char>(name[0])) &&
+                      std::all_of(name.begin(), name.end(), [](char c) {
+                        return std::isalnum(static_cast<unsigned char>(c)) || (c == '_');
+                      });
+    if (!identifier) {
+      throw write_exception("\"" + name + "\" is not a C++ identifier");
+    }
+    if (!s.objects().empty()) {
+      throw write_exception("embedded scenes cannot hold objects or instances");
+    }
+
+    std::string text;
+    auto number = [&](double x) { detail::append_double(text, x); };
+    auto vector = [&](const vector3& v) {
+      text += "rayson::vector3(";
+      number(v.x());
+      text += ", ";
+      number(v.y());
+      text += ", ";
+      number(v.z());
+      text += ")";
+    };
+    auto colour = [&](const color& c) {
+      text += "rayson::color(";
+      number(c.r());
+      text += ", ";
+      number(c.g());
+      text += ", ";
+      number(c.b());
+      text += ")";
+    };
+    // an array named array_name with one element per item of items
+    auto array = [&](const char* type, const char* array_name, const auto& items, auto element) {
+      text += "  inline constexpr std::array<rayson::";
+      text += type;
+      text += ", " + std::to_string(items.size()) + "> " + array_name + " = {";
+      for (size_t i = 0; i < items.size(); ++i) {
+        text += (i == 0) ? "\n    " : ",\n    ";
+        element(items[i]);
+      }
+      text += items.empty() ? "};\n\n" : "\n  };\n\n";
+    };
+    auto material_index = [&](const material& m) {
+      text += std::to_string(static_cast<size_t>(&m - s.materials().data()));
+    };
+
+    text += "// Generated by rayson-embed. Do not edit.\n\n"
+            "#pragma once\n\n"
+            "#include \"rayson.hpp\"\n\n"
+            "namespace " + name + " {\n\n";
+    array("embedded_material", "materials", s.materials(), [&](const material& m) {
+      text += "rayson::embedded_material(" + nlohmann::json(m.name()).dump() + ", ";
+      number(m.shininess());
+      text += ", ";
+      colour(m.color());
+      text += ")";
+    });
+    array("point_light", "point_lights", s.point_lights(), [&](const point_light& light) {
+      text += "rayson::point_light(";
+      vector(light.location());
+      text += ", ";
+      colour(light.color());
+      text += ", ";
+      number(light.intensity());
+      text += ")";
+    });
+    array("embedded_sphere", "spheres", s.spheres(), [&](const sphere& sph) {
+      text += "rayson::embedded_sphere(";
+      material_index(sph.material());
+      text += ", ";
+      vector(sph.center());
+      text += ", ";
+      number(sph.radius());
+      text += ")";
+    });
+    array("embedded_triangle", "triangles", s.triangles(), [&](const triangle& tri) {
+      text += "rayson::embedded_triangle(";
+      material_index(tri.material());
+      text += ", ";
+      vector(tri.a());
+      text += ", ";
+      vector(tri.b());
+      text += ", ";
+      vector(tri.c());
+      text += ")";
+    });
+
+    auto& v = s.viewport();
+    text += "  inline constexpr rayson::embedded_scene scene(\n    rayson::camera(";
+    vector(s.camera().eye());
+    text += ", ";
+    vector(s.camera().up());
+    text += ", ";
+    vector(s.camera().view());
+    text += "),\n    rayson::viewport(" + std::to_string(v.x_resolution()) + ", " + std::to_string(v.y_resolution());
+    for (double x : { v.left(), v.top(), v.right(), v.bottom() }) {
+      text += ", ";
+      number(x);
+    }
+    text += "),\n    ";
+    if (auto persp = std::get_if<persp_projection>(&s.projection())) {
+      text += "rayson::persp_projection(";
+      number(persp->focal_length());
+      text += ")";
+    } else {
+      text += "rayson::ortho_projection()";
+    }
+    text += ",\n    ";
+    if (auto phong = std::get_if<phong_shader>(&s.shader())) {
+      text += "rayson::phong_shader(";
+      number(phong->ambient_coeff());
+      text += ", ";
+      number(phong->diffuse_coeff());
+      text += ", ";
+      number(phong->specular_coeff());
+      text += ", ";
+      colour(phong->ambient_color());
+      text += ")";
+    } else {
+      text += "rayson::flat_shader()";
+    }
+    text += ",\n    ";
+    colour(s.background());
+    text += ",\n    materials, point_lights, spheres, triangles);\n}\n";
 
-    return read_json(j);
+    out << text;
+    if (!out) {
+      throw write_exception("could not write embedded scene");
+    }
+  }
+
+  enum class json_style {
+    // one entry or array element per line, as in the sample scene files
+    pretty,
+    // no whitespace
+    compact
+  };
+
+  namespace detail {
+
+    // Appends x as a JSON number that reads back as exactly x, and as a
+    // float rather than an integer.
+    void append_json_double(std::string& out, double x) {
+      auto start = out.size();
+      append_double(out, x);
+      if (out.find_first_of(".e", start) == std::string::npos) {
+        out += ".0";
+      }
+    }
+  }
+
+  // Writes s to out as a rayson scene file that read_json reads back as
+  // exactly s. Meshes are written as the triangles they were read into.
+  // Output is streamed: large arrays are formatted in parallel, one batch
+  // of chunks at a time, and each batch is written before the next is
+  // formatted. Throws write_exception if two materials, or two objects,
+  // share a name, or if out fails.
+  void write_json(const scene& s, std::ostream& out, json_style style = json_style::pretty) {
+    auto unique = [](auto& items, const char* what) {
+      std::unordered_map<std::string, size_t> seen;
+      for (auto& item : items) {
+        if (++seen[item.name()] > 1) {
+          throw write_exception(std::string("two ") + what + " are named \"" + item.name() + "\"");
+        }
+      }
+    };
+    unique(s.materials(), "materials");
+    unique(s.objects(), "objects");
+
+    bool pretty = (style == json_style::pretty);
+    const std::string colon = pretty ? " : " : ":",
+                      comma = pretty ? ", " : ",",
+                      newline = pretty ? "\n" : "";
+    auto indent = [&](unsigned depth) { return pretty ? std::string(2 * depth, ' ') : std::string(); };
+
+    // the name of each material as a JSON string
+    std::vector<std::string> material_names;
+    for (auto& m : s.materials()) {
+      material_names.push_back(nlohmann::json(m.name()).dump());
+    }
+    auto material_name = [&](const material& m) -> const std::string& {
+      return material_names[static_cast<size_t>(&m - s.materials().data())];
+    };
+
+    auto key = [&](std::string& text, const char* name) {
+      text += '"';
+      text += name;
+      text += '"';
+      text += colon;
+    };
+    auto numbers = [&](std::string& text, std::initializer_list<double> xs) {
+      text += '[';
+      for (auto x = xs.begin(); x != xs.end(); ++x) {
+        if (x != xs.begin()) {
+          text += comma;
+        }
+        detail::append_json_double(text, *x);
+      }
+      text += ']';
+    };
+    auto vector = [&](std::string& text, const vector3& v) { numbers(text, { v.x(), v.y(), v.z() }); };
+    auto colour = [&](std::string& text, const color& c) { numbers(text, { c.r(), c.g(), c.b() }); };
+    // an object, written as { "key" : value, ... } on one line
+    auto open = [&](std::string& text) { text += pretty ? "{ " : "{"; };
+    auto close = [&](std::string& text) { text += pretty ? " }" : "}"; };
+
+    std::string text;
+    auto flush = [&]() {
+      out << text;
+      text.clear();
+      if (!out) {
+        throw write_exception("could not write scene");
+      }
+    };
+
+    // Writes the array of items as entry name, one element per line,
+    // where element(text, item) appends one item.
+    auto array = [&](const char* name, unsigned depth, const auto& items, auto element) {
+      text += indent(depth);
+      key(text, name);
+      text += '[';
+      constexpr size_t chunk = 1024, chunks_per_batch = 64;
+      auto separator = newline + indent(depth + 1);
+      for (size_t begin = 0; begin < items.size(); begin += chunk * chunks_per_batch) {
+        auto end = std::min(items.size(), begin + chunk * chunks_per_batch);
+        std::vector<std::string> parts((end - begin + chunk - 1) / chunk);
+        detail::parallel_for(parts.size(), 1, [&](size_t first, size_t last) {
+          for (auto part = first; part < last; ++part) {
+            auto& part_text = parts[part];
+            for (auto i = begin + part * chunk; i < std::min(end, begin + (part + 1) * chunk); ++i) {
+              if (i > 0) {
+                part_text += ',';
+              }
+              part_text += separator;
+              element(part_text, items[i]);
+            }
+          }
+        });
+        flush();
+        for (auto& part_text : parts) {
+          out << part_text;
+        }
+      }
+      if (!items.empty()) {
+        text += newline + indent(depth);
+      }
+      text += ']';
+    };
+    auto next_entry = [&](unsigned depth) { text += ',' + newline + indent(depth); };
+
+    auto sphere_element = [&](std::string& text, const sphere& sph) {
+      open(text);
+      key(text, "material");
+      text += material_name(sph.material());
+      text += comma;
+      key(text, "center");
+      vector(text, sph.center());
+      text += comma;
+      key(text, "radius");
+      detail::append_json_double(text, sph.radius());
+      close(text);
+    };
+    auto triangle_element = [&](std::string& text, const triangle& tri) {
+      open(text);
+      key(text, "material");
+      text += material_name(tri.material());
+      text += comma;
+      key(text, "a");
+      vector(text, tri.a());
+      text += comma;
+      key(text, "b");
+      vector(text, tri.b());
+      text += comma;
+      key(text, "c");
+      vector(text, tri.c());
+      close(text);
+    };
+
+    text += "{" + newline + indent(1);
+    key(text, "camera_eye");
+    vector(text, s.camera().eye());
+    next_entry(1);
+    key(text, "camera_up");
+    vector(text, s.camera().up());
+    next_entry(1);
+    key(text, "camera_view");
+    vector(text, s.camera().view());
+    auto& v = s.viewport();
+    next_entry(1);
+    key(text, "x_resolution");
+    text += std::to_string(v.x_resolution());
+    next_entry(1);
+    key(text, "y_resolution");
+    text += std::to_string(v.y_resolution());
+    std::pair<const char*, double> bounds[] = { { "viewport_left", v.left() }, { "viewport_top", v.top() },
+                                                { "viewport_right", v.right() }, { "viewport_bottom", v.bottom() } };
+    for (auto& [name, x] : bounds) {
+      next_entry(1);
+      key(text, name);
+      detail::append_json_double(text, x);
+    }
+    next_entry(1);
+    key(text, "background");
+    colour(text, s.background());
+    next_entry(1);
+    if (auto persp = std::get_if<persp_projection>(&s.projection())) {
+      key(text, "persp_focal_length");
+      detail::append_json_double(text, persp->focal_length());
+    } else {
+      key(text, "ortho_projection");
+      text += "true";
+    }
+    next_entry(1);
+    if (auto phong = std::get_if<phong_shader>(&s.shader())) {
+      key(text, "phong_shader");
+      text += "{" + newline + indent(2);
+      key(text, "ambient_coeff");
+      detail::append_json_double(text, phong->ambient_coeff());
+      next_entry(2);
+      key(text, "diffuse_coeff");
+      detail::append_json_double(text, phong->diffuse_coeff());
+      next_entry(2);
+      key(text, "specular_coeff");
+      detail::append_json_double(text, phong->specular_coeff());
+      next_entry(2);
+      key(text, "ambient_color");
+      colour(text, phong->ambient_color());
+      text += newline + indent(1) + "}";
+    } else {
+      key(text, "flat_shader");
+      text += "true";
+    }
+
+    text += ',' + newline;
+    array("materials", 1, s.materials(), [&](std::string& text, const material& m) {
+      open(text);
+      key(text, "name");
+      text += material_name(m) + comma;
+      key(text, "color");
+      colour(text, m.color());
+      text += comma;
+      key(text, "shininess");
+      detail::append_json_double(text, m.shininess());
+      close(text);
+    });
+    if (!s.point_lights().empty()) {
+      text += ',' + newline;
+      array("point_lights", 1, s.point_lights(), [&](std::string& text, const point_light& light) {
+        open(text);
+        key(text, "location");
+        vector(text, light.location());
+        text += comma;
+        key(text, "intensity");
+        detail::append_json_double(text, light.intensity());
+        text += comma;
+        key(text, "color");
+        colour(text, light.color());
+        close(text);
+      });
+    }
+    if (!s.spheres().empty()) {
+      text += ',' + newline;
+      array("spheres", 1, s.spheres(), sphere_element);
+    }
+    if (!s.triangles().empty()) {
+      text += ',' + newline;
+      array("triangles", 1, s.triangles(), triangle_element);
+    }
+
+    // objects are written one at a time, so that each one's primitives
+    // stream like the scene's
+    if (!s.objects().empty()) {
+      text += ',' + newline + indent(1);
+      key(text, "objects");
+      text += '[';
+      for (size_t i = 0; i < s.objects().size(); ++i) {
+        auto& o = s.objects()[i];
+        text += ((i > 0) ? "," : "") + newline + indent(2) + "{" + newline + indent(3);
+        key(text, "name");
+        text += nlohmann::json(o.name()).dump();
+        if (!o.spheres().empty()) {
+          text += ',' + newline;
+          array("spheres", 3, o.spheres(), sphere_element);
+        }
+        if (!o.triangles().empty()) {
+          text += ',' + newline;
+          array("triangles", 3, o.triangles(), triangle_element);
+        }
+        text += newline + indent(2) + "}";
+      }
+      text += newline + indent(1) + "]";
+    }
+    if (!s.instances().empty()) {
+      text += ',' + newline;
+      array("instances", 1, s.instances(), [&](std::string& text, const instance& inst) {
+        open(text);
+        key(text, "object");
+        text += nlohmann::json(inst.object().name()).dump();
+        text += comma;
+        key(text, "transform");
+        text += '[';
+        auto& m = inst.to_world();
+        for (unsigned row = 0; row < 3; ++row) {
+          if (row > 0) {
+            text += comma;
+          }
+          numbers(text, { m(row, 0), m(row, 1), m(row, 2), m(row, 3) });
+        }
+        text += ']';
+        if (inst.has_material()) {
+          text += comma;
+          key(text, "material");
+          text += material_name(inst.material());
+        }
+        close(text);
+      });
+    }
+    text += newline + "}" + newline;
+    flush();
   }
+
+  // Generates primary rays for a scene's camera, viewport, and projection,
+  // as in section 4.3 of Marschner and Shirley. Image coordinates are in
+  // pixels, with (0, 0) at the top-left corner of the image.
+  class ray_generator {
+  private:
+    vector3 eye_, u_, v_, w_;
+    double left_, top_, pixel_width_, pixel_height_;
+    // zero for orthographic projection
+    double focal_length_;
+
+  public:
+
+    explicit ray_generator(const scene& s) noexcept
+    : eye_(s.camera().eye()),
+      w_(-s.camera().view().normalized()),
+      left_(s.viewport().left()),
+      top_(s.viewport().top()),
+      pixel_width_((s.viewport().right() - s.viewport().left()) / s.viewport().x_resolution()),
+      pixel_height_((s.viewport().top() - s.viewport().bottom()) / s.viewport().y_resolution()),
+      focal_length_(0.0) {
+      u_ = s.camera().up().cross(w_).normalized();
+      v_ = w_.cross(u_);
+      if (auto persp = std::get_if<persp_projection>(&s.projection())) {
+        focal_length_ = persp->focal_length();
+      }
+    }
+
+    // The ray through image point (x, y).
+    ray operator()(double x, double y) const noexcept {
+      double us = left_ + pixel_width_ * x,
+             vs = top_ - pixel_height_ * y;
+      if (focal_length_ == 0.0) {
+        return ray(eye_ + u_ * us + v_ * vs, -w_);
+      }
+      return ray(eye_, w_ * -focal_length_ + u_ * us + v_ * vs);
+    }
+
+    // The ray through the center of pixel (x, y).
+    ray pixel(unsigned x, unsigned y) const noexcept {
+      return (*this)(x + 0.5, y + 0.5);
+    }
+
+    // Rays through the centers of a tile of pixels with width columns and
+    // N / width rows, starting at pixel (x, y), in row-major order. Tiles
+    // are coherent packets for bvh::intersect.
+    template <size_t N>
+    std::array<ray, N> tile(unsigned x, unsigned y, unsigned width) const noexcept {
+      assert((width > 0) && (N % width == 0));
+      std::array<ray, N> result{};
+      for (size_t i = 0; i < N; ++i) {
+        result[i] = pixel(x + i % width, y + static_cast<unsigned>(i / width));
+      }
+      return result;
+    }
+  };
+
+  // The region that a scene's primary rays can reach: a box, open at the
+  // far end, for orthographic projection, or a frustum for perspective
+  // projection. It is bounded by five planes, four through the edges of
+  // the viewport and one through the eye, facing the view direction. The
+  // tests are conservative: they may report overlap for a primitive that
+  // lies just outside a corner, but never miss one that is inside.
+  class view_volume {
+  private:
+    // p is inside plane i when normals_[i].dot(p) >= offsets_[i]
+    std::array<vector3, 5> normals_;
+    std::array<double, 5> offsets_;
+
+  public:
+
+    explicit view_volume(const scene& s) noexcept {
+      auto eye = s.camera().eye();
+      auto w = -s.camera().view().normalized();
+      auto u = s.camera().up().cross(w).normalized();
+      auto v = w.cross(u);
+      double left   = std::min(s.viewport().left(), s.viewport().right()),
+             right  = std::max(s.viewport().left(), s.viewport().right()),
+             bottom = std::min(s.viewport().bottom(), s.viewport().top()),
+             top    = std::max(s.viewport().bottom(), s.viewport().top());
+
+      // each plane as a normal and a least value of normal.dot(p - eye)
+      std::array<double, 5> least{};
+      if (auto persp = std::get_if<persp_projection>(&s.projection())) {
+        double f = persp->focal_length();
+        normals_ = { u * f + w * left, -(u * f) - w * right, v * f + w * bottom, -(v * f) - w * top, -w };
+      } else {
+        normals_ = { u, -u, v, -v, -w };
+        least = { left, -right, bottom, -top, 0.0 };
+      }
+      for (size_t i = 0; i < normals_.size(); ++i) {
+        offsets_[i] = least[i] + normals_[i].dot(eye);
+      }
+    }
+
+    bool overlaps(const aabb& box) const noexcept {
+      for (size_t i = 0; i < normals_.size(); ++i) {
+        auto& n = normals_[i];
+        // the corner of box furthest along n
+        vector3 corner((n.x() >= 0.0) ? box.max().x() : box.min().x(),
+                       (n.y() >= 0.0) ? box.max().y() : box.min().y(),
+                       (n.z() >= 0.0) ? box.max().z() : box.min().z());
+        if (n.dot(corner) < offsets_[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    bool overlaps(const sphere& sph) const noexcept {
+      for (size_t i = 0; i < normals_.size(); ++i) {
+        if (normals_[i].dot(sph.center()) + sph.radius() * normals_[i].magnitude() < offsets_[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    bool overlaps(const triangle& tri) const noexcept {
+      for (size_t i = 0; i < normals_.size(); ++i) {
+        auto& n = normals_[i];
+        if ((n.dot(tri.a()) < offsets_[i]) && (n.dot(tri.b()) < offsets_[i]) && (n.dot(tri.c()) < offsets_[i])) {
+          return false;
+        }
+      }
+      return true;
+    }
+  };
+
+  enum class primitive_kind { sphere, triangle, instance };
+
+  // How a bvh stores triangle vertices: as exact doubles, or as 16-bit
+  // offsets within the bounds of their leaf, decoded during intersection.
+  enum class vertex_storage { exact, quantized };
+
+  // The closest intersection of a ray with a scene primitive.
+  class hit {
+  private:
+    double t_;
+    primitive_kind kind_, local_kind_;
+    size_t index_, local_index_, material_index_;
+    vector3 normal_;
+
+  public:
+
+    // index is into scene::spheres(), scene::triangles(), or
+    // scene::instances(), depending on kind; material_index is into
+    // scene::materials(). normal is unit length and points out of spheres,
+    // or along (b - a) x (c - a) for triangles, in world space.
+    constexpr hit(double t,
+                  primitive_kind kind,
+                  size_t index,
+                  size_t material_index,
+                  const vector3& normal) noexcept
+    : hit(t, kind, index, kind, index, material_index, normal) { }
+
+    // A hit on an instance also names the primitive of its object that was
+    // hit: local_index is into that object's spheres or triangles,
+    // depending on local_kind.
+    constexpr hit(double t,
+                  primitive_kind kind,
+                  size_t index,
+                  primitive_kind local_kind,
+                  size_t local_index,
+                  size_t material_index,
+                  const vector3& normal) noexcept
+    : t_(t),
+      kind_(kind),
+      local_kind_(local_kind),
+      index_(index),
+      local_index_(local_index),
+      material_index_(material_index),
+      normal_(normal) { }
+
+    constexpr double t() const noexcept { return t_; }
+    constexpr primitive_kind kind() const noexcept { return kind_; }
+    constexpr size_t index() const noexcept { return index_; }
+    // the same as kind() and index(), except for instance hits
+    constexpr primitive_kind local_kind() const noexcept { return local_kind_; }
+    constexpr size_t local_index() const noexcept { return local_index_; }
+    constexpr size_t material_index() const noexcept { return material_index_; }
+    constexpr const vector3& normal() const noexcept { return normal_; }
+  };
+
+  // Bounding volume hierarchy over the spheres and triangles of a scene,
+  // built with the binned surface area heuristic (SAH). A bvh keeps its
+  // own copy of primitive geometry, so it stays valid when the scene is
+  // moved, but must be refit or updated after primitives are edited
+  // through scene::spheres() or scene::triangles().
+  //
+  // Instances make it two-level: each scene object gets its own bvh, once,
+  // and each instance is a single leaf primitive of the top level, bounded
+  // by its object's transformed bounds. Rays that reach an instance are
+  // transformed into object space and traced through the object's bvh.
+  //
+  // With vertex_storage::quantized, each leaf is a cluster: its triangles'
+  // vertices are stored as 16-bit offsets within the leaf's bounds and
+  // decoded inside the intersection kernels. This shrinks only the bvh's
+  // own copy of the geometry, to less than half for teatime.json; the
+  // scene keeps its exact triangles. Decoded vertices are off by at most
+  // max_vertex_error(), measured when the tree is built, so vertices
+  // shared across leaves may leave hairline cracks.
+  class bvh {
+  private:
+
+    static constexpr double traversal_cost = 1.0, intersection_cost = 1.0;
+    static constexpr unsigned bin_count = 16, max_leaf_size = 8, max_depth = 60;
+
+    struct node {
+      aabb bounds;
+      // interior: index of the right child, the left child follows this node;
+      // leaf: index of the first primitive
+      std::uint32_t offset;
+      // 0 for interior nodes
+      std::uint32_t count;
+      // interior: axis of the split, along which the left child comes first
+      std::uint32_t axis;
+    };
+
+    struct primitive {
+      primitive_kind kind;
+      size_t index, material;
+      // sphere: p0 is the center; triangle: vertices a, b, c; instance: p0
+      // and p1 are the min and max of its world-space bounds
+      vector3 p0, p1, p2;
+      double radius;
+
+      aabb bounds() const noexcept {
+        if (kind == primitive_kind::instance) {
+          return aabb(p0, p1);
+        }
+        if (kind == primitive_kind::sphere) {
+          vector3 extent(radius, radius, radius);
+          return aabb(p0 - extent, p0 + extent);
+        }
+        return aabb().merged(p0).merged(p1).merged(p2);
+      }
+
+      // Distance to the nearest intersection within (t_min, t_max), or
+      // infinity when there is none.
+      double intersect(const ray& r, double t_min, double t_max) const noexcept {
+        const double none = std::numeric_limits<double>::infinity();
+        if (kind == primitive_kind::sphere) {
+          auto oc = r.origin() - p0;
+          double a = r.direction().dot(r.direction()),
+                 half_b = oc.dot(r.direction()),
+                 c = oc.dot(oc) - radius*radius,
+                 discriminant = half_b*half_b - a*c;
+          if (discriminant < 0.0) {
+            return none;
+          }
+          double root = std::sqrt(discriminant),
+                 t = (-half_b - root) / a;
+          if (t <= t_min) {
+            t = (-half_b + root) / a;
+          }
+          return ((t > t_min) && (t < t_max)) ? t : none;
+        }
+        // Moller-Trumbore
+        auto e1 = p1 - p0, e2 = p2 - p0;
+        auto p = r.direction().cross(e2);
+        double det = e1.dot(p);
+        if (det == 0.0) {
+          return none;
+        }
+        double inverse_det = 1.0 / det;
+        auto s = r.origin() - p0;
+        double u = s.dot(p) * inverse_det;
+        if ((u < 0.0) || (u > 1.0)) {
+          return none;
+        }
+        auto q = s.cross(e1);
+        double v = r.direction().dot(q) * inverse_det;
+        if ((v < 0.0) || (u + v > 1.0)) {
+          return none;
+        }
+        double t = e2.dot(q) * inverse_det;
+        return ((t > t_min) && (t < t_max)) ? t : none;
+      }
+
+      vector3 normal(const vector3& point) const noexcept {
+        if (kind == primitive_kind::sphere) {
+          return (point - p0).normalized();
+        }
+        return (p1 - p0).cross(p2 - p0).normalized();
+      }
+    };
+
+    // an instance's object, as an index into objects_, and its transform
+    // from world to object space
+    struct placement {
+      size_t object;
+      transform to_object;
+    };
+
+    // the material of an instance primitive without an override
+    static constexpr size_t no_material = std::numeric_limits<size_t>::max();
+    // no primitive found
+    static constexpr size_t no_slot = std::numeric_limits<size_t>::max();
+    static constexpr double quantization_steps = 65535.0;
+
+    // A primitive in quantized storage. Triangles hold their vertices as
+    // offsets in steps from their cluster's origin; spheres and instances
+    // refer to an exact copy in primitives_.
+    struct packed_primitive {
+      std::uint32_t index;
+      // std::uint32_t(-1) for an instance without a material override
+      std::uint32_t material;
+      // triangle: index into clusters_; otherwise: index into primitives_
+      std::uint32_t extra;
+      primitive_kind kind;
+      std::array<std::uint16_t, 9> q;
+    };
+
+    // the quantization grid of one leaf's triangles, in single precision,
+    // which is ample for 16-bit offsets as long as the grid covers the leaf:
+    // the origin is rounded down and the step up (see quantize())
+    struct cluster {
+      std::array<float, 3> origin, step;
+    };
+
+    std::vector<node> nodes_;
+    // exact: every primitive, in leaf order; quantized: the spheres and
+    // instances only, with leaves indexing packed_ instead
+    std::vector<primitive> primitives_;
+    std::vector<packed_primitive> packed_;
+    std::vector<cluster> clusters_;
+    vertex_storage storage_;
+    double built_sah_cost_;
+    // the largest distance, along any axis, between a quantized vertex and
+    // its original position
+    double max_error_;
+    // bottom level: one bvh per scene object
+    std::vector<bvh> objects_;
+    std::vector<placement> instances_;
+
+    static size_t source_primitive_count(const scene& s) noexcept {
+      return s.spheres().size() + s.triangles().size() + s.instances().size();
+    }
+
+    void load_instances(const scene& s) {
+      instances_.resize(s.instances().size());
+      for (size_t i = 0; i < instances_.size(); ++i) {
+        auto& inst = s.instances()[i];
+        instances_[i] = placement{static_cast<size_t>(&inst.object() - s.objects().data()), inst.to_object()};
+      }
+    }
+
+    // Loads the geometry of p from source, a scene or an object, whose
+    // primitives' materials are indexed relative to materials.
+    template <typename Source>
+    void load_primitive(const Source& source, const material* materials, primitive& p) const noexcept {
+      if (p.kind == primitive_kind::sphere) {
+        auto& sph = source.spheres()[p.index];
+        p.material = static_cast<size_t>(&sph.material() - materials);
+        p.p0 = sph.center();
+        p.radius = sph.radius();
+      } else if (p.kind == primitive_kind::triangle) {
+        auto& tri = source.triangles()[p.index];
+        p.material = static_cast<size_t>(&tri.material() - materials);
+        p.p0 = tri.a();
+        p.p1 = tri.b();
+        p.p2 = tri.c();
+      } else if constexpr (std::is_same<Source, scene>::value) {
+        auto& inst = source.instances()[p.index];
+        auto& object_tree = objects_[static_cast<size_t>(&inst.object() - source.objects().data())];
+        p.material = inst.has_material() ? static_cast<size_t>(&inst.material() - materials) : no_material;
+        auto box = transformed(object_tree.bounds(), inst.to_world());
+        p.p0 = box.min();
+        p.p1 = box.max();
+      }
+    }
+
+    void load_primitive(const scene& s, primitive& p) const noexcept {
+      load_primitive(s, s.materials().data(), p);
+    }
+
+    // (Re)builds the hierarchy over the primitives of source, a scene or an
+    // object.
+    template <typename Source>
+    void build_primitives(const Source& source, const material* materials) {
+      nodes_.clear();
+      primitives_.clear();
+      primitives_.reserve(source.spheres().size() + source.triangles().size());
+      for (size_t i = 0; i < source.spheres().size(); ++i) {
+        primitives_.push_back(primitive{primitive_kind::sphere, i, 0, vector3(), vector3(), vector3(), 0.0});
+      }
+      for (size_t i = 0; i < source.triangles().size(); ++i) {
+        primitives_.push_back(primitive{primitive_kind::triangle, i, 0, vector3(), vector3(), vector3(), 0.0});
+      }
+      if constexpr (std::is_same<Source, scene>::value) {
+        for (size_t i = 0; i < source.instances().size(); ++i) {
+          primitives_.push_back(primitive{primitive_kind::instance, i, 0, vector3(), vector3(), vector3(), 0.0});
+        }
+      }
+      detail::parallel_for(primitives_.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          load_primitive(source, materials, primitives_[i]);
+        }
+      });
+      if (!primitives_.empty()) {
+        nodes_.reserve(2 * primitives_.size());
+        build_node(0, primitives_.size(), 0);
+      }
+      packed_.clear();
+      clusters_.clear();
+      max_error_ = 0.0;
+      if (storage_ == vertex_storage::quantized) {
+        quantize();
+      }
+      built_sah_cost_ = sah_cost();
+    }
+
+    std::array<std::uint16_t, 9> encode(const primitive& p, const cluster& c) const noexcept {
+      std::array<std::uint16_t, 9> q;
+      const vector3* vertices[] = { &p.p0, &p.p1, &p.p2 };
+      for (unsigned v = 0; v < 3; ++v) {
+        for (unsigned axis = 0; axis < 3; ++axis) {
+          double steps = (c.step[axis] > 0.0f) ? ((*vertices[v])[axis] - c.origin[axis]) / c.step[axis] : 0.0;
+          q[3 * v + axis] = static_cast<std::uint16_t>(std::min(quantization_steps, std::max(0.0, std::round(steps))));
+        }
+      }
+      return q;
+    }
+
+    vector3 decode(const std::array<std::uint16_t, 9>& q, unsigned v, const cluster& c) const noexcept {
+      return vector3(c.origin[0] + q[3 * v] * static_cast<double>(c.step[0]),
+                     c.origin[1] + q[3 * v + 1] * static_cast<double>(c.step[1]),
+                     c.origin[2] + q[3 * v + 2] * static_cast<double>(c.step[2]));
+    }
+
+    // Whether the triangle p, loaded from a scene, is stored as the
+    // quantized triangle in slot k: it encodes to the same offsets, and
+    // none of its vertices was clamped into the cluster.
+    bool encodes_to(const primitive& p, size_t k) const noexcept {
+      auto& packed = packed_[k];
+      auto& c = clusters_[packed.extra];
+      if (encode(p, c) != packed.q) {
+        return false;
+      }
+      const vector3* vertices[] = { &p.p0, &p.p1, &p.p2 };
+      for (unsigned v = 0; v < 3; ++v) {
+        auto decoded = decode(packed.q, v, c);
+        for (unsigned axis = 0; axis < 3; ++axis) {
+          if (std::abs(decoded[axis] - (*vertices[v])[axis]) > c.step[axis]) {
+            return false;
+          }
+        }
+      }
+      return true;
+    }
+
+    // Moves the built primitives into quantized storage, one cluster per
+    // leaf, and refits the nodes to the decoded triangles.
+    void quantize() {
+      std::vector<size_t> leaves;
+      for (size_t i = 0; i < nodes_.size(); ++i) {
+        if (is_leaf(nodes_[i])) {
+          leaves.push_back(i);
+        }
+      }
+      packed_.resize(primitives_.size());
+      clusters_.resize(leaves.size());
+      std::vector<double> errors(leaves.size(), 0.0);
+      std::vector<primitive> exact;
+      for (size_t k = 0; k < primitives_.size(); ++k) {
+        if (primitives_[k].kind != primitive_kind::triangle) {
+          packed_[k].extra = static_cast<std::uint32_t>(exact.size());
+          exact.push_back(primitives_[k]);
+        }
+      }
+      detail::parallel_for(leaves.size(), 256, [&](size_t begin, size_t end) {
+        for (size_t l = begin; l < end; ++l) {
+          auto& n = nodes_[leaves[l]];
+          aabb box;
+          for (size_t k = n.offset; k < n.offset + n.count; ++k) {
+            if (primitives_[k].kind == primitive_kind::triangle) {
+              box = box.merged(primitives_[k].bounds());
+            }
+          }
+          auto& c = clusters_[l];
+          for (unsigned axis = 0; axis < 3; ++axis) {
+            // a small leaf far from the world origin can be narrower than
+            // the rounding error of a float coordinate, so the step is
+            // taken from the rounded origin rather than from the box
+            c.origin[axis] = static_cast<float>(box.min()[axis]);
+            if (c.origin[axis] > box.min()[axis]) {
+              c.origin[axis] = std::nextafter(c.origin[axis], -std::numeric_limits<float>::infinity());
+            }
+            double extent = box.max()[axis] - c.origin[axis];
+            c.step[axis] = static_cast<float>(extent / quantization_steps);
+            if (c.step[axis] * static_cast<double>(quantization_steps) < extent) {
+              c.step[axis] = std::nextafter(c.step[axis], std::numeric_limits<float>::infinity());
+            }
+          }
+          for (size_t k = n.offset; k < n.offset + n.count; ++k) {
+            auto& p = primitives_[k];
+            auto& packed = packed_[k];
+            packed.index = static_cast<std::uint32_t>(p.index);
+            packed.material = static_cast<std::uint32_t>(p.material);
+            packed.kind = p.kind;
+            if (p.kind == primitive_kind::triangle) {
+              packed.extra = static_cast<std::uint32_t>(l);
+              packed.q = encode(p, c);
+              const vector3* vertices[] = { &p.p0, &p.p1, &p.p2 };
+              for (unsigned v = 0; v < 3; ++v) {
+                auto decoded = decode(packed.q, v, c);
+                for (unsigned axis = 0; axis < 3; ++axis) {
+                  errors[l] = std::max(errors[l], std::abs(decoded[axis] - (*vertices[v])[axis]));
+                }
+              }
+            }
+          }
+        }
+      });
+      primitives_ = std::move(exact);
+      max_error_ = errors.empty() ? 0.0 : *std::max_element(errors.begin(), errors.end());
+      for (size_t i = nodes_.size(); i-- > 0; ) {
+        fit_node(i);
+      }
+    }
+
+    size_t slot_count() const noexcept {
+      return (storage_ == vertex_storage::exact) ? primitives_.size() : packed_.size();
+    }
+
+    // The primitive in leaf slot k, decoded into scratch if it is a
+    // quantized triangle.
+    const primitive& slot(size_t k, primitive& scratch) const noexcept {
+      if (storage_ == vertex_storage::exact) {
+        return primitives_[k];
+      }
+      auto& packed = packed_[k];
+      if (packed.kind != primitive_kind::triangle) {
+        return primitives_[packed.extra];
+      }
+      auto& c = clusters_[packed.extra];
+      scratch.kind = primitive_kind::triangle;
+      scratch.index = packed.index;
+      scratch.material = packed.material;
+      scratch.p0 = decode(packed.q, 0, c);
+      scratch.p1 = decode(packed.q, 1, c);
+      scratch.p2 = decode(packed.q, 2, c);
+      return scratch;
+    }
+
+    // Traces r through the object of the instance primitive p. On a hit
+    // nearer than closest, narrows closest, stores the world-space hit in
+    // nested, and returns true.
+    bool intersect_instance(const primitive& p,
+                            const ray& r,
+                            double t_min,
+                            double& closest,
+                            std::optional<hit>& nested) const noexcept {
+      auto& place = instances_[p.index];
+      // an affine map keeps distances along the ray, so t needs no change
+      ray local(place.to_object.point(r.origin()), place.to_object.direction(r.direction()));
+      auto h = objects_[place.object].intersect(local, t_min, closest);
+      if (!h) {
+        return false;
+      }
+      closest = h->t();
+      nested = hit(h->t(),
+                   primitive_kind::instance,
+                   p.index,
+                   h->kind(),
+                   h->index(),
+                   (p.material != no_material) ? p.material : h->material_index(),
+                   place.to_object.transposed_direction(h->normal()).normalized());
+      return true;
+    }
+
+    bool occluded_instance(const primitive& p, const ray& r, double t_min, double t_max) const noexcept {
+      auto& place = instances_[p.index];
+      ray local(place.to_object.point(r.origin()), place.to_object.direction(r.direction()));
+      return objects_[place.object].occluded(local, t_min, t_max);
+    }
+
+    bool is_leaf(const node& n) const noexcept { return n.count > 0; }
+
+    void fit_node(size_t i) noexcept {
+      auto& n = nodes_[i];
+      aabb box;
+      if (is_leaf(n)) {
+        primitive scratch;
+        for (size_t k = n.offset; k < n.offset + n.count; ++k) {
+          box = box.merged(slot(k, scratch).bounds());
+        }
+      } else {
+        box = nodes_[i + 1].bounds.merged(nodes_[n.offset].bounds);
+      }
+      n.bounds = box;
+    }
+
+    // Builds the subtree over primitives_[first, last) and returns its root.
+    std::uint32_t build_node(size_t first, size_t last, unsigned depth) {
+      auto index = static_cast<std::uint32_t>(nodes_.size());
+      nodes_.push_back(node{aabb(), static_cast<std::uint32_t>(first), 0, 0});
+
+      aabb box, centroids;
+      for (size_t i = first; i < last; ++i) {
+        auto b = primitives_[i].bounds();
+        box = box.merged(b);
+        centroids = centroids.merged(b.centroid());
+      }
+      nodes_[index].bounds = box;
+
+      size_t count = last - first;
+      auto make_leaf = [&]() {
+        nodes_[index].offset = static_cast<std::uint32_t>(first);
+        nodes_[index].count = static_cast<std::uint32_t>(count);
+        return index;
+      };
+
+      if ((count <= 2) || (depth >= max_depth)) {
+        return make_leaf();
+      }
+
+      // find the cheapest binned split over all three axes
+      double best_cost = std::numeric_limits<double>::infinity();
+      unsigned best_axis = 0, best_bin = 0;
+      for (unsigned axis = 0; axis < 3; ++axis) {
+        double lo = centroids.min()[axis], hi = centroids.max()[axis];
+        if (!(hi > lo)) {
+          continue;
+        }
+        std::array<aabb, bin_count> bin_bounds;
+        std::array<size_t, bin_count> bin_counts{};
+        double scale = bin_count / (hi - lo);
+        for (size_t i = first; i < last; ++i) {
+          auto b = primitives_[i].bounds();
+          auto bin = std::min<unsigned>(bin_count - 1,
+                                        static_cast<unsigned>((b.centroid()[axis] - lo) * scale));
+          bin_bounds[bin] = bin_bounds[bin].merged(b);
+          ++bin_counts[bin];
+        }
+        std::array<double, bin_count> right_area{};
+        std::array<size_t, bin_count> right_count{};
+        aabb right;
+        size_t right_total = 0;
+        for (unsigned bin = bin_count - 1; bin > 0; --bin) {
+          right = right.merged(bin_bounds[bin]);
+          right_total += bin_counts[bin];
+          right_area[bin] = right.surface_area();
+          right_count[bin] = right_total;
+        }
+        aabb left;
+        size_t left_total = 0;
+        for (unsigned bin = 1; bin < bin_count; ++bin) {
+          left = left.merged(bin_bounds[bin - 1]);
+          left_total += bin_counts[bin - 1];
+          if ((left_total == 0) || (right_count[bin] == 0)) {
+            continue;
+          }
+          double cost = left.surface_area() * left_total + right_area[bin] * right_count[bin];
+          if (cost < best_cost) {
+            best_cost = cost;
+            best_axis = axis;
+            best_bin = bin;
+          }
+        }
+      }
+
+      double leaf_cost = intersection_cost * count,
+             split_cost = traversal_cost + intersection_cost * best_cost / box.surface_area();
+      if ((best_cost == std::numeric_limits<double>::infinity()) ||
+          ((split_cost >= leaf_cost) && (count <= max_leaf_size))) {
+        return make_leaf();
+      }
+
+      double lo = centroids.min()[best_axis],
+             scale = bin_count / (centroids.max()[best_axis] - lo);
+      auto middle = std::partition(primitives_.begin() + first,
+                                   primitives_.begin() + last,
+                                   [&](const primitive& p) {
+                                     auto bin = std::min<unsigned>(bin_count - 1,
+                                                                   static_cast<unsigned>((p.bounds().centroid()[best_axis] - lo) * scale));
+                                     return bin < best_bin;
+                                   });
+      size_t split = middle - primitives_.begin();
+
+      build_node(first, split, depth + 1);
+      auto right_child = build_node(split, last, depth + 1);
+      nodes_[index].offset = right_child;
+      nodes_[index].axis = best_axis;
+      return index;
+    }
+
+    // One past the last node index in the subtree rooted at i.
+    size_t subtree_end(size_t i) const noexcept {
+      while (!is_leaf(nodes_[i])) {
+        i = nodes_[i].offset;
+      }
+      return i + 1;
+    }
+
+    // Closest-hit traversal of the subtree rooted at root. Narrows closest
+    // and updates found on every nearer hit.
+    void traverse(std::uint32_t root,
+                  const ray& r,
+                  const vector3& inverse,
+                  double t_min,
+                  double& closest,
+                  size_t& found,
+                  std::optional<hit>& nested) const noexcept {
+      const double none = std::numeric_limits<double>::infinity();
+
+      std::array<std::uint32_t, max_depth + 2> stack;
+      size_t top = 0;
+      if (nodes_[root].bounds.entry(r, inverse, t_min, closest) != none) {
+        stack[top++] = root;
+      }
+      primitive scratch;
+      while (top > 0) {
+        auto& n = nodes_[stack[--top]];
+        if (is_leaf(n)) {
+          for (size_t k = n.offset; k < n.offset + n.count; ++k) {
+            auto& prim = slot(k, scratch);
+            if (prim.kind == primitive_kind::instance) {
+              if (intersect_instance(prim, r, t_min, closest, nested)) {
+                found = k;
+              }
+              continue;
+            }
+            double t = prim.intersect(r, t_min, closest);
+            if (t != none) {
+              closest = t;
+              found = k;
+            }
+          }
+          continue;
+        }
+        std::uint32_t near_child = static_cast<std::uint32_t>(&n - nodes_.data()) + 1,
+                      far_child = n.offset;
+        double near_t = nodes_[near_child].bounds.entry(r, inverse, t_min, closest),
+               far_t = nodes_[far_child].bounds.entry(r, inverse, t_min, closest);
+        if (far_t < near_t) {
+          std::swap(near_child, far_child);
+          std::swap(near_t, far_t);
+        }
+        // push the far child first so the near one is visited first
+        if (far_t != none) {
+          stack[top++] = far_child;
+        }
+        if (near_t != none) {
+          stack[top++] = near_child;
+        }
+      }
+    }
+
+    // Any-hit traversal of the subtree rooted at root. Children are
+    // ordered by the ray's direction along the split axis, without box
+    // tests, so occluders near the origin are found first.
+    bool traverse_occluded(std::uint32_t root,
+                           const ray& r,
+                           const vector3& inverse,
+                           double t_min,
+                           double t_max) const noexcept {
+      const double none = std::numeric_limits<double>::infinity();
+
+      std::array<std::uint32_t, max_depth + 2> stack;
+      size_t top = 0;
+      stack[top++] = root;
+      primitive scratch;
+      while (top > 0) {
+        auto index = stack[--top];
+        auto& n = nodes_[index];
+        if (n.bounds.entry(r, inverse, t_min, t_max) == none) {
+          continue;
+        }
+        if (is_leaf(n)) {
+          for (size_t k = n.offset; k < n.offset + n.count; ++k) {
+            auto& prim = slot(k, scratch);
+            if ((prim.kind == primitive_kind::instance) ? occluded_instance(prim, r, t_min, t_max)
+                                                        : (prim.intersect(r, t_min, t_max) != none)) {
+              return true;
+            }
+          }
+          continue;
+        }
+        if (r.direction()[n.axis] < 0.0) {
+          stack[top++] = index + 1;
+          stack[top++] = n.offset;
+        } else {
+          stack[top++] = n.offset;
+          stack[top++] = index + 1;
+        }
+      }
+      return false;
+    }
+
+    std::optional<hit> make_hit(const ray& r,
+                                double t,
+                                size_t found,
+                                const std::optional<hit>& nested) const noexcept {
+      if (found == no_slot) {
+        return std::nullopt;
+      }
+      primitive scratch;
+      auto& prim = slot(found, scratch);
+      if (prim.kind == primitive_kind::instance) {
+        return nested;
+      }
+      return hit(t, prim.kind, prim.index, prim.material, prim.normal(r.at(t)));
+    }
+
+    static unsigned popcount(std::uint64_t mask) noexcept {
+      return static_cast<unsigned>(std::bitset<64>(mask).count());
+    }
+
+    // Structure-of-arrays copy of a ray packet, with one lane per ray.
+    template <size_t N>
+    struct packet {
+      using lanes = std::array<double, N>;
+
+      lanes ox, oy, oz, dx, dy, dz, ix, iy, iz, closest;
+      // leaf slots of the closest hits, or no_slot
+      std::array<size_t, N> found;
+      // hits inside instances, for lanes whose found is an instance
+      std::array<std::optional<hit>, N> nested;
+
+      void load(const std::array<ray, N>& rays, double t_max) noexcept {
+        for (size_t lane = 0; lane < N; ++lane) {
+          auto& o = rays[lane].origin();
+          auto& d = rays[lane].direction();
+          ox[lane] = o.x();
+          oy[lane] = o.y();
+          oz[lane] = o.z();
+          dx[lane] = d.x();
+          dy[lane] = d.y();
+          dz[lane] = d.z();
+          ix[lane] = 1.0 / d.x();
+          iy[lane] = 1.0 / d.y();
+          iz[lane] = 1.0 / d.z();
+          closest[lane] = t_max;
+          found[lane] = no_slot;
+        }
+      }
+
+      vector3 inverse(size_t lane) const noexcept {
+        return vector3(ix[lane], iy[lane], iz[lane]);
+      }
+
+      // Per-lane distances at which rays enter box, or infinity on a miss.
+      lanes entry_distances(const aabb& box, double t_min) const noexcept {
+        const double none = std::numeric_limits<double>::infinity();
+        lanes result;
+        for (size_t lane = 0; lane < N; ++lane) {
+          double t[3][2] = {
+            { (box.min().x() - ox[lane]) * ix[lane], (box.max().x() - ox[lane]) * ix[lane] },
+            { (box.min().y() - oy[lane]) * iy[lane], (box.max().y() - oy[lane]) * iy[lane] },
+            { (box.min().z() - oz[lane]) * iz[lane], (box.max().z() - oz[lane]) * iz[lane] }
+          };
+          // as in aabb::entry, the comparisons skip the NaN of 0 * infinity,
+          // from an axis-parallel ray whose origin lies on a slab plane
+          double near_t = t_min, far_t = closest[lane];
+          for (auto& slab : t) {
+            double lo = (slab[0] > slab[1]) ? slab[1] : slab[0],
+                   hi = (slab[0] > slab[1]) ? slab[0] : slab[1];
+            near_t = (lo > near_t) ? lo : near_t;
+            far_t = (hi < far_t) ? hi : far_t;
+          }
+          result[lane] = (near_t > far_t) ? none : near_t;
+        }
+        return result;
+      }
+
+      // Mask of lanes whose rays reach box before their closest hit so far.
+      static std::uint64_t entries(const lanes& distances) noexcept {
+        std::uint64_t mask = 0;
+        for (size_t lane = 0; lane < N; ++lane) {
+          if (distances[lane] != std::numeric_limits<double>::infinity()) {
+            mask |= std::uint64_t(1) << lane;
+          }
+        }
+        return mask;
+      }
+
+      // Tests prim, in leaf slot k, against every lane, narrowing closest
+      // for active lanes.
+      void intersect(const primitive& prim, size_t k, double t_min, std::uint64_t active) noexcept {
+        const double none = std::numeric_limits<double>::infinity();
+        lanes t;
+        if (prim.kind == primitive_kind::sphere) {
+          for (size_t lane = 0; lane < N; ++lane) {
+            double ocx = ox[lane] - prim.p0.x(), ocy = oy[lane] - prim.p0.y(), ocz = oz[lane] - prim.p0.z();
+            double a = dx[lane]*dx[lane] + dy[lane]*dy[lane] + dz[lane]*dz[lane],
+                   half_b = ocx*dx[lane] + ocy*dy[lane] + ocz*dz[lane],
+                   c = ocx*ocx + ocy*ocy + ocz*ocz - prim.radius*prim.radius,
+                   discriminant = half_b*half_b - a*c,
+                   root = std::sqrt(std::max(discriminant, 0.0)),
+                   t0 = (-half_b - root) / a,
+                   t1 = (-half_b + root) / a,
+                   tt = (t0 > t_min) ? t0 : t1;
+            t[lane] = ((discriminant >= 0.0) && (tt > t_min) && (tt < closest[lane])) ? tt : none;
+          }
+        } else {
+          double e1x = prim.p1.x() - prim.p0.x(), e1y = prim.p1.y() - prim.p0.y(), e1z = prim.p1.z() - prim.p0.z(),
+                 e2x = prim.p2.x() - prim.p0.x(), e2y = prim.p2.y() - prim.p0.y(), e2z = prim.p2.z() - prim.p0.z();
+          for (size_t lane = 0; lane < N; ++lane) {
+            double px = dy[lane]*e2z - dz[lane]*e2y,
+                   py = dz[lane]*e2x - dx[lane]*e2z,
+                   pz = dx[lane]*e2y - dy[lane]*e2x,
+                   det = e1x*px + e1y*py + e1z*pz,
+                   inverse_det = 1.0 / det,
+                   sx = ox[lane] - prim.p0.x(), sy = oy[lane] - prim.p0.y(), sz = oz[lane] - prim.p0.z(),
+                   u = (sx*px + sy*py + sz*pz) * inverse_det,
+                   qx = sy*e1z - sz*e1y,
+                   qy = sz*e1x - sx*e1z,
+                   qz = sx*e1y - sy*e1x,
+                   v = (dx[lane]*qx + dy[lane]*qy + dz[lane]*qz) * inverse_det,
+                   tt = (e2x*qx + e2y*qy + e2z*qz) * inverse_det;
+            bool inside = (det != 0.0) && (u >= 0.0) && (u <= 1.0) && (v >= 0.0) && (u + v <= 1.0);
+            t[lane] = (inside && (tt > t_min) && (tt < closest[lane])) ? tt : none;
+          }
+        }
+        for (size_t lane = 0; lane < N; ++lane) {
+          if ((active & (std::uint64_t(1) << lane)) && (t[lane] != none)) {
+            closest[lane] = t[lane];
+            found[lane] = k;
+          }
+        }
+      }
+    };
+
+
+  public:
+
+    bvh() noexcept
+    : storage_(vertex_storage::exact), built_sah_cost_(0.0), max_error_(0.0) { }
+
+    explicit bvh(const scene& s, vertex_storage storage = vertex_storage::exact)
+    : storage_(storage) {
+      build(s);
+    }
+
+    // A hierarchy over the primitives of o alone, whose materials belong to
+    // s. Hits index o's spheres and triangles.
+    bvh(const object& o, const scene& s, vertex_storage storage = vertex_storage::exact)
+    : storage_(storage) {
+      build_primitives(o, s.materials().data());
+    }
+
+    // (Re)builds the hierarchy from scratch over the current primitives of s.
+    void build(const scene& s) {
+      objects_.clear();
+      objects_.resize(s.objects().size());
+      for (size_t i = 0; i < objects_.size(); ++i) {
+        objects_[i].storage_ = storage_;
+        objects_[i].build_primitives(s.objects()[i], s.materials().data());
+      }
+      load_instances(s);
+      build_primitives(s, s.materials().data());
+    }
+
+    // Recomputes every node's bounds bottom-up after primitives of s have
+    // moved, keeping the tree topology. s must hold the same primitives, in
+    // the same order, as when this bvh was built. Disjoint subtrees are
+    // refit in parallel. Instances may be moved, but their objects must not
+    // have changed. Quantized storage cannot be refit, so it is rebuilt.
+    void refit(const scene& s) {
+      assert(source_primitive_count(s) == slot_count());
+      if (storage_ == vertex_storage::quantized) {
+        build(s);
+        return;
+      }
+
+      load_instances(s);
+      detail::parallel_for(primitives_.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          load_primitive(s, primitives_[i]);
+        }
+      });
+
+      if (nodes_.empty()) {
+        return;
+      }
+
+      // split the tree into a top part and a frontier of disjoint subtrees
+      size_t wanted = 4 * std::max<size_t>(1, std::thread::hardware_concurrency());
+      std::vector<size_t> top, frontier{0};
+      while (frontier.size() < wanted) {
+        std::vector<size_t> next;
+        for (auto i : frontier) {
+          if (is_leaf(nodes_[i])) {
+            next.push_back(i);
+          } else {
+            top.push_back(i);
+            next.push_back(i + 1);
+            next.push_back(nodes_[i].offset);
+          }
+        }
+        if (next.size() == frontier.size()) {
+          break;
+        }
+        frontier.swap(next);
+      }
+
+      // children always have greater indices than their parent, so a
+      // reverse sweep over a subtree's contiguous index range is bottom-up
+      detail::parallel_for(frontier.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t f = begin; f < end; ++f) {
+          auto root = frontier[f];
+          for (size_t i = subtree_end(root); i-- > root; ) {
+            fit_node(i);
+          }
+        }
+      });
+      std::sort(top.begin(), top.end());
+      for (auto it = top.rbegin(); it != top.rend(); ++it) {
+        fit_node(*it);
+      }
+    }
+
+    // Refits to the current primitives of s, then rebuilds if the primitive
+    // count changed or the refit tree's SAH cost exceeds threshold times its
+    // cost when last built. Returns true when the tree was rebuilt.
+    bool update(const scene& s, double threshold = 1.5) {
+      assert(threshold >= 1.0);
+      if ((source_primitive_count(s) != slot_count()) || (storage_ == vertex_storage::quantized)) {
+        build(s);
+        return true;
+      }
+      refit(s);
+      if (sah_cost() > threshold * built_sah_cost_) {
+        build(s);
+        return true;
+      }
+      return false;
+    }
+
+    // True when s holds exactly the primitives this bvh was last built or
+    // refit over, with the same positions, sizes, and materials.
+    bool matches(const scene& s) const {
+      if ((source_primitive_count(s) != slot_count()) ||
+          (s.objects().size() != objects_.size())) {
+        return false;
+      }
+      for (size_t i = 0; i < instances_.size(); ++i) {
+        auto& inst = s.instances()[i];
+        if ((static_cast<size_t>(&inst.object() - s.objects().data()) != instances_[i].object) ||
+            (inst.to_object() != instances_[i].to_object)) {
+          return false;
+        }
+      }
+      std::atomic<bool> same(true);
+      detail::parallel_for(slot_count(), 4096, [&](size_t begin, size_t end) {
+        primitive scratch;
+        for (size_t i = begin; (i < end) && same.load(std::memory_order_relaxed); ++i) {
+          auto& p = slot(i, scratch);
+          auto current = p;
+          load_primitive(s, current);
+          bool equal = (current.material == p.material);
+          if ((storage_ == vertex_storage::quantized) && (p.kind == primitive_kind::triangle)) {
+            // quantized triangles match the scene's if they encode the same
+            equal = equal && encodes_to(current, i);
+          } else {
+            equal = equal && (current.p0 == p.p0) && (current.p1 == p.p1) &&
+                    (current.p2 == p.p2) && (current.radius == p.radius);
+          }
+          if (!equal) {
+            same.store(false, std::memory_order_relaxed);
+          }
+        }
+      });
+      return same.load();
+    }
+
+    // Expected cost of tracing a ray through the tree, relative to the
+    // root's surface area.
+    double sah_cost() const noexcept {
+      if (nodes_.empty()) {
+        return 0.0;
+      }
+      double root_area = nodes_[0].bounds.surface_area();
+      if (root_area <= 0.0) {
+        return intersection_cost * slot_count();
+      }
+      double cost = 0.0;
+      for (auto& n : nodes_) {
+        double share = n.bounds.surface_area() / root_area;
+        cost += share * (is_leaf(n) ? intersection_cost * n.count : traversal_cost);
+      }
+      return cost;
+    }
+
+    double built_sah_cost() const noexcept { return built_sah_cost_; }
+
+    size_t node_count() const noexcept { return nodes_.size(); }
+    size_t primitive_count() const noexcept { return slot_count(); }
+
+    vertex_storage storage() const noexcept { return storage_; }
+
+    // Bytes of the bvh's own primitive storage, including the bottom level.
+    // The scene's primitives are not counted.
+    size_t primitive_bytes() const noexcept {
+      size_t bytes = primitives_.size() * sizeof(primitive) +
+                     packed_.size() * sizeof(packed_primitive) +
+                     clusters_.size() * sizeof(cluster) +
+                     instances_.size() * sizeof(placement);
+      for (auto& o : objects_) {
+        bytes += o.primitive_bytes();
+      }
+      return bytes;
+    }
+
+    // Bytes of the bvh's nodes, including the bottom level.
+    size_t node_bytes() const noexcept {
+      size_t bytes = nodes_.size() * sizeof(node);
+      for (auto& o : objects_) {
+        bytes += o.node_bytes();
+      }
+      return bytes;
+    }
+
+    // The largest distance along any axis between a stored triangle vertex,
+    // as decoded, and its original position, measured over every vertex
+    // when the tree was built: 0 for exact storage.
+    double max_vertex_error() const noexcept {
+      double error = max_error_;
+      for (auto& o : objects_) {
+        error = std::max(error, o.max_vertex_error());
+      }
+      return error;
+    }
+
+    aabb bounds() const noexcept {
+      return nodes_.empty() ? aabb() : nodes_[0].bounds;
+    }
+
+    // Closest intersection of r within (t_min, t_max), if any.
+    std::optional<hit> intersect(const ray& r,
+                                 double t_min = 0.0,
+                                 double t_max = std::numeric_limits<double>::infinity()) const noexcept {
+      if (nodes_.empty()) {
+        return std::nullopt;
+      }
+      vector3 inverse(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+      double closest = t_max;
+      size_t found = no_slot;
+      std::optional<hit> nested;
+      traverse(0, r, inverse, t_min, closest, found, nested);
+      return make_hit(r, closest, found, nested);
+    }
+
+    // Closest intersections of a packet of coherent rays, such as primary
+    // rays through a tile of neighboring pixels or shadow rays toward one
+    // point light. Equivalent to calling intersect on each ray, but the
+    // packet shares one traversal: each node's bounds are tested once
+    // against every ray, in a vectorizable lane loop, when its parent is
+    // visited, and the node is entered with a mask of the rays that reach
+    // it. Primitives are tested against all active rays the same way. Once
+    // a subtree is reached by few enough rays, they continue one at a time.
+    template <size_t N>
+    std::array<std::optional<hit>, N> intersect(const std::array<ray, N>& rays,
+                                                double t_min = 0.0,
+                                                double t_max = std::numeric_limits<double>::infinity()) const noexcept {
+      static_assert((N > 0) && (N <= 64), "packets hold between 1 and 64 rays");
+
+      std::array<std::optional<hit>, N> hits;
+      if (nodes_.empty()) {
+        return hits;
+      }
+
+      packet<N> p;
+      p.load(rays, t_max);
+      primitive scratch;
+
+      using mask_type = std::uint64_t;
+      const mask_type all = (N == 64) ? ~mask_type(0) : ((mask_type(1) << N) - 1);
+      const unsigned divergence_threshold = std::max<unsigned>(1, N / 4);
+
+      // nodes with the lanes that reached them when their parent was visited
+      std::array<std::pair<std::uint32_t, mask_type>, max_depth + 2> stack;
+      size_t top = 0;
+      if (auto root = all & packet<N>::entries(p.entry_distances(nodes_[0].bounds, t_min))) {
+        stack[top++] = {0, root};
+      }
+      while (top > 0) {
+        auto [index, active] = stack[--top];
+        auto& n = nodes_[index];
+
+        if (popcount(active) <= divergence_threshold) {
+          // the packet has diverged; finish the survivors one ray at a time
+          for (size_t lane = 0; lane < N; ++lane) {
+            if (active & (mask_type(1) << lane)) {
+              traverse(index, rays[lane], p.inverse(lane), t_min, p.closest[lane], p.found[lane], p.nested[lane]);
+            }
+          }
+          continue;
+        }
+
+        if (is_leaf(n)) {
+          for (size_t k = n.offset; k < n.offset + n.count; ++k) {
+            auto& prim = slot(k, scratch);
+            if (prim.kind != primitive_kind::instance) {
+              p.intersect(prim, k, t_min, active);
+              continue;
+            }
+            for (size_t lane = 0; lane < N; ++lane) {
+              if ((active & (mask_type(1) << lane)) &&
+                  intersect_instance(prim, rays[lane], t_min, p.closest[lane], p.nested[lane])) {
+                p.found[lane] = k;
+              }
+            }
+          }
+          continue;
+        }
+
+        std::uint32_t near_child = index + 1, far_child = n.offset;
+        auto near_entries = p.entry_distances(nodes_[near_child].bounds, t_min),
+             far_entries = p.entry_distances(nodes_[far_child].bounds, t_min);
+        mask_type near_active = active & packet<N>::entries(near_entries),
+                  far_active = active & packet<N>::entries(far_entries);
+        // visit first the child that the majority of active rays reach first
+        unsigned prefer_far = 0;
+        for (size_t lane = 0; lane < N; ++lane) {
+          if ((active & (mask_type(1) << lane)) && (far_entries[lane] < near_entries[lane])) {
+            ++prefer_far;
+          }
+        }
+        if (2 * prefer_far > popcount(active)) {
+          std::swap(near_child, far_child);
+          std::swap(near_active, far_active);
+        }
+        if (far_active != 0) {
+          stack[top++] = {far_child, far_active};
+        }
+        if (near_active != 0) {
+          stack[top++] = {near_child, near_active};
+        }
+      }
+
+      for (size_t lane = 0; lane < N; ++lane) {
+        hits[lane] = make_hit(rays[lane], p.closest[lane], p.found[lane], p.nested[lane]);
+      }
+      return hits;
+    }
+
+    // True when r hits any primitive within (t_min, t_max). Cheaper than
+    // intersect for shadow rays: traversal stops at the first hit found
+    // and never narrows the search interval.
+    bool occluded(const ray& r,
+                  double t_min = 0.0,
+                  double t_max = std::numeric_limits<double>::infinity()) const noexcept {
+      if (nodes_.empty()) {
+        return false;
+      }
+      vector3 inverse(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+      return traverse_occluded(0, r, inverse, t_min, t_max);
+    }
+
+    // occluded for a packet of coherent rays, such as the shadow rays from
+    // a tile of hit points toward one point light. Each ray leaves the
+    // packet as soon as it is found to be occluded.
+    template <size_t N>
+    std::array<bool, N> occluded(const std::array<ray, N>& rays,
+                                 double t_min = 0.0,
+                                 double t_max = std::numeric_limits<double>::infinity()) const noexcept {
+      static_assert((N > 0) && (N <= 64), "packets hold between 1 and 64 rays");
+
+      std::array<bool, N> result{};
+      if (nodes_.empty()) {
+        return result;
+      }
+
+      packet<N> p;
+      p.load(rays, t_max);
+      primitive scratch;
+
+      using mask_type = std::uint64_t;
+      mask_type pending = (N == 64) ? ~mask_type(0) : ((mask_type(1) << N) - 1);
+      const unsigned divergence_threshold = std::max<unsigned>(1, N / 4);
+
+      // nodes with the lanes that reached them when their parent was visited
+      std::array<std::pair<std::uint32_t, mask_type>, max_depth + 2> stack;
+      size_t top = 0;
+      if (auto root = pending & packet<N>::entries(p.entry_distances(nodes_[0].bounds, t_min))) {
+        stack[top++] = {0, root};
+      }
+      while ((top > 0) && (pending != 0)) {
+        auto [index, active] = stack[--top];
+        auto& n = nodes_[index];
+
+        active &= pending;
+        if (active == 0) {
+          continue;
+        }
+
+        if (popcount(active) <= divergence_threshold) {
+          for (size_t lane = 0; lane < N; ++lane) {
+            if ((active & (mask_type(1) << lane)) &&
+                traverse_occluded(index, rays[lane], p.inverse(lane), t_min, t_max)) {
+              result[lane] = true;
+              pending &= ~(mask_type(1) << lane);
+            }
+          }
+          continue;
+        }
+
+        if (is_leaf(n)) {
+          for (size_t k = n.offset; (k < n.offset + n.count) && (active != 0); ++k) {
+            auto& prim = slot(k, scratch);
+            if (prim.kind != primitive_kind::instance) {
+              p.intersect(prim, k, t_min, active);
+            }
+            for (size_t lane = 0; lane < N; ++lane) {
+              if ((active & (mask_type(1) << lane)) &&
+                  ((prim.kind == primitive_kind::instance) ? occluded_instance(prim, rays[lane], t_min, t_max)
+                                                           : (p.found[lane] != no_slot))) {
+                result[lane] = true;
+                active &= ~(mask_type(1) << lane);
+                pending &= ~(mask_type(1) << lane);
+              }
+            }
+          }
+          continue;
+        }
+
+        // order by the direction of the first active ray along the split axis
+        size_t first_lane = 0;
+        while (!(active & (mask_type(1) << first_lane))) {
+          ++first_lane;
+        }
+        double direction = (n.axis == 0) ? p.dx[first_lane] : ((n.axis == 1) ? p.dy[first_lane] : p.dz[first_lane]);
+        std::uint32_t near_child = index + 1, far_child = n.offset;
+        if (direction < 0.0) {
+          std::swap(near_child, far_child);
+        }
+        mask_type near_active = active & packet<N>::entries(p.entry_distances(nodes_[near_child].bounds, t_min)),
+                  far_active = active & packet<N>::entries(p.entry_distances(nodes_[far_child].bounds, t_min));
+        if (far_active != 0) {
+          stack[top++] = {far_child, far_active};
+        }
+        if (near_active != 0) {
+          stack[top++] = {near_child, near_active};
+        }
+      }
+      return result;
+    }
+
+    // occluded for an arbitrary batch of rays, such as all the shadow rays
+    // of a tile, traced in parallel. Rays are traced one at a time, which
+    // measured about twice as fast as 16-ray packets on teatime.json.
+    std::vector<bool> occluded(const std::vector<ray>& rays,
+                               double t_min = 0.0,
+                               double t_max = std::numeric_limits<double>::infinity()) const {
+      std::vector<char> results(rays.size());
+      detail::parallel_for(rays.size(), 1024, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          results[i] = occluded(rays[i], t_min, t_max);
+        }
+      });
+      return std::vector<bool>(results.begin(), results.end());
+    }
+  };
+
+  // Hierarchy over a scene's point lights, so that shading a point visits
+  // only the lights that can illuminate it rather than every light.
+  //
+  // In exact mode (max_error = 0) a query returns every light in front of
+  // the surface, meaning on the side its normal points to; in the reference
+  // Blinn-Phong model the other lights contribute nothing. A positive
+  // max_error also leaves out lights in front of the surface, dimmest
+  // subtrees first, as long as the most they could add to any color channel
+  // in shade() sums to at most max_error. Since colors are in [0, 1], a
+  // light adds at most intensity * max(color channels) * (diffuse_coeff +
+  // specular_coeff) to a channel, its weight().
+  class light_tree {
+  private:
+
+    static constexpr unsigned max_leaf_size = 4;
+
+    struct node {
+      aabb bounds;
+      // the sum of the weights of the node's lights
+      double weight;
+      // interior: index of the right child, the left child follows this node;
+      // leaf: index of the first light in order_
+      std::uint32_t offset;
+      // 0 for interior nodes
+      std::uint32_t count;
+    };
+
+    std::vector<node> nodes_;
+    std::vector<size_t> order_;
+    std::vector<vector3> locations_;
+    std::vector<double> weights_;
+
+    std::uint32_t build_node(size_t first, size_t last) {
+      auto index = static_cast<std::uint32_t>(nodes_.size());
+      nodes_.push_back(node{aabb(), 0.0, static_cast<std::uint32_t>(first), 0});
+
+      aabb box;
+      double weight = 0.0;
+      for (size_t i = first; i < last; ++i) {
+        box = box.merged(locations_[order_[i]]);
+        weight += weights_[order_[i]];
+      }
+      nodes_[index].bounds = box;
+      nodes_[index].weight = weight;
+
+      if (last - first <= max_leaf_size) {
+        nodes_[index].count = static_cast<std::uint32_t>(last - first);
+        return index;
+      }
+
+      // median split along the longest axis
+      auto extent = box.max() - box.min();
+      unsigned axis = (extent.x() >= extent.y()) ? ((extent.x() >= extent.z()) ? 0 : 2)
+                                                 : ((extent.y() >= extent.z()) ? 1 : 2);
+      size_t middle = first + (last - first) / 2;
+      std::nth_element(order_.begin() + first, order_.begin() + middle, order_.begin() + last,
+                       [&](size_t a, size_t b) { return locations_[a][axis] < locations_[b][axis]; });
+
+      build_node(first, middle);
+      nodes_[index].offset = build_node(middle, last);
+      return index;
+    }
+
+    // Whether a node may hold a light in front of the surface at point.
+    static bool in_front(const node& n, const vector3& point, const vector3& normal) noexcept {
+      // the box corner farthest along the normal
+      vector3 corner(normal.x() >= 0.0 ? n.bounds.max().x() : n.bounds.min().x(),
+                     normal.y() >= 0.0 ? n.bounds.max().y() : n.bounds.min().y(),
+                     normal.z() >= 0.0 ? n.bounds.max().z() : n.bounds.min().z());
+      return normal.dot(corner - point) > 0.0;
+    }
+
+  public:
+
+    light_tree() noexcept { }
+
+    explicit light_tree(const scene& s) {
+      build(s);
+    }
+
+    void build(const scene& s) {
+      nodes_.clear();
+      order_.clear();
+      locations_.clear();
+      weights_.clear();
+      // under flat shading lights add nothing
+      auto phong = std::get_if<phong_shader>(&s.shader());
+      double coeffs = phong ? (phong->diffuse_coeff() + phong->specular_coeff()) : 0.0;
+      for (auto& light : s.point_lights()) {
+        auto& c = light.color();
+        order_.push_back(locations_.size());
+        locations_.push_back(light.location());
+        weights_.push_back(light.intensity() * std::max(std::max(c.r(), c.g()), c.b()) * coeffs);
+      }
+      if (!order_.empty()) {
+        nodes_.reserve(2 * order_.size());
+        build_node(0, order_.size());
+      }
+    }
+
+    size_t light_count() const noexcept { return locations_.size(); }
+
+    // The most that light, an index into scene::point_lights(), adds to a
+    // color channel in shade().
+    double weight(size_t light) const noexcept { return weights_[light]; }
+
+    // Appends to out the indices, into scene::point_lights(), of the lights
+    // that may illuminate point, a surface point with the given unit normal,
+    // leaving out lights whose weights sum to at most max_error. Indices are
+    // not in any particular order.
+    void query(const vector3& point,
+               const vector3& normal,
+               double max_error,
+               std::vector<size_t>& out) const {
+      assert(max_error >= 0.0);
+      if (nodes_.empty()) {
+        return;
+      }
+      double budget = max_error;
+      std::vector<std::uint32_t> stack{0};
+      while (!stack.empty()) {
+        auto index = stack.back();
+        stack.pop_back();
+        auto& n = nodes_[index];
+        if (!in_front(n, point, normal)) {
+          continue;
+        }
+        if ((max_error > 0.0) && (n.weight <= budget)) {
+          budget -= n.weight;
+          continue;
+        }
+        if (n.count == 0) {
+          // the heavier child last, so that the lighter one is visited, and
+          // perhaps left out, first
+          auto left = index + 1, right = n.offset;
+          if (nodes_[left].weight > nodes_[right].weight) {
+            std::swap(left, right);
+          }
+          stack.push_back(right);
+          stack.push_back(left);
+          continue;
+        }
+        for (size_t i = n.offset; i < n.offset + n.count; ++i) {
+          auto light = order_[i];
+          if (normal.dot(locations_[light] - point) <= 0.0) {
+            continue;
+          }
+          if ((max_error > 0.0) && (weights_[light] <= budget)) {
+            budget -= weights_[light];
+          } else {
+            out.push_back(light);
+          }
+        }
+      }
+    }
+
+    std::vector<size_t> query(const vector3& point,
+                              const vector3& normal,
+                              double max_error = 0.0) const {
+      std::vector<size_t> out;
+      query(point, normal, max_error, out);
+      return out;
+    }
+  };
+
+  // An image with one color per pixel, stored in row-major order with
+  // pixel (0, 0) at the top-left.
+  class framebuffer {
+  private:
+    unsigned width_, height_;
+    std::vector<color> pixels_;
+
+  public:
+
+    framebuffer(unsigned width, unsigned height)
+    : width_(width), height_(height), pixels_(size_t(width) * height) {
+      assert(width > 0);
+      assert(height > 0);
+    }
+
+    // A framebuffer at the viewport's resolution.
+    explicit framebuffer(const viewport& vp)
+    : framebuffer(vp.x_resolution(), vp.y_resolution()) { }
+
+    constexpr unsigned width () const noexcept { return width_ ; }
+    constexpr unsigned height() const noexcept { return height_; }
+
+    const color& at(unsigned x, unsigned y) const noexcept {
+      assert((x < width_) && (y < height_));
+      return pixels_[size_t(y) * width_ + x];
+    }
+
+    void set(unsigned x, unsigned y, const color& c) noexcept {
+      assert((x < width_) && (y < height_));
+      pixels_[size_t(y) * width_ + x] = c;
+    }
+
+    // The width pixels of row y.
+    color* row(unsigned y) noexcept {
+      assert(y < height_);
+      return pixels_.data() + size_t(y) * width_;
+    }
+    const color* row(unsigned y) const noexcept {
+      assert(y < height_);
+      return pixels_.data() + size_t(y) * width_;
+    }
+
+    const std::vector<color>& pixels() const noexcept { return pixels_; }
+  };
+
+  enum class image_format {
+    // binary portable pixmap (P6), 8 bits per channel
+    ppm,
+    // portable float map, 32-bit floats per channel
+    pfm,
+    // PNG, 8 bits per channel, with uncompressed deflate blocks
+    png
+  };
+
+  // Writes an image to a stream one row at a time, as soon as each row is
+  // available, so that a reader of a file or pipe sees partial images and
+  // the whole image is never buffered. Rows must be written in the order
+  // given by next_row(): top to bottom, except for PFM, which stores rows
+  // bottom to top.
+  class scanline_writer {
+  private:
+    std::ostream& out_;
+    unsigned width_, height_, rows_written_;
+    image_format format_;
+    std::vector<unsigned char> bytes_;
+    std::uint32_t adler_a_, adler_b_;
+
+    static std::uint32_t crc32(std::uint32_t crc, const unsigned char* data, size_t size) noexcept {
+      static const auto table = []() {
+        std::array<std::uint32_t, 256> t{};
+        for (std::uint32_t n = 0; n < 256; ++n) {
+          std::uint32_t c = n;
+          for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+          }
+          t[n] = c;
+        }
+        return t;
+      }();
+      crc = ~crc;
+      for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+      }
+      return ~crc;
+    }
+
+    static void append_u32(std::vector<unsigned char>& v, std::uint32_t x) {
+      v.push_back(static_cast<unsigned char>(x >> 24));
+      v.push_back(static_cast<unsigned char>(x >> 16));
+      v.push_back(static_cast<unsigned char>(x >> 8));
+      v.push_back(static_cast<unsigned char>(x));
+    }
+
+    void write_bytes(const void* data, size_t size) {
+      out_.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+      if (!out_) {
+        throw write_exception("error writing image");
+      }
+    }
+
+    void write_png_chunk(const char* type, const std::vector<unsigned char>& data) {
+      std::vector<unsigned char> chunk;
+      chunk.reserve(data.size() + 12);
+      append_u32(chunk, static_cast<std::uint32_t>(data.size()));
+      chunk.insert(chunk.end(), type, type + 4);
+      chunk.insert(chunk.end(), data.begin(), data.end());
+      append_u32(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+      write_bytes(chunk.data(), chunk.size());
+    }
+
+    static unsigned char to_byte(double channel) noexcept {
+      return static_cast<unsigned char>(std::lround(std::clamp(channel, 0.0, 1.0) * 255.0));
+    }
+
+  public:
+
+    scanline_writer(std::ostream& out, unsigned width, unsigned height, image_format format)
+    : out_(out),
+      width_(width),
+      height_(height),
+      rows_written_(0),
+      format_(format),
+      adler_a_(1),
+      adler_b_(0) {
+      assert(width > 0);
+      assert(height > 0);
+
+      switch (format_) {
+      case image_format::ppm:
+        out_ << "P6\n" << width_ << " " << height_ << "\n255\n";
+        break;
+      case image_format::pfm: {
+        // a negative scale marks little-endian floats
+        const std::uint16_t probe = 1;
+        bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+        out_ << "PF\n" << width_ << " " << height_ << "\n" << (little_endian ? "-1.0" : "1.0") << "\n";
+        break;
+      }
+      case image_format::png: {
+        const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        write_bytes(signature, sizeof(signature));
+        std::vector<unsigned char> header;
+        append_u32(header, width_);
+        append_u32(header, height_);
+        // 8 bits per channel, RGB, deflate, adaptive filtering, no interlace
+        header.insert(header.end(), {8, 2, 0, 0, 0});
+        write_png_chunk("IHDR", header);
+        break;
+      }
+      }
+      out_.flush();
+      if (!out_) {
+        throw write_exception("error writing image header");
+      }
+    }
+
+    // A writer for an image at the viewport's resolution.
+    scanline_writer(std::ostream& out, const viewport& vp, image_format format)
+    : scanline_writer(out, vp.x_resolution(), vp.y_resolution(), format) { }
+
+    constexpr unsigned width () const noexcept { return width_ ; }
+    constexpr unsigned height() const noexcept { return height_; }
+    constexpr image_format format() const noexcept { return format_; }
+
+    constexpr bool done() const noexcept { return rows_written_ == height_; }
+
+    // The image row, counting from the top, that write_row expects next.
+    constexpr unsigned next_row() const noexcept {
+      return (format_ == image_format::pfm) ? (height_ - 1 - rows_written_) : rows_written_;
+    }
+
+    // Writes the width pixels of row next_row(), and flushes the stream.
+    void write_row(const color* pixels) {
+      assert(!done());
+      bytes_.clear();
+      switch (format_) {
+      case image_format::ppm:
+        for (unsigned x = 0; x < width_; ++x) {
+          bytes_.push_back(to_byte(pixels[x].r()));
+          bytes_.push_back(to_byte(pixels[x].g()));
+          bytes_.push_back(to_byte(pixels[x].b()));
+        }
+        write_bytes(bytes_.data(), bytes_.size());
+        break;
+      case image_format::pfm: {
+        std::vector<float> floats;
+        floats.reserve(3 * size_t(width_));
+        for (unsigned x = 0; x < width_; ++x) {
+          floats.push_back(static_cast<float>(pixels[x].r()));
+          floats.push_back(static_cast<float>(pixels[x].g()));
+          floats.push_back(static_cast<float>(pixels[x].b()));
+        }
+        write_bytes(floats.data(), floats.size() * sizeof(float));
+        break;
+      }
+      case image_format::png: {
+        // one IDAT chunk per row; the zlib stream is a sequence of stored
+        // deflate blocks, so rows need no compressor state
+        std::vector<unsigned char> raw;
+        raw.reserve(1 + 3 * size_t(width_));
+        raw.push_back(0);  // filter type: none
+        for (unsigned x = 0; x < width_; ++x) {
+          raw.push_back(to_byte(pixels[x].r()));
+          raw.push_back(to_byte(pixels[x].g()));
+          raw.push_back(to_byte(pixels[x].b()));
+        }
+        for (auto byte : raw) {
+          adler_a_ = (adler_a_ + byte) % 65521;
+          adler_b_ = (adler_b_ + adler_a_) % 65521;
+        }
+        if (rows_written_ == 0) {
+          // zlib header: deflate, 32K window, no preset dictionary
+          bytes_.insert(bytes_.end(), {0x78, 0x01});
+        }
+        bool last_row = rows_written_ + 1 == height_;
+        for (size_t offset = 0; offset < raw.size(); ) {
+          size_t length = std::min<size_t>(65535, raw.size() - offset);
+          bool final_block = last_row && (offset + length == raw.size());
+          bytes_.push_back(final_block ? 1 : 0);
+          bytes_.push_back(static_cast<unsigned char>(length));
+          bytes_.push_back(static_cast<unsigned char>(length >> 8));
+          bytes_.push_back(static_cast<unsigned char>(~length));
+          bytes_.push_back(static_cast<unsigned char>(~length >> 8));
+          bytes_.insert(bytes_.end(), raw.begin() + offset, raw.begin() + offset + length);
+          offset += length;
+        }
+        if (last_row) {
+          append_u32(bytes_, (adler_b_ << 16) | adler_a_);
+        }
+        write_png_chunk("IDAT", bytes_);
+        if (last_row) {
+          write_png_chunk("IEND", std::vector<unsigned char>());
+        }
+        break;
+      }
+      }
+      ++rows_written_;
+      out_.flush();
+    }
+  };
+
+  // Writes a whole framebuffer to out.
+  void write_image(const framebuffer& image, std::ostream& out, image_format format) {
+    scanline_writer writer(out, image.width(), image.height(), format);
+    while (!writer.done()) {
+      writer.write_row(image.row(writer.next_row()));
+    }
+  }
+
+  namespace detail {
+
+    // Shadow rays start this far along their segment toward the light,
+    // in units of the segment length, so surfaces do not shadow themselves.
+    constexpr double shadow_epsilon = 1e-6;
+
+    color clamped_color(double r, double g, double b) noexcept {
+      return color(std::clamp(r, 0.0, 1.0), std::clamp(g, 0.0, 1.0), std::clamp(b, 0.0, 1.0));
+    }
+
+    ray shadow_ray(const vector3& point, const point_light& light) noexcept {
+      return ray(point, light.location() - point);
+    }
+  }
+
+  // A point on a surface as seen along a primary ray: everything needed to
+  // shade it except the lights, materials, and shader.
+  class surface_point {
+  private:
+    vector3 position_, normal_, to_eye_;
+    size_t material_index_;
+
+  public:
+
+    constexpr surface_point() noexcept
+    : material_index_(0) { }
+
+    // Builds the surface point of h, a hit of r. The normal is flipped, if
+    // needed, to face the eye.
+    surface_point(const ray& r, const hit& h) noexcept
+    : position_(r.at(h.t())),
+      normal_(h.normal()),
+      to_eye_((-r.direction()).normalized()),
+      material_index_(h.material_index()) {
+      if (normal_.dot(to_eye_) < 0.0) {
+        normal_ = -normal_;
+      }
+    }
+
+    constexpr const vector3& position() const noexcept { return position_; }
+    // unit length, facing the eye
+    constexpr const vector3& normal() const noexcept { return normal_; }
+    // unit length, from the position toward the eye
+    constexpr const vector3& to_eye() const noexcept { return to_eye_; }
+    // into scene::materials()
+    constexpr size_t material_index() const noexcept { return material_index_; }
+  };
+
+  // The color of p under the scene's shader. Flat shading uses the material
+  // color. Blinn-Phong shading, as in section 4.5 of Marschner and Shirley,
+  // sums an ambient term and, for each point light i where visible(i) is
+  // true, diffuse and specular terms. Channels are clamped to [0, 1].
+  //
+  // Given lights, a light_tree of s, only the lights its query returns for
+  // p with max_error are visited. With max_error 0 the color is the same
+  // as without the tree; otherwise each channel is off by at most
+  // max_error.
+  template <typename Visible>
+  color shade(const scene& s,
+              const surface_point& p,
+              Visible visible,
+              const light_tree* lights = nullptr,
+              double max_error = 0.0) {
+    auto& m = s.materials()[p.material_index()];
+    auto phong = std::get_if<phong_shader>(&s.shader());
+    if (phong == nullptr) {
+      return m.color();
+    }
+
+    double r = phong->ambient_coeff() * phong->ambient_color().r() * m.color().r(),
+           g = phong->ambient_coeff() * phong->ambient_color().g() * m.color().g(),
+           b = phong->ambient_coeff() * phong->ambient_color().b() * m.color().b();
+    auto add = [&](size_t i) {
+      auto& light = s.point_lights()[i];
+      auto to_light = (light.location() - p.position()).normalized();
+      double diffuse = p.normal().dot(to_light);
+      if ((diffuse <= 0.0) || !visible(i)) {
+        return;
+      }
+      auto half = (to_light + p.to_eye()).normalized();
+      double specular = std::pow(std::max(0.0, p.normal().dot(half)), m.shininess()),
+             kd = phong->diffuse_coeff() * diffuse,
+             ks = phong->specular_coeff() * specular;
+      r += light.intensity() * light.color().r() * (kd * m.color().r() + ks);
+      g += light.intensity() * light.color().g() * (kd * m.color().g() + ks);
+      b += light.intensity() * light.color().b() * (kd * m.color().b() + ks);
+    };
+    if (lights != nullptr) {
+      assert(lights->light_count() == s.point_lights().size());
+      thread_local std::vector<size_t> lit;
+      lit.clear();
+      lights->query(p.position(), p.normal(), max_error, lit);
+      // in scene order, so that the sums round as they would without the tree
+      std::sort(lit.begin(), lit.end());
+      for (auto i : lit) {
+        add(i);
+      }
+    } else {
+      for (size_t i = 0; i < s.point_lights().size(); ++i) {
+        add(i);
+      }
+    }
+    return detail::clamped_color(r, g, b);
+  }
+
+  namespace detail {
+
+    // The color seen along primary ray r, whose closest hit is h, shading
+    // with lights as in shade().
+    color trace(const scene& s,
+                const bvh& tree,
+                const ray& r,
+                const std::optional<hit>& h,
+                const light_tree* lights = nullptr,
+                double max_error = 0.0) {
+      if (!h) {
+        return s.background();
+      }
+      surface_point p(r, *h);
+      return shade(s, p, [&](size_t light) {
+        return !tree.occluded(shadow_ray(p.position(), s.point_lights()[light]), shadow_epsilon, 1.0);
+      }, lights, max_error);
+    }
+
+    // Renders image row y into row. Primary rays are traced one at a time:
+    // with double-precision lanes, 8- and 16-ray packets measured slower
+    // than single rays on teatime.json.
+    void render_row(const scene& s,
+                    const bvh& tree,
+                    const ray_generator& eye,
+                    unsigned y,
+                    color* row,
+                    const light_tree* lights = nullptr,
+                    double max_error = 0.0) {
+      unsigned width = s.viewport().x_resolution();
+      for (unsigned x = 0; x < width; ++x) {
+        auto r = eye.pixel(x, y);
+        row[x] = trace(s, tree, r, tree.intersect(r), lights, max_error);
+      }
+    }
+  }
+
+  // Renders s, whose primitives tree must match, one ray per pixel. Rows
+  // are rendered in parallel.
+  framebuffer render(const scene& s, const bvh& tree) {
+    framebuffer result(s.viewport());
+    ray_generator eye(s);
+    detail::parallel_for(result.height(), 1, [&](size_t begin, size_t end) {
+      for (auto y = static_cast<unsigned>(begin); y < end; ++y) {
+        detail::render_row(s, tree, eye, y, result.row(y));
+      }
+    });
+    return result;
+  }
+
+  // render(s, tree), shading each point with only the lights that lights,
+  // a light_tree of s, returns for it; see shade(). For scenes with many
+  // lights, most of which face away from or are too dim for any one point.
+  framebuffer render(const scene& s, const bvh& tree, const light_tree& lights, double max_error = 0.0) {
+    assert(max_error >= 0.0);
+    framebuffer result(s.viewport());
+    ray_generator eye(s);
+    detail::parallel_for(result.height(), 1, [&](size_t begin, size_t end) {
+      for (auto y = static_cast<unsigned>(begin); y < end; ++y) {
+        detail::render_row(s, tree, eye, y, result.row(y), &lights, max_error);
+      }
+    });
+    return result;
+  }
+
+  // Renders s, whose primitives tree must match, progressively: first one
+  // pixel in every 16 x 16 block, then in every 8 x 8, 4 x 4, and 2 x 2
+  // block, and finally every remaining pixel. Each level traces only the
+  // pixels that earlier levels did not. It then fills every untraced pixel
+  // with the nearest traced sample above and to its left, and calls
+  // on_level(image, step) with the step between traced pixels. The last
+  // call has step 1, and its image is identical to render(s, tree).
+  template <typename OnLevel>
+  framebuffer render_progressive(const scene& s, const bvh& tree, OnLevel on_level) {
+    framebuffer result(s.viewport());
+    ray_generator eye(s);
+    for (unsigned step = 16; step >= 1; step /= 2) {
+      detail::parallel_for((result.height() + step - 1) / step, 1, [&](size_t begin, size_t end) {
+        for (size_t row = begin; row < end; ++row) {
+          auto y = static_cast<unsigned>(row * step);
+          bool coarse_row = (step < 16) && (y % (2 * step) == 0);
+          for (unsigned x = 0; x < result.width(); x += step) {
+            if (coarse_row && (x % (2 * step) == 0)) {
+              continue;  // traced at an earlier level
+            }
+            auto r = eye.pixel(x, y);
+            result.set(x, y, detail::trace(s, tree, r, tree.intersect(r)));
+          }
+        }
+      });
+      if (step > 1) {
+        detail::parallel_for(result.height(), 16, [&](size_t begin, size_t end) {
+          for (auto y = static_cast<unsigned>(begin); y < end; ++y) {
+            for (unsigned x = 0; x < result.width(); ++x) {
+              if ((x % step != 0) || (y % step != 0)) {
+                result.set(x, y, result.at(x - x % step, y - y % step));
+              }
+            }
+          }
+        });
+      }
+      on_level(static_cast<const framebuffer&>(result), step);
+    }
+    return result;
+  }
+
+  // Settings for adaptive antialiasing.
+  class antialiasing {
+  private:
+    double threshold_;
+    unsigned grid_;
+
+  public:
+
+    // A pixel is refined when a color channel differs from that of a
+    // neighboring pixel by more than threshold, or when the two see
+    // different primitives. A refined pixel averages grid x grid samples.
+    constexpr antialiasing(double threshold = 0.1, unsigned grid = 3) noexcept
+    : threshold_(threshold), grid_(grid) {
+      assert(threshold >= 0.0);
+      assert(grid > 0);
+    }
+
+    constexpr double threshold() const noexcept { return threshold_; }
+    constexpr unsigned grid() const noexcept { return grid_; }
+  };
+
+  // An image rendered with adaptive antialiasing, and what it cost.
+  class antialiased_image {
+  private:
+    framebuffer image_;
+    size_t samples_, refined_pixels_;
+
+  public:
+
+    antialiased_image(framebuffer&& image, size_t samples, size_t refined_pixels) noexcept
+    : image_(std::move(image)), samples_(samples), refined_pixels_(refined_pixels) { }
+
+    const framebuffer& image() const noexcept { return image_; }
+    // primary rays traced in total
+    constexpr size_t samples() const noexcept { return samples_; }
+    // pixels that received more than one sample
+    constexpr size_t refined_pixels() const noexcept { return refined_pixels_; }
+  };
+
+  // Renders s, whose primitives tree must match, with adaptive
+  // supersampling. Every pixel first gets one sample at its center; extra
+  // samples go only to pixels where options decides neighbors differ, such
+  // as silhouettes, shadow edges, and material boundaries, while flat
+  // background and smooth interiors keep their single sample.
+  antialiased_image render_antialiased(const scene& s,
+                                       const bvh& tree,
+                                       const antialiasing& options = antialiasing()) {
+    framebuffer result(s.viewport());
+    ray_generator eye(s);
+    const unsigned width = result.width(), height = result.height();
+
+    // first pass: one sample per pixel, remembering which primitive it saw,
+    // and for instances, which primitive of the instance's object
+    using primitive_id = std::pair<std::int64_t, std::int64_t>;
+    auto id = [](primitive_kind kind, size_t index) {
+      return static_cast<std::int64_t>(index * 3 + static_cast<size_t>(kind));
+    };
+    const primitive_id miss(-1, -1);
+    std::vector<primitive_id> seen(size_t(width) * height);
+    detail::parallel_for(height, 1, [&](size_t begin, size_t end) {
+      for (auto y = static_cast<unsigned>(begin); y < end; ++y) {
+        for (unsigned x = 0; x < width; ++x) {
+          auto r = eye.pixel(x, y);
+          auto h = tree.intersect(r);
+          seen[size_t(y) * width + x] =
+            !h ? miss : primitive_id(id(h->kind(), h->index()), id(h->local_kind(), h->local_index()));
+          result.set(x, y, detail::trace(s, tree, r, h));
+        }
+      }
+    });
+
+    // mark both pixels of every pair of neighbors that differ
+    auto differ = [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+      if (seen[size_t(y0) * width + x0] != seen[size_t(y1) * width + x1]) {
+        return true;
+      }
+      auto& a = result.at(x0, y0);
+      auto& b = result.at(x1, y1);
+      return (std::abs(a.r() - b.r()) > options.threshold()) ||
+             (std::abs(a.g() - b.g()) > options.threshold()) ||
+             (std::abs(a.b() - b.b()) > options.threshold());
+    };
+    std::vector<char> refine(size_t(width) * height, 0);
+    for (unsigned y = 0; y < height; ++y) {
+      for (unsigned x = 0; x < width; ++x) {
+        if ((x + 1 < width) && differ(x, y, x + 1, y)) {
+          refine[size_t(y) * width + x] = refine[size_t(y) * width + x + 1] = 1;
+        }
+        if ((y + 1 < height) && differ(x, y, x, y + 1)) {
+          refine[size_t(y) * width + x] = refine[size_t(y + 1) * width + x] = 1;
+        }
+      }
+    }
+
+    // second pass: a stratified grid of samples in each marked pixel, which
+    // for odd grids reuses the center sample from the first pass
+    const unsigned grid = options.grid();
+    const bool reuse_center = (grid % 2) == 1;
+    std::vector<size_t> row_samples(height, 0), row_refined(height, 0);
+    if (grid > 1) {
+      detail::parallel_for(height, 1, [&](size_t begin, size_t end) {
+        for (auto y = static_cast<unsigned>(begin); y < end; ++y) {
+          for (unsigned x = 0; x < width; ++x) {
+            if (!refine[size_t(y) * width + x]) {
+              continue;
+            }
+            double r = 0.0, g = 0.0, b = 0.0;
+            for (unsigned j = 0; j < grid; ++j) {
+              for (unsigned i = 0; i < grid; ++i) {
+                color c;
+                if (reuse_center && (i == grid / 2) && (j == grid / 2)) {
+                  c = result.at(x, y);
+                } else {
+                  auto sample_ray = eye(x + (i + 0.5) / grid, y + (j + 0.5) / grid);
+                  c = detail::trace(s, tree, sample_ray, tree.intersect(sample_ray));
+                  ++row_samples[y];
+                }
+                r += c.r();
+                g += c.g();
+                b += c.b();
+              }
+            }
+            double n = double(grid) * grid;
+            result.set(x, y, detail::clamped_color(r / n, g / n, b / n));
+            ++row_refined[y];
+          }
+        }
+      });
+    }
+
+    size_t samples = size_t(width) * height, refined = 0;
+    for (unsigned y = 0; y < height; ++y) {
+      samples += row_samples[y];
+      refined += row_refined[y];
+    }
+    return antialiased_image(std::move(result), samples, refined);
+  }
+
+  // Renders s, whose primitives tree must match, streaming rows to out as
+  // they finish. Rows are rendered in parallel, in out's row order; each
+  // is written as soon as it and every row before it are done. At most a
+  // couple of rows per thread are buffered, never the whole image.
+  void render(const scene& s, const bvh& tree, scanline_writer& out) {
+    assert(out.width() == s.viewport().x_resolution());
+    assert(out.height() == s.viewport().y_resolution());
+
+    ray_generator eye(s);
+    const unsigned height = out.height(),
+                   threads = std::max(1u, std::min(std::thread::hardware_concurrency(), height)),
+                   window = 2 * threads;
+    bool bottom_up = out.next_row() != 0;
+
+    // rows in flight, in slot (sequence % window)
+    std::vector<std::vector<color>> slots(window, std::vector<color>(out.width()));
+    std::vector<char> ready(window, 0);
+    unsigned next_sequence = 0, written = 0;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable row_ready, slot_free;
+
+    // a worker that throws stops the others, and the writer rethrows
+    auto worker = [&]() {
+      try {
+        for (;;) {
+          unsigned sequence;
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            slot_free.wait(lock, [&]() { return (next_sequence >= height) || (next_sequence < written + window); });
+            if (next_sequence >= height) {
+              return;
+            }
+            sequence = next_sequence++;
+          }
+          unsigned y = bottom_up ? (height - 1 - sequence) : sequence;
+          detail::render_row(s, tree, eye, y, slots[sequence % window].data());
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready[sequence % window] = 1;
+          }
+          row_ready.notify_one();
+        }
+      } catch (...) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+          next_sequence = height;
+        }
+        row_ready.notify_all();
+        slot_free.notify_all();
+      }
+    };
+
+    std::vector<std::thread> workers;
+
+    // write rows in order on this thread, so the stream has one writer
+    try {
+      for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back(worker);
+      }
+      while (written < height) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          row_ready.wait(lock, [&]() { return error || (ready[written % window] != 0); });
+          if (error) {
+            std::rethrow_exception(error);
+          }
+        }
+        out.write_row(slots[written % window].data());
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          ready[written % window] = 0;
+          ++written;
+        }
+        slot_free.notify_all();
+      }
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        next_sequence = height;
+      }
+      slot_free.notify_all();
+      for (auto& w : workers) {
+        w.join();
+      }
+      throw;
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+
+  framebuffer render(const scene& s) {
+    return render(s, bvh(s));
+  }
+
+  // A fixed set of worker threads that runs submitted tasks in FIFO order.
+  // Render jobs share one pool, so running several jobs at once never
+  // uses more threads than the pool has.
+  class worker_pool {
+  private:
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable available_;
+    bool stopping_;
+
+  public:
+
+    explicit worker_pool(unsigned threads = std::thread::hardware_concurrency())
+    : stopping_(false) {
+      threads = std::max(1u, threads);
+      for (unsigned i = 0; i < threads; ++i) {
+        threads_.emplace_back([this]() {
+          for (;;) {
+            std::function<void()> task;
+            {
+              std::unique_lock<std::mutex> lock(mutex_);
+              available_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+              if (tasks_.empty()) {
+                return;
+              }
+              task = std::move(tasks_.front());
+              tasks_.pop_front();
+            }
+            task();
+          }
+        });
+      }
+    }
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    // Runs every task already submitted, then joins the threads.
+    ~worker_pool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      available_.notify_all();
+      for (auto& t : threads_) {
+        t.join();
+      }
+    }
+
+    unsigned size() const noexcept { return static_cast<unsigned>(threads_.size()); }
+
+    // task must not throw.
+    void submit(std::function<void()> task) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+      }
+      available_.notify_one();
+    }
+  };
+
+  // A rectangle of pixels, in image coordinates.
+  class tile {
+  private:
+    unsigned x_, y_, width_, height_;
+
+  public:
+
+    constexpr tile(unsigned x, unsigned y, unsigned width, unsigned height) noexcept
+    : x_(x), y_(y), width_(width), height_(height) { }
+
+    constexpr unsigned x     () const noexcept { return x_     ; }
+    constexpr unsigned y     () const noexcept { return y_     ; }
+    constexpr unsigned width () const noexcept { return width_ ; }
+    constexpr unsigned height() const noexcept { return height_; }
+  };
+
+  // Why a render job ended without an image.
+  class render_exception {
+  private:
+    std::string message_;
+
+  public:
+
+    render_exception(const std::string& message)
+    : message_(message) { }
+
+    render_exception(std::string&& message)
+    : message_(message) { }
+
+    constexpr const std::string& message() const noexcept { return message_; }
+  };
+
+  // A render running in the background on a worker_pool. The image is
+  // divided into tiles, and cancellation and the deadline are checked
+  // before each tile. Each pool task renders one tile and then requeues
+  // itself, so jobs sharing a pool take turns rather than running to
+  // completion in submission order. Copies of a render_job refer to the
+  // same job.
+  class render_job {
+  public:
+
+    using clock = std::chrono::steady_clock;
+    // Called on a worker thread as each tile is finished; the tile's pixels
+    // in the framebuffer are final, the rest may still be changing.
+    using tile_callback = std::function<void(const tile&, const framebuffer&)>;
+
+    static constexpr unsigned tile_size = 32;
+
+  private:
+
+    struct state {
+      worker_pool* pool_;
+      std::shared_ptr<const scene> scene_;
+      std::shared_ptr<const bvh> tree_;
+      std::optional<clock::time_point> deadline_;
+      tile_callback on_tile_;
+      ray_generator eye_;
+      framebuffer image_;
+      unsigned columns_, tiles_;
+      std::atomic<unsigned> next_tile_, tiles_done_, runners_;
+      std::atomic<bool> cancelled_, expired_, failed_;
+      // what the first failed tile threw; written once, before failed_'s
+      // runner finishes
+      std::exception_ptr error_;
+      std::promise<framebuffer> promise_;
+
+      state(worker_pool& pool,
+            std::shared_ptr<const scene>&& s,
+            std::shared_ptr<const bvh>&& tree,
+            std::optional<clock::time_point> deadline,
+            tile_callback&& on_tile)
+      : pool_(&pool),
+        scene_(std::move(s)),
+        tree_(std::move(tree)),
+        deadline_(deadline),
+        on_tile_(std::move(on_tile)),
+        eye_(*scene_),
+        image_(scene_->viewport()),
+        columns_((image_.width() + tile_size - 1) / tile_size),
+        tiles_(columns_ * ((image_.height() + tile_size - 1) / tile_size)),
+        next_tile_(0),
+        tiles_done_(0),
+        runners_(0),
+        cancelled_(false),
+        expired_(false),
+        failed_(false) { }
+
+      bool stopped() noexcept {
+        if (!expired_ && deadline_ && (clock::now() >= *deadline_)) {
+          expired_ = true;
+        }
+        return cancelled_ || expired_ || failed_;
+      }
+
+      void render_tile(unsigned index) {
+        unsigned x0 = (index % columns_) * tile_size, y0 = (index / columns_) * tile_size,
+                 x1 = std::min(x0 + tile_size, image_.width()),
+                 y1 = std::min(y0 + tile_size, image_.height());
+        for (unsigned y = y0; y < y1; ++y) {
+          for (unsigned x = x0; x < x1; ++x) {
+            auto r = eye_.pixel(x, y);
+            image_.set(x, y, detail::trace(*scene_, *tree_, r, tree_->intersect(r)));
+          }
+        }
+        if (on_tile_) {
+          on_tile_(tile(x0, y0, x1 - x0, y1 - y0), image_);
+        }
+      }
+
+      // Body of the job's pool tasks: renders the next tile and requeues
+      // itself, behind any tasks other jobs queued meanwhile. Never throws;
+      // the last runner to finish settles the future.
+      void run(const std::shared_ptr<state>& self) noexcept {
+        if (!stopped()) {
+          unsigned index = next_tile_++;
+          if (index < tiles_) {
+            try {
+              render_tile(index);
+              ++tiles_done_;
+              pool_->submit([self]() { self->run(self); });
+              return;
+            } catch (...) {
+              if (!failed_.exchange(true)) {
+                error_ = std::current_exception();
+              }
+            }
+          }
+        }
+        if (--runners_ == 0) {
+          if (failed_) {
+            promise_.set_exception(error_);
+          } else if (tiles_done_ == tiles_) {
+            promise_.set_value(std::move(image_));
+          } else {
+            promise_.set_exception(std::make_exception_ptr(
+              render_exception(cancelled_ ? "render cancelled" : "render deadline exceeded")));
+          }
+        }
+      }
+    };
+
+    std::shared_ptr<state> state_;
+    std::shared_future<framebuffer> future_;
+
+  public:
+
+    // Starts rendering s, whose primitives tree must match, on pool, which
+    // must outlive the job's tasks. The job runs on at most thread_budget
+    // of the pool's threads at once, or on all of them when thread_budget
+    // is 0. A job still running at deadline stops before its next tile.
+    render_job(worker_pool& pool,
+               std::shared_ptr<const scene> s,
+               std::shared_ptr<const bvh> tree,
+               unsigned thread_budget = 0,
+               std::optional<clock::time_point> deadline = std::nullopt,
+               tile_callback on_tile = nullptr)
+    : state_(std::make_shared<state>(pool, std::move(s), std::move(tree), deadline, std::move(on_tile))) {
+      assert(state_->scene_ && state_->tree_);
+      future_ = state_->promise_.get_future().share();
+      unsigned runners = (thread_budget == 0) ? pool.size() : std::min(thread_budget, pool.size());
+      runners = std::max(1u, std::min(runners, state_->tiles_));
+      state_->runners_ = runners;
+      for (unsigned i = 0; i < runners; ++i) {
+        pool.submit([job = state_]() { job->run(job); });
+      }
+    }
+
+    // Asks the job to stop before its next tile. The future then throws
+    // render_exception, unless the last tile had already started.
+    void cancel() noexcept { state_->cancelled_ = true; }
+
+    bool cancelled() const noexcept { return state_->cancelled_; }
+
+    unsigned tiles() const noexcept { return state_->tiles_; }
+    unsigned tiles_done() const noexcept { return state_->tiles_done_; }
+
+    // The fraction of tiles finished, from 0 to 1.
+    double progress() const noexcept {
+      return static_cast<double>(state_->tiles_done_) / state_->tiles_;
+    }
+
+    // The finished image, or a render_exception when the job was cancelled
+    // or ran past its deadline. If rendering a tile or the tile callback
+    // threw, the future throws that instead, and the job stops.
+    const std::shared_future<framebuffer>& future() const noexcept { return future_; }
+
+    bool done() const {
+      return future_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+  };
+
+  // A relighting cache: renders a scene while keeping a G-buffer of every
+  // pixel's primary hit, and the shadow visibility of each point light at
+  // each hit. A later render of a scene that differs only in its lights,
+  // materials, shader, or background re-shades from the G-buffer without
+  // tracing primary rays, and traces shadow rays only for lights that
+  // moved or were added. Any other change retraces everything.
+  class relight_cache {
+  private:
+    std::optional<camera> camera_;
+    std::optional<viewport> viewport_;
+    projection projection_;
+    bvh tree_;
+    // per pixel; a surface point only where hit_ is true
+    std::vector<surface_point> points_;
+    std::vector<char> hit_;
+    // the lights whose visibility is cached, and per light, per pixel,
+    // whether that light reaches the pixel's surface point
+    std::vector<vector3> light_locations_;
+    std::vector<std::vector<bool>> visible_;
+    bool last_retraced_;
+    size_t last_shadow_lights_;
+
+    bool same_view(const scene& s) const noexcept {
+      return camera_ && (*camera_ == s.camera()) &&
+             viewport_ && (*viewport_ == s.viewport()) &&
+             (projection_ == s.projection());
+    }
+
+    void trace_primary(const scene& s) {
+      camera_ = s.camera();
+      viewport_ = s.viewport();
+      projection_ = s.projection();
+      if (!tree_.matches(s)) {
+        tree_.build(s);
+      }
+      size_t width = s.viewport().x_resolution(), height = s.viewport().y_resolution();
+      points_.assign(width * height, surface_point());
+      hit_.assign(width * height, 0);
+      light_locations_.clear();
+      visible_.clear();
+
+      ray_generator eye(s);
+      detail::parallel_for(height, 1, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; ++y) {
+          for (size_t x = 0; x < width; ++x) {
+            auto r = eye.pixel(static_cast<unsigned>(x), static_cast<unsigned>(y));
+            if (auto h = tree_.intersect(r)) {
+              points_[y * width + x] = surface_point(r, *h);
+              hit_[y * width + x] = 1;
+            }
+          }
+        }
+      });
+    }
+
+  public:
+
+    relight_cache() noexcept
+    : last_retraced_(false), last_shadow_lights_(0) { }
+
+    // Renders s, reusing as much cached work as its changes allow.
+    framebuffer render(const scene& s) {
+      last_retraced_ = !same_view(s) || !tree_.matches(s);
+      if (last_retraced_) {
+        trace_primary(s);
+      }
+
+      // refresh the visibility of moved or added lights
+      last_shadow_lights_ = 0;
+      if (std::holds_alternative<phong_shader>(s.shader())) {
+        auto& lights = s.point_lights();
+        light_locations_.resize(std::min(light_locations_.size(), lights.size()));
+        visible_.resize(lights.size());
+        for (size_t light = 0; light < lights.size(); ++light) {
+          if ((light < light_locations_.size()) && (light_locations_[light] == lights[light].location())) {
+            continue;
+          }
+          std::vector<ray> rays;
+          std::vector<size_t> pixels;
+          for (size_t i = 0; i < points_.size(); ++i) {
+            if (hit_[i]) {
+              rays.push_back(detail::shadow_ray(points_[i].position(), lights[light]));
+              pixels.push_back(i);
+            }
+          }
+          auto occluded = tree_.occluded(rays, detail::shadow_epsilon, 1.0);
+          visible_[light].assign(points_.size(), false);
+          for (size_t k = 0; k < pixels.size(); ++k) {
+            visible_[light][pixels[k]] = !occluded[k];
+          }
+          if (light < light_locations_.size()) {
+            light_locations_[light] = lights[light].location();
+          } else {
+            light_locations_.push_back(lights[light].location());
+          }
+          ++last_shadow_lights_;
+        }
+      }
+
+      framebuffer result(s.viewport());
+      size_t width = result.width();
+      detail::parallel_for(result.height(), 1, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; ++y) {
+          for (size_t x = 0; x < width; ++x) {
+            size_t i = y * width + x;
+            result.set(static_cast<unsigned>(x), static_cast<unsigned>(y),
+                       hit_[i] ? shade(s, points_[i], [&](size_t light) { return bool(visible_[light][i]); })
+                               : s.background());
+          }
+        }
+      });
+      return result;
+    }
+
+    // Whether the last render traced primary rays, rather than re-shading.
+    bool last_retraced() const noexcept { return last_retraced_; }
+
+    // The number of lights whose shadow rays the last render traced.
+    size_t last_shadow_lights() const noexcept { return last_shadow_lights_; }
+  };
+
+  namespace detail {
+
+    // xxHash64 of size bytes at data, a fast non-cryptographic hash. Words
+    // are read in host byte order, which matches the reference
+    // implementation on little-endian machines.
+    std::uint64_t xxh64(const void* data, size_t size, std::uint64_t seed = 0) noexcept {
+      constexpr std::uint64_t p1 = 11400714785074694791ULL, p2 = 14029467366897019727ULL,
+                              p3 = 1609587929392839161ULL, p4 = 9650029242287828579ULL,
+                              p5 = 2870177450012600261ULL;
+      auto rotl = [](std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+      auto round = [&](std::uint64_t acc, std::uint64_t input) {
+        acc += input * p2;
+        acc = rotl(acc, 31);
+        return acc * p1;
+      };
+      auto merge = [&](std::uint64_t acc, std::uint64_t value) {
+        acc ^= round(0, value);
+        return acc * p1 + p4;
+      };
+      auto read64 = [](const unsigned char* p) {
+        std::uint64_t x;
+        std::memcpy(&x, p, sizeof(x));
+        return x;
+      };
+      auto read32 = [](const unsigned char* p) {
+        std::uint32_t x;
+        std::memcpy(&x, p, sizeof(x));
+        return x;
+      };
+
+      auto p = static_cast<const unsigned char*>(data);
+      const auto end = p + size;
+      std::uint64_t h;
+      if (size >= 32) {
+        std::uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+        for (; p + 32 <= end; p += 32) {
+          v1 = round(v1, read64(p));
+          v2 = round(v2, read64(p + 8));
+          v3 = round(v3, read64(p + 16));
+          v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+      } else {
+        h = seed + p5;
+      }
+      h += static_cast<std::uint64_t>(size);
+      for (; p + 8 <= end; p += 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * p1 + p4;
+      }
+      if (p + 4 <= end) {
+        h ^= static_cast<std::uint64_t>(read32(p)) * p1;
+        h = rotl(h, 23) * p2 + p3;
+        p += 4;
+      }
+      for (; p < end; ++p) {
+        h ^= (*p) * p5;
+        h = rotl(h, 11) * p1;
+      }
+      h ^= h >> 33;
+      h *= p2;
+      h ^= h >> 29;
+      h *= p3;
+      h ^= h >> 32;
+      return h;
+    }
+
+    // Accumulates the bytes of scene values for hashing.
+    class hash_buffer {
+    private:
+      std::vector<unsigned char> bytes_;
+
+      void append(const void* data, size_t size) {
+        auto p = static_cast<const unsigned char*>(data);
+        bytes_.insert(bytes_.end(), p, p + size);
+      }
+
+    public:
+
+      void add(double x) { append(&x, sizeof(x)); }
+      void add(std::uint64_t x) { append(&x, sizeof(x)); }
+      void add(const vector3& v) { add(v.x()); add(v.y()); add(v.z()); }
+      void add(const color& c) { add(c.r()); add(c.g()); add(c.b()); }
+
+      void add(const transform& t) {
+        for (unsigned row = 0; row < 3; ++row) {
+          for (unsigned column = 0; column < 4; ++column) {
+            add(t(row, column));
+          }
+        }
+      }
+
+      void add(const std::string& s) {
+        add(static_cast<std::uint64_t>(s.size()));
+        append(s.data(), s.size());
+      }
+
+      std::uint64_t digest() const noexcept { return xxh64(bytes_.data(), bytes_.size()); }
+    };
+
+    // Hashes count elements in fixed-size chunks, in parallel, with
+    // add(buffer, i) appending element i, and then hashes the chunk
+    // hashes. The chunk size does not depend on the thread count, so
+    // neither does the result.
+    template <typename Add>
+    std::uint64_t parallel_hash(size_t count, Add add) {
+      constexpr size_t chunk_size = 1024;
+      std::vector<std::uint64_t> chunks((count + chunk_size - 1) / chunk_size);
+      parallel_for(chunks.size(), 1, [&](size_t begin, size_t end) {
+        for (auto c = begin; c < end; ++c) {
+          hash_buffer buffer;
+          for (auto i = c * chunk_size; i < std::min(count, (c + 1) * chunk_size); ++i) {
+            add(buffer, i);
+          }
+          chunks[c] = buffer.digest();
+        }
+      });
+      hash_buffer result;
+      result.add(static_cast<std::uint64_t>(count));
+      for (auto h : chunks) {
+        result.add(h);
+      }
+      return result.digest();
+    }
+  }
+
+  // Hashes of each section of a scene, so that two scenes, or two versions
+  // of one scene, can be compared cheaply. Equal hashes mean equal
+  // sections, barring a 64-bit collision. Primitives are hashed with the
+  // index of their material, so renaming a material changes only the
+  // materials hash.
+  class scene_hash {
+  private:
+    std::uint64_t camera_, projection_, materials_, lights_, spheres_, triangles_, instances_;
+
+  public:
+
+    constexpr scene_hash(std::uint64_t camera,
+                         std::uint64_t projection,
+                         std::uint64_t materials,
+                         std::uint64_t lights,
+                         std::uint64_t spheres,
+                         std::uint64_t triangles,
+                         std::uint64_t instances) noexcept
+    : camera_(camera),
+      projection_(projection),
+      materials_(materials),
+      lights_(lights),
+      spheres_(spheres),
+      triangles_(triangles),
+      instances_(instances) { }
+
+    // camera and viewport
+    constexpr std::uint64_t camera    () const noexcept { return camera_;     }
+    // projection, shader, and background
+    constexpr std::uint64_t projection() const noexcept { return projection_; }
+    constexpr std::uint64_t materials () const noexcept { return materials_;  }
+    constexpr std::uint64_t lights    () const noexcept { return lights_;     }
+    constexpr std::uint64_t spheres   () const noexcept { return spheres_;    }
+    constexpr std::uint64_t triangles () const noexcept { return triangles_;  }
+    // objects and instances
+    constexpr std::uint64_t instances () const noexcept { return instances_;  }
+
+    // whether the two scenes have the same primitives, so that a bvh built
+    // over one also matches the other
+    constexpr bool same_geometry(const scene_hash& rhs) const noexcept {
+      return (spheres_ == rhs.spheres_) && (triangles_ == rhs.triangles_) &&
+             (instances_ == rhs.instances_);
+    }
+
+    // a hash of the whole scene
+    std::uint64_t value() const noexcept {
+      const std::uint64_t sections[] = { camera_, projection_, materials_, lights_,
+                                         spheres_, triangles_, instances_ };
+      return detail::xxh64(sections, sizeof(sections));
+    }
+
+    constexpr bool operator==(const scene_hash& rhs) const noexcept {
+      return same_geometry(rhs) &&
+             (camera_ == rhs.camera_) &&
+             (projection_ == rhs.projection_) &&
+             (materials_ == rhs.materials_) &&
+             (lights_ == rhs.lights_);
+    }
+    constexpr bool operator!=(const scene_hash& rhs) const noexcept {
+      return !(*this == rhs);
+    }
+  };
+
+  // Hashes each section of s. The geometry arrays are hashed in parallel.
+  scene_hash hash(const scene& s) {
+    auto material_index = [&](const material& m) {
+      return static_cast<std::uint64_t>(&m - s.materials().data());
+    };
+
+    detail::hash_buffer camera;
+    camera.add(s.camera().eye());
+    camera.add(s.camera().up());
+    camera.add(s.camera().view());
+    camera.add(static_cast<std::uint64_t>(s.viewport().x_resolution()));
+    camera.add(static_cast<std::uint64_t>(s.viewport().y_resolution()));
+    camera.add(s.viewport().left());
+    camera.add(s.viewport().top());
+    camera.add(s.viewport().right());
+    camera.add(s.viewport().bottom());
+
+    detail::hash_buffer projection;
+    projection.add(static_cast<std::uint64_t>(s.projection().index()));
+    if (auto persp = std::get_if<persp_projection>(&s.projection())) {
+      projection.add(persp->focal_length());
+    }
+    projection.add(static_cast<std::uint64_t>(s.shader().index()));
+    if (auto phong = std::get_if<phong_shader>(&s.shader())) {
+      projection.add(phong->ambient_coeff());
+      projection.add(phong->diffuse_coeff());
+      projection.add(phong->specular_coeff());
+      projection.add(phong->ambient_color());
+    }
+    projection.add(s.background());
+
+    detail::hash_buffer materials;
+    materials.add(static_cast<std::uint64_t>(s.materials().size()));
+    for (auto& m : s.materials()) {
+      materials.add(m.name());
+      materials.add(m.shininess());
+      materials.add(m.color());
+    }
+
+    detail::hash_buffer lights;
+    lights.add(static_cast<std::uint64_t>(s.point_lights().size()));
+    for (auto& light : s.point_lights()) {
+      lights.add(light.location());
+      lights.add(light.color());
+      lights.add(light.intensity());
+    }
+
+    auto spheres = detail::parallel_hash(s.spheres().size(), [&](detail::hash_buffer& buffer, size_t i) {
+      auto& sph = s.spheres()[i];
+      buffer.add(material_index(sph.material()));
+      buffer.add(sph.center());
+      buffer.add(sph.radius());
+    });
+    auto triangles = detail::parallel_hash(s.triangles().size(), [&](detail::hash_buffer& buffer, size_t i) {
+      auto& tri = s.triangles()[i];
+      buffer.add(material_index(tri.material()));
+      buffer.add(tri.a());
+      buffer.add(tri.b());
+      buffer.add(tri.c());
+    });
+
+    detail::hash_buffer instances;
+    instances.add(static_cast<std::uint64_t>(s.objects().size()));
+    for (auto& o : s.objects()) {
+      instances.add(static_cast<std::uint64_t>(o.spheres().size()));
+      for (auto& sph : o.spheres()) {
+        instances.add(material_index(sph.material()));
+        instances.add(sph.center());
+        instances.add(sph.radius());
+      }
+      instances.add(static_cast<std::uint64_t>(o.triangles().size()));
+      for (auto& tri : o.triangles()) {
+        instances.add(material_index(tri.material()));
+        instances.add(tri.a());
+        instances.add(tri.b());
+        instances.add(tri.c());
+      }
+    }
+    instances.add(static_cast<std::uint64_t>(s.instances().size()));
+    for (auto& inst : s.instances()) {
+      instances.add(static_cast<std::uint64_t>(&inst.object() - s.objects().data()));
+      instances.add(inst.has_material() ? material_index(inst.material()) + 1 : std::uint64_t(0));
+      instances.add(inst.to_world());
+    }
+
+    return scene_hash(camera.digest(), projection.digest(), materials.digest(),
+                      lights.digest(), spheres, triangles, instances.digest());
+  }
+
+  namespace detail {
+
+    // The size and modification time of a file, for noticing edits; a
+    // missing file has no size.
+    struct file_stamp {
+      std::string path;
+      std::optional<std::uintmax_t> size;
+      std::filesystem::file_time_type modified;
+
+      bool operator==(const file_stamp& rhs) const noexcept {
+        return (path == rhs.path) && (size == rhs.size) && (modified == rhs.modified);
+      }
+    };
+
+    file_stamp stamp(const std::string& path) {
+      file_stamp result{path, std::nullopt, std::filesystem::file_time_type()};
+      std::error_code error;
+      auto size = std::filesystem::file_size(path, error);
+      if (!error) {
+        auto modified = std::filesystem::last_write_time(path, error);
+        if (!error) {
+          result.size = size;
+          result.modified = modified;
+        }
+      }
+      return result;
+    }
+
+    // Stamps of the mesh files that scene JSON j references, at the top
+    // level and in objects, resolved against directory as read_json does.
+    // Malformed entries are skipped; read_json reports them.
+    std::vector<file_stamp> mesh_stamps(const nlohmann::json& j, const std::string& directory) {
+      std::vector<file_stamp> result;
+      auto add = [&](const nlohmann::json& j_obj) {
+        if (!j_obj.is_object() || !j_obj.contains("meshes") || !j_obj["meshes"].is_array()) {
+          return;
+        }
+        for (auto& it : j_obj["meshes"]) {
+          if (it.is_object() && it.contains("path") && it["path"].is_string()) {
+            result.push_back(stamp(mesh_path(directory, it["path"].get<std::string>())));
+          }
+        }
+      };
+      add(j);
+      if (j.is_object() && j.contains("objects") && j["objects"].is_array()) {
+        for (auto& it : j["objects"]) {
+          add(it);
+        }
+      }
+      return result;
+    }
+  }
+
+  // A least-recently-used cache of parsed scenes and their bvhs, keyed by
+  // a hash of the scene's JSON text, so that rendering the same scene file
+  // again skips parsing and bvh construction. An entry is used only if its
+  // text matches, so hash collisions are harmless, and only while the size
+  // and modification time of every mesh file the scene references are
+  // unchanged, so editing a mesh alone reloads the scene. Safe to share
+  // between threads.
+  class scene_cache {
+  public:
+
+    class entry {
+    private:
+      std::shared_ptr<const scene> scene_;
+      std::shared_ptr<const bvh> tree_;
+      bool hit_;
+
+    public:
+
+      entry(std::shared_ptr<const scene> s, std::shared_ptr<const bvh> tree, bool hit) noexcept
+      : scene_(std::move(s)), tree_(std::move(tree)), hit_(hit) { }
+
+      const std::shared_ptr<const scene>& scene() const noexcept { return scene_; }
+      const std::shared_ptr<const bvh>& tree() const noexcept { return tree_; }
+      // whether this came from the cache rather than being parsed and built
+      constexpr bool hit() const noexcept { return hit_; }
+    };
+
+  private:
+
+    // the text's hash and length
+    using key = std::pair<std::uint64_t, size_t>;
+
+    struct key_hash {
+      size_t operator()(const key& k) const noexcept { return static_cast<size_t>(k.first); }
+    };
+
+    struct cached {
+      key k;
+      std::string text, directory;
+      std::vector<detail::file_stamp> meshes;
+      std::shared_ptr<const rayson::scene> s;
+      std::shared_ptr<const bvh> tree;
+
+      // whether this is the scene of text, with its meshes as they are now
+      bool current(const std::string& other_text, const std::string& other_directory) const {
+        if ((text != other_text) || (directory != other_directory)) {
+          return false;
+        }
+        for (auto& m : meshes) {
+          if (!(detail::stamp(m.path) == m)) {
+            return false;
+          }
+        }
+        return true;
+      }
+    };
+
+    size_t capacity_, hits_, misses_;
+    std::list<cached> recent_;
+    std::unordered_map<key, std::list<cached>::iterator, key_hash> index_;
+    std::mutex mutex_;
+
+  public:
+
+    explicit scene_cache(size_t capacity)
+    : capacity_(capacity), hits_(0), misses_(0) {
+      assert(capacity > 0);
+    }
+
+    // The scene whose JSON text is text, parsing it and building its bvh
+    // only when it is not already cached. Mesh paths are relative to
+    // directory, as in read_json. Throws read_exception.
+    entry load_text(const std::string& text, const std::string& directory = "") {
+      key k(detail::xxh64(text.data(), text.size(), detail::xxh64(directory.data(), directory.size())),
+            text.size());
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = index_.find(k);
+        if ((found != index_.end()) && found->second->current(text, directory)) {
+          recent_.splice(recent_.begin(), recent_, found->second);
+          ++hits_;
+          return entry(found->second->s, found->second->tree, true);
+        }
+        ++misses_;
+      }
+
+      nlohmann::json j;
+      try {
+        j = nlohmann::json::parse(text);
+      } catch (nlohmann::json::exception& e) {
+        throw read_exception("JSON parse error");
+      }
+      // stamped before reading, so that an edit made while reading is
+      // noticed next time
+      auto meshes = detail::mesh_stamps(j, directory);
+      auto s = std::make_shared<const rayson::scene>(read_json(j, directory));
+      auto tree = std::make_shared<const bvh>(*s);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      // replaces a stale entry, or one whose text merely hashed the same
+      auto found = index_.find(k);
+      if (found != index_.end()) {
+        recent_.erase(found->second);
+        index_.erase(found);
+      }
+      recent_.push_front(cached{k, text, directory, std::move(meshes), s, tree});
+      index_[k] = recent_.begin();
+      if (recent_.size() > capacity_) {
+        index_.erase(recent_.back().k);
+        recent_.pop_back();
+      }
+      return entry(s, tree, false);
+    }
+
+    // load_text of the contents of the file at path, with mesh paths
+    // relative to its directory.
+    entry load_file(const std::string& path) {
+      auto slash = path.rfind('/');
+      return load_text(detail::read_bytes(path),
+                       (slash == std::string::npos) ? std::string() : path.substr(0, slash + 1));
+    }
+
+    size_t capacity() const noexcept { return capacity_; }
+
+    size_t size() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return recent_.size();
+    }
+
+    size_t hits() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return hits_;
+    }
+
+    size_t misses() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return misses_;
+    }
+  };
+
+  // The differences between two versions of a scene. Elements are matched
+  // by their position in each array. Primitives are compared by geometry
+  // and material index, so a material that changes in place is reported
+  // only among the materials.
+  class scene_diff {
+  public:
+
+    // Indices of elements added (into the new array), removed (into the
+    // old array), and changed (into both), each in increasing order.
+    class changes {
+    private:
+      std::vector<size_t> added_, removed_, changed_;
+
+    public:
+
+      template <typename T, typename Equal>
+      changes(const std::vector<T>& before, const std::vector<T>& after, Equal equal) {
+        auto common = std::min(before.size(), after.size());
+        for (size_t i = 0; i < common; ++i) {
+          if (!equal(before[i], after[i])) {
+            changed_.push_back(i);
+          }
+        }
+        for (auto i = common; i < after.size(); ++i) {
+          added_.push_back(i);
+        }
+        for (auto i = common; i < before.size(); ++i) {
+          removed_.push_back(i);
+        }
+      }
+
+      const std::vector<size_t>& added  () const noexcept { return added_;   }
+      const std::vector<size_t>& removed() const noexcept { return removed_; }
+      const std::vector<size_t>& changed() const noexcept { return changed_; }
+
+      bool empty() const noexcept {
+        return added_.empty() && removed_.empty() && changed_.empty();
+      }
+    };
+
+  private:
+    bool camera_changed_, shading_changed_;
+    changes materials_, point_lights_, spheres_, triangles_, objects_, instances_;
+
+    static size_t material_index(const scene& s, const material& m) noexcept {
+      return static_cast<size_t>(&m - s.materials().data());
+    }
+
+    static size_t object_index(const scene& s, const object& o) noexcept {
+      return static_cast<size_t>(&o - s.objects().data());
+    }
+
+  public:
+
+    scene_diff(const scene& before, const scene& after)
+    : camera_changed_((before.camera() != after.camera()) ||
+                      (before.viewport() != after.viewport()) ||
+                      (before.projection() != after.projection())),
+      shading_changed_((before.shader() != after.shader()) ||
+                       (before.background() != after.background())),
+      materials_(before.materials(), after.materials(), std::equal_to<material>()),
+      point_lights_(before.point_lights(), after.point_lights(), std::equal_to<point_light>()),
+      spheres_(before.spheres(), after.spheres(), [&](const sphere& x, const sphere& y) {
+        return (x.center() == y.center()) &&
+               (x.radius() == y.radius()) &&
+               (material_index(before, x.material()) == material_index(after, y.material()));
+      }),
+      triangles_(before.triangles(), after.triangles(), [&](const triangle& x, const triangle& y) {
+        return (x.a() == y.a()) && (x.b() == y.b()) && (x.c() == y.c()) &&
+               (material_index(before, x.material()) == material_index(after, y.material()));
+      }),
+      objects_(before.objects(), after.objects(), [&](const object& x, const object& y) {
+        return (x.name() == y.name()) &&
+               changes(x.spheres(), y.spheres(), [&](const sphere& a, const sphere& b) {
+                 return (a.center() == b.center()) &&
+                        (a.radius() == b.radius()) &&
+                        (material_index(before, a.material()) == material_index(after, b.material()));
+               }).empty() &&
+               changes(x.triangles(), y.triangles(), [&](const triangle& a, const triangle& b) {
+                 return (a.a() == b.a()) && (a.b() == b.b()) && (a.c() == b.c()) &&
+                        (material_index(before, a.material()) == material_index(after, b.material()));
+               }).empty();
+      }),
+      instances_(before.instances(), after.instances(), [&](const instance& x, const instance& y) {
+        return (object_index(before, x.object()) == object_index(after, y.object())) &&
+               (x.to_world() == y.to_world()) &&
+               (x.has_material() == y.has_material()) &&
+               (!x.has_material() ||
+                (material_index(before, x.material()) == material_index(after, y.material())));
+      }) { }
+
+    // camera, viewport, or projection
+    constexpr bool camera_changed() const noexcept { return camera_changed_; }
+    // shader or background
+    constexpr bool shading_changed() const noexcept { return shading_changed_; }
+
+    const changes& materials   () const noexcept { return materials_;    }
+    const changes& point_lights() const noexcept { return point_lights_; }
+    const changes& spheres     () const noexcept { return spheres_;      }
+    const changes& triangles   () const noexcept { return triangles_;    }
+    const changes& objects     () const noexcept { return objects_;      }
+    const changes& instances   () const noexcept { return instances_;    }
+
+    // Whether primitives or instances were added or removed, or objects
+    // changed at all. If so, a bvh must be rebuilt; otherwise, when only
+    // geometry changed, bvh::refit suffices.
+    bool topology_changed() const noexcept {
+      return !(spheres_.added().empty() && spheres_.removed().empty() &&
+               triangles_.added().empty() && triangles_.removed().empty() &&
+               instances_.added().empty() && instances_.removed().empty() &&
+               objects_.empty());
+    }
+
+    bool geometry_changed() const noexcept {
+      return !(spheres_.empty() && triangles_.empty() && objects_.empty() && instances_.empty());
+    }
+
+    bool empty() const noexcept {
+      return !camera_changed_ && !shading_changed_ && materials_.empty() &&
+             point_lights_.empty() && !geometry_changed();
+    }
+  };
+
+  namespace detail {
+
+    // A copy of s's camera, viewport, projection, shader, background, and
+    // point lights, and, if with_materials, its materials, in order, but no
+    // primitives. A given camera replaces s's.
+    scene without_geometry(const scene& s,
+                           bool with_materials = false,
+                           const std::optional<rayson::camera>& replacement = std::nullopt) {
+      rayson::camera camera(replacement ? *replacement : s.camera());
+      rayson::viewport viewport(s.viewport());
+      rayson::projection projection(s.projection());
+      rayson::shader shader(s.shader());
+      scene result(std::move(camera),
+                   std::move(viewport),
+                   std::move(projection),
+                   std::move(shader),
+                   s.background());
+      if (with_materials) {
+        for (auto& m : s.materials()) {
+          result.emplace_material(material(m));
+        }
+      }
+      for (auto& light : s.point_lights()) {
+        result.emplace_point_light(point_light(light));
+      }
+      return result;
+    }
+  }
+
+  // A copy of s's viewport, projection, shader, background, materials, and
+  // point lights, seen through camera, but without primitives. Rendered with
+  // a bvh built for s, it renders s from camera without copying or
+  // rebuilding s's geometry.
+  scene view_from(const scene& s, const rayson::camera& camera) {
+    return detail::without_geometry(s, true, camera);
+  }
+
+  // A copy of a scene without duplicates. Triangle vertices within
+  // tolerance of an earlier vertex are welded to it, materials with equal
+  // shininess and color are merged into the first of them, and spheres and
+  // triangles that then repeat exactly, or triangles that welding made
+  // degenerate, are dropped. Triangles are compared up to rotation of
+  // their vertices, which keeps their winding. Each object is deduplicated
+  // in its own coordinates; objects and instances keep their indices.
+  // Hashing runs in parallel.
+  class scene_dedup {
+  private:
+    rayson::scene scene_;
+    size_t vertices_welded_, materials_merged_, spheres_removed_, triangles_removed_;
+
+    // Snaps each vertex to the first earlier unsnapped vertex within
+    // tolerance of it, found through a hash of grid cells one tolerance
+    // wide. Returns how many vertices moved.
+    static size_t weld(std::vector<vector3>& vertices, double tolerance) {
+      if (!(tolerance > 0.0)) {
+        return 0;
+      }
+      using cell = std::array<std::int64_t, 3>;
+      std::vector<cell> cells(vertices.size());
+      detail::parallel_for(vertices.size(), 4096, [&](size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+          for (unsigned axis = 0; axis < 3; ++axis) {
+            cells[i][axis] = static_cast<std::int64_t>(std::floor(vertices[i][axis] / tolerance));
+          }
+        }
+      });
+      auto cell_hash = [](const cell& c) { return detail::xxh64(c.data(), sizeof(cell)); };
+
+      // representatives, by the hash of their cell
+      std::unordered_map<std::uint64_t, std::vector<size_t>> grid;
+      size_t welded = 0;
+      for (size_t i = 0; i < vertices.size(); ++i) {
+        std::optional<size_t> found;
+        for (std::int64_t dx = -1; (dx <= 1) && !found; ++dx) {
+          for (std::int64_t dy = -1; (dy <= 1) && !found; ++dy) {
+            for (std::int64_t dz = -1; (dz <= 1) && !found; ++dz) {
+              auto it = grid.find(cell_hash({cells[i][0] + dx, cells[i][1] + dy, cells[i][2] + dz}));
+              if (it == grid.end()) {
+                continue;
+              }
+              for (auto r : it->second) {
+                if ((vertices[r] - vertices[i]).magnitude() <= tolerance) {
+                  found = r;
+                  break;
+                }
+              }
+            }
+          }
+        }
+        if (!found) {
+          grid[cell_hash(cells[i])].push_back(i);
+        } else if (vertices[i] != vertices[*found]) {
+          vertices[i] = vertices[*found];
+          ++welded;
+        }
+      }
+      return welded;
+    }
+
+    // Those of candidates that equal no earlier candidate, in order, given
+    // the hash of each element.
+    template <typename Equal>
+    static std::vector<size_t> firsts(const std::vector<size_t>& candidates,
+                                      const std::vector<std::uint64_t>& hashes,
+                                      Equal equal) {
+      std::unordered_map<std::uint64_t, std::vector<size_t>> seen;
+      std::vector<size_t> result;
+      for (auto i : candidates) {
+        auto& same = seen[hashes[i]];
+        if (std::none_of(same.begin(), same.end(), [&](size_t j) { return equal(i, j); })) {
+          same.push_back(i);
+          result.push_back(i);
+        }
+      }
+      return result;
+    }
+
+    // Adds the distinct spheres and triangles to target, with materials
+    // mapped by material_of.
+    template <typename Target, typename MaterialOf>
+    void add_primitives(const std::vector<sphere>& spheres,
+                        const std::vector<triangle>& triangles,
+                        double tolerance,
+                        MaterialOf material_of,
+                        Target& target) {
+      auto index_of = [&](const rayson::material* m) {
+        return static_cast<std::uint64_t>(m - scene_.materials().data());
+      };
+
+      std::vector<std::uint64_t> sphere_hashes(spheres.size());
+      detail::parallel_for(spheres.size(), 1024, [&](size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+          detail::hash_buffer buffer;
+          buffer.add(index_of(material_of(spheres[i].material())));
+          buffer.add(spheres[i].center());
+          buffer.add(spheres[i].radius());
+          sphere_hashes[i] = buffer.digest();
+        }
+      });
+      std::vector<size_t> all(spheres.size());
+      std::iota(all.begin(), all.end(), size_t(0));
+      auto kept = firsts(all, sphere_hashes, [&](size_t i, size_t j) {
+        return (spheres[i].center() == spheres[j].center()) &&
+               (spheres[i].radius() == spheres[j].radius()) &&
+               (material_of(spheres[i].material()) == material_of(spheres[j].material()));
+      });
+      spheres_removed_ += spheres.size() - kept.size();
+      for (auto i : kept) {
+        target.emplace_sphere(sphere(material_of(spheres[i].material()),
+                                     spheres[i].center(),
+                                     spheres[i].radius()));
+      }
+
+      std::vector<vector3> vertices(3 * triangles.size());
+      detail::parallel_for(triangles.size(), 4096, [&](size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+          vertices[3 * i] = triangles[i].a();
+          vertices[3 * i + 1] = triangles[i].b();
+          vertices[3 * i + 2] = triangles[i].c();
+        }
+      });
+      vertices_welded_ += weld(vertices, tolerance);
+
+      // each triangle's vertices rotated to start from the least one
+      auto less = [](const vector3& x, const vector3& y) {
+        return (x.x() != y.x()) ? (x.x() < y.x()) : ((x.y() != y.y()) ? (x.y() < y.y()) : (x.z() < y.z()));
+      };
+      std::vector<unsigned> first(triangles.size());
+      std::vector<std::uint64_t> triangle_hashes(triangles.size());
+      detail::parallel_for(triangles.size(), 1024, [&](size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+          auto v = &vertices[3 * i];
+          first[i] = less(v[1], v[0]) ? (less(v[2], v[1]) ? 2 : 1) : (less(v[2], v[0]) ? 2 : 0);
+          detail::hash_buffer buffer;
+          buffer.add(index_of(material_of(triangles[i].material())));
+          for (unsigned k = 0; k < 3; ++k) {
+            buffer.add(v[(first[i] + k) % 3]);
+          }
+          triangle_hashes[i] = buffer.digest();
+        }
+      });
+      std::vector<size_t> candidates;
+      for (size_t i = 0; i < triangles.size(); ++i) {
+        auto v = &vertices[3 * i];
+        if ((v[0] != v[1]) && (v[0] != v[2]) && (v[1] != v[2])) {
+          candidates.push_back(i);
+        }
+      }
+      kept = firsts(candidates, triangle_hashes, [&](size_t i, size_t j) {
+        for (unsigned k = 0; k < 3; ++k) {
+          if (vertices[3 * i + (first[i] + k) % 3] != vertices[3 * j + (first[j] + k) % 3]) {
+            return false;
+          }
+        }
+        return material_of(triangles[i].material()) == material_of(triangles[j].material());
+      });
+      triangles_removed_ += triangles.size() - kept.size();
+      for (auto i : kept) {
+        target.emplace_triangle(triangle(material_of(triangles[i].material()),
+                                         vertices[3 * i], vertices[3 * i + 1], vertices[3 * i + 2]));
+      }
+    }
+
+  public:
+
+    explicit scene_dedup(const rayson::scene& s, double tolerance = 0.0)
+    : scene_(detail::without_geometry(s)),
+      vertices_welded_(0),
+      materials_merged_(0),
+      spheres_removed_(0),
+      triangles_removed_(0) {
+      assert(tolerance >= 0.0);
+
+      // the index in scene_ of each of s's materials
+      std::vector<size_t> merged(s.materials().size());
+      std::unordered_map<std::uint64_t, std::vector<size_t>> seen;
+      for (size_t i = 0; i < s.materials().size(); ++i) {
+        auto& m = s.materials()[i];
+        detail::hash_buffer buffer;
+        buffer.add(m.shininess());
+        buffer.add(m.color());
+        auto& same = seen[buffer.digest()];
+        auto found = std::find_if(same.begin(), same.end(), [&](size_t j) {
+          auto& other = scene_.materials()[j];
+          return (other.shininess() == m.shininess()) && (other.color() == m.color());
+        });
+        if (found != same.end()) {
+          merged[i] = *found;
+          ++materials_merged_;
+        } else {
+          merged[i] = scene_.materials().size();
+          same.push_back(merged[i]);
+          scene_.emplace_material(material(m));
+        }
+      }
+      auto material_of = [&](const rayson::material& m) {
+        return &scene_.materials()[merged[static_cast<size_t>(&m - s.materials().data())]];
+      };
+
+      add_primitives(s.spheres(), s.triangles(), tolerance, material_of, scene_);
+      for (auto& o : s.objects()) {
+        object copy(o.name());
+        add_primitives(o.spheres(), o.triangles(), tolerance, material_of, copy);
+        scene_.emplace_object(std::move(copy));
+      }
+      for (auto& inst : s.instances()) {
+        scene_.emplace_instance(instance(&scene_.objects()[static_cast<size_t>(&inst.object() - s.objects().data())],
+                                         inst.to_world(),
+                                         inst.has_material() ? material_of(inst.material()) : nullptr));
+      }
+    }
+
+    constexpr const rayson::scene& scene() const noexcept { return scene_; }
+    constexpr rayson::scene& scene() noexcept { return scene_; }
+
+    constexpr size_t vertices_welded  () const noexcept { return vertices_welded_;   }
+    constexpr size_t materials_merged () const noexcept { return materials_merged_;  }
+    constexpr size_t spheres_removed  () const noexcept { return spheres_removed_;   }
+    constexpr size_t triangles_removed() const noexcept { return triangles_removed_; }
+
+    // the memory that the removed materials and primitives occupied
+    constexpr size_t bytes_saved() const noexcept {
+      return materials_merged_ * sizeof(material) +
+             spheres_removed_ * sizeof(sphere) +
+             triangles_removed_ * sizeof(triangle);
+    }
+  };
+
+  // An optional pass, to run before building a bvh, that drops the
+  // primitives outside a scene's view_volume. Only primary rays reach a
+  // flat-shaded scene, so its image is unchanged; phong shading casts
+  // shadow rays, which may hit anything, so a phong-shaded scene is kept
+  // whole. Instances are kept when their world-space bounds overlap the
+  // volume, along with the objects they place; objects are kept whole.
+  class view_cull {
+  private:
+    rayson::scene scene_;
+    size_t spheres_culled_, triangles_culled_, instances_culled_;
+
+  public:
+
+    explicit view_cull(const rayson::scene& s)
+    : scene_(detail::without_geometry(s, true)),
+      spheres_culled_(0),
+      triangles_culled_(0),
+      instances_culled_(0) {
+      auto material_of = [&](const rayson::material& m) {
+        return &scene_.materials()[static_cast<size_t>(&m - s.materials().data())];
+      };
+
+      bool cull = std::holds_alternative<flat_shader>(s.shader());
+      view_volume volume(s);
+
+      for (auto& sph : s.spheres()) {
+        if (cull && !volume.overlaps(sph)) {
+          ++spheres_culled_;
+        } else {
+          scene_.emplace_sphere(sphere(material_of(sph.material()), sph.center(), sph.radius()));
+        }
+      }
+      for (auto& tri : s.triangles()) {
+        if (cull && !volume.overlaps(tri)) {
+          ++triangles_culled_;
+        } else {
+          scene_.emplace_triangle(triangle(material_of(tri.material()), tri.a(), tri.b(), tri.c()));
+        }
+      }
+
+      // the instances kept, and whether each object is placed by one
+      std::vector<const instance*> kept;
+      std::vector<bool> used(s.objects().size(), !cull);
+      for (auto& inst : s.instances()) {
+        if (cull) {
+          aabb box;
+          for (auto& sph : inst.object().spheres()) {
+            box = box.merged(bounds(sph));
+          }
+          for (auto& tri : inst.object().triangles()) {
+            box = box.merged(bounds(tri));
+          }
+          if (!volume.overlaps(transformed(box, inst.to_world()))) {
+            ++instances_culled_;
+            continue;
+          }
+        }
+        kept.push_back(&inst);
+        used[static_cast<size_t>(&inst.object() - s.objects().data())] = true;
+      }
+
+      // the index in scene_ of each used object
+      std::vector<size_t> placed(s.objects().size());
+      for (size_t i = 0; i < s.objects().size(); ++i) {
+        if (!used[i]) {
+          continue;
+        }
+        auto& o = s.objects()[i];
+        placed[i] = scene_.objects().size();
+        object copy(o.name());
+        for (auto& sph : o.spheres()) {
+          copy.emplace_sphere(sphere(material_of(sph.material()), sph.center(), sph.radius()));
+        }
+        for (auto& tri : o.triangles()) {
+          copy.emplace_triangle(triangle(material_of(tri.material()), tri.a(), tri.b(), tri.c()));
+        }
+        scene_.emplace_object(std::move(copy));
+      }
+      for (auto inst : kept) {
+        scene_.emplace_instance(instance(&scene_.objects()[placed[static_cast<size_t>(&inst->object() - s.objects().data())]],
+                                         inst->to_world(),
+                                         inst->has_material() ? material_of(inst->material()) : nullptr));
+      }
+    }
+
+    constexpr const rayson::scene& scene() const noexcept { return scene_; }
+    constexpr rayson::scene& scene() noexcept { return scene_; }
+
+    constexpr size_t spheres_culled  () const noexcept { return spheres_culled_;   }
+    constexpr size_t triangles_culled() const noexcept { return triangles_culled_; }
+    constexpr size_t instances_culled() const noexcept { return instances_culled_; }
+  };
+
+  // An immutable version of a scene, together with its bvh.
+  class scene_snapshot {
+  private:
+    std::uint64_t version_;
+    rayson::scene scene_;
+    bvh tree_;
+
+  public:
+
+    scene_snapshot(rayson::scene&& s, std::uint64_t version)
+    : version_(version), scene_(std::move(s)), tree_(scene_) { }
+
+    scene_snapshot(const scene_snapshot&) = delete;
+    scene_snapshot& operator=(const scene_snapshot&) = delete;
+
+    constexpr std::uint64_t version() const noexcept { return version_; }
+    constexpr const rayson::scene& scene() const noexcept { return scene_; }
+    constexpr const bvh& tree() const noexcept { return tree_; }
+  };
+
+  // A variant of a base snapshot that overrides its shader, point lights,
+  // or materials, while sharing the base's primitives and bvh. Many
+  // variants of one scene cost one copy of its geometry, plus each
+  // variant's lights and materials.
+  class scene_variant {
+  private:
+    std::shared_ptr<const scene_snapshot> base_;
+    scene shading_;
+
+  public:
+
+    explicit scene_variant(std::shared_ptr<const scene_snapshot> base)
+    : base_(std::move(base)), shading_(detail::without_geometry(base_->scene(), true)) { }
+
+    const scene_snapshot& base() const noexcept { return *base_; }
+
+    // The base's camera, viewport, projection, and background, with this
+    // variant's shader, point lights, and materials, but no primitives.
+    // Render it with base().tree(), whose hits index these materials.
+    const scene& shading() const noexcept { return shading_; }
+
+    void set_shader(const shader& x) noexcept { shading_.set_shader(x); }
+
+    scene::point_light_container& point_lights() noexcept { return shading_.point_lights(); }
+
+    void set_material(size_t index, const material& x) { shading_.set_material(index, x); }
+  };
+
+  // Renders v's shading of its base's primitives.
+  framebuffer render(const scene_variant& v) {
+    return render(v.shading(), v.base().tree());
+  }
+
+  // Hands the current scene_snapshot from an updating thread to any number
+  // of reading threads. Readers acquire the current snapshot without
+  // waiting on the updater or each other, and keep rendering it after a
+  // newer one is published; each snapshot is destroyed once the last
+  // reader holding it lets go.
+  class scene_publisher {
+  private:
+    std::shared_ptr<const scene_snapshot> current_;
+    std::uint64_t next_version_;
+    std::mutex publishing_;
+
+  public:
+
+    explicit scene_publisher(scene&& initial)
+    : current_(std::make_shared<const scene_snapshot>(std::move(initial), 0)),
+      next_version_(1) { }
+
+    std::shared_ptr<const scene_snapshot> acquire() const noexcept {
+      return std::atomic_load_explicit(&current_, std::memory_order_acquire);
+    }
+
+    // Builds a snapshot of next, including its bvh, and then makes it
+    // current. The build happens before publishing, so readers never see
+    // a partial snapshot. Concurrent publishers are serialized, and
+    // versions increase in publishing order.
+    std::shared_ptr<const scene_snapshot> publish(scene&& next) {
+      std::lock_guard<std::mutex> lock(publishing_);
+      auto snapshot = std::make_shared<const scene_snapshot>(std::move(next), next_version_++);
+      std::atomic_store_explicit(&current_, snapshot, std::memory_order_release);
+      return snapshot;
+    }
+  };
+
+  namespace detail {
+
+    // Layout of chunked scene files, in host byte order:
+    //
+    //   header:    "RAYSONCK", u32 version, u32 chunk count, u64 material
+    //              count, u32 node count, u32 zero
+    //   tree:      per node of the median-cut tree, depth first, f64 bounds
+    //              min xyz and max xyz, u32 index of the second child (the
+    //              first is the next node) or 0 for a leaf, u32 chunk index
+    //              of a leaf
+    //   directory: per chunk, f64 bounds min xyz and max xyz, u64 byte offset,
+    //              u32 sphere count, u32 triangle count
+    //   chunks:    per sphere, u32 scene index, u32 material index, f64 center
+    //              xyz, f64 radius; then per triangle, u32 scene index,
+    //              u32 material index, f64 a, b, and c xyz
+    constexpr char chunked_magic[8] = {'R', 'A', 'Y', 'S', 'O', 'N', 'C', 'K'};
+    constexpr std::uint32_t chunked_version = 2;
+    constexpr size_t chunked_header_size = 32, chunked_node_size = 56, chunked_entry_size = 64,
+                     chunked_sphere_size = 40, chunked_triangle_size = 80;
+  }
+
+  // Writes the spheres and triangles of s to path as a chunked scene
+  // file, for chunked_geometry. Primitives are split by recursive median
+  // cuts along the longest axis of their centroids until each chunk holds
+  // at most chunk_size of them, and chunks are written in the order of that
+  // tree, so that neighboring chunks are near each other in the file. The
+  // tree itself is written too, for chunked_geometry to traverse.
+  // Throws write_exception, including for scenes with instances.
+  void write_chunked(const scene& s, const std::string& path, size_t chunk_size = 4096) {
+    assert(chunk_size > 0);
+    if (!s.instances().empty()) {
+      throw write_exception("chunked scenes cannot hold instances");
+    }
+
+    // primitives as (kind, index), partitioned in place
+    struct item {
+      primitive_kind kind;
+      std::uint32_t index;
+      aabb bounds;
+    };
+    std::vector<item> items;
+    for (size_t i = 0; i < s.spheres().size(); ++i) {
+      items.push_back(item{primitive_kind::sphere, static_cast<std::uint32_t>(i), bounds(s.spheres()[i])});
+    }
+    for (size_t i = 0; i < s.triangles().size(); ++i) {
+      items.push_back(item{primitive_kind::triangle, static_cast<std::uint32_t>(i), bounds(s.triangles()[i])});
+    }
+    std::vector<std::pair<size_t, size_t>> chunks;
+    // the tree's nodes, depth first, as (bounds, second child or 0, chunk)
+    struct tree_node {
+      aabb bounds;
+      std::uint32_t second, chunk;
+    };
+    std::vector<tree_node> nodes;
+    std::function<void(size_t, size_t)> split = [&](size_t first, size_t last) {
+      auto n = nodes.size();
+      nodes.push_back(tree_node{aabb(), 0, 0});
+      if (last - first <= chunk_size) {
+        for (auto i = first; i < last; ++i) {
+          nodes[n].bounds = nodes[n].bounds.merged(items[i].bounds);
+        }
+        nodes[n].chunk = static_cast<std::uint32_t>(chunks.size());
+        chunks.emplace_back(first, last);
+        return;
+      }
+      aabb centroids;
+      for (auto i = first; i < last; ++i) {
+        centroids = centroids.merged(items[i].bounds.centroid());
+      }
+      auto extent = centroids.max() - centroids.min();
+      unsigned axis = (extent.x() >= extent.y()) ? ((extent.x() >= extent.z()) ? 0 : 2)
+                                                 : ((extent.y() >= extent.z()) ? 1 : 2);
+      auto middle = first + (last - first) / 2;
+      std::nth_element(items.begin() + first, items.begin() + middle, items.begin() + last,
+                       [&](const item& a, const item& b) {
+                         return a.bounds.centroid()[axis] < b.bounds.centroid()[axis];
+                       });
+      split(first, middle);
+      nodes[n].second = static_cast<std::uint32_t>(nodes.size());
+      split(middle, last);
+      nodes[n].bounds = nodes[n + 1].bounds.merged(nodes[nodes[n].second].bounds);
+    };
+    if (!items.empty()) {
+      split(0, items.size());
+    }
+
+    std::ofstream f(path, std::ios::binary);
+    if (!f) {
+      throw write_exception("could not open \"" + path + "\"");
+    }
+    auto put = [&](auto x) { f.write(reinterpret_cast<const char*>(&x), sizeof(x)); };
+    auto put_vector3 = [&](const vector3& v) { put(v.x()); put(v.y()); put(v.z()); };
+    auto material_index = [&](const material& m) {
+      return static_cast<std::uint32_t>(&m - s.materials().data());
+    };
+
+    f.write(detail::chunked_magic, sizeof(detail::chunked_magic));
+    put(detail::chunked_version);
+    put(static_cast<std::uint32_t>(chunks.size()));
+    put(static_cast<std::uint64_t>(s.materials().size()));
+    put(static_cast<std::uint32_t>(nodes.size()));
+    put(std::uint32_t(0));
+    for (auto& n : nodes) {
+      put_vector3(n.bounds.min());
+      put_vector3(n.bounds.max());
+      put(n.second);
+      put(n.chunk);
+    }
+    std::uint64_t offset = detail::chunked_header_size + nodes.size() * detail::chunked_node_size +
+                           chunks.size() * detail::chunked_entry_size;
+    for (auto [first, last] : chunks) {
+      aabb box;
+      std::uint32_t spheres = 0, triangles = 0;
+      for (auto i = first; i < last; ++i) {
+        box = box.merged(items[i].bounds);
+        ++((items[i].kind == primitive_kind::sphere) ? spheres : triangles);
+      }
+      put_vector3(box.min());
+      put_vector3(box.max());
+      put(offset);
+      put(spheres);
+      put(triangles);
+      offset += spheres * detail::chunked_sphere_size + triangles * detail::chunked_triangle_size;
+    }
+    for (auto [first, last] : chunks) {
+      for (auto kind : { primitive_kind::sphere, primitive_kind::triangle }) {
+        for (auto i = first; i < last; ++i) {
+          if (items[i].kind != kind) {
+            continue;
+          }
+          put(items[i].index);
+          if (kind == primitive_kind::sphere) {
+            auto& sph = s.spheres()[items[i].index];
+            put(material_index(sph.material()));
+            put_vector3(sph.center());
+            put(sph.radius());
+          } else {
+            auto& tri = s.triangles()[items[i].index];
+            put(material_index(tri.material()));
+            put_vector3(tri.a());
+            put_vector3(tri.b());
+            put_vector3(tri.c());
+          }
+        }
+      }
+    }
+    if (!f) {
+      throw write_exception("could not write \"" + path + "\"");
+    }
+  }
+
+  // The geometry of a chunked scene file, traced out of core. The file is
+  // memory-mapped, so the operating system pages in only the chunks that
+  // rays reach; a chunk is decoded, and gets its own bvh, when it is first
+  // needed, and the most recently used chunks stay cached. Other chunks
+  // are dropped, so resident geometry is bounded by the cache capacity.
+  //
+  // Rays find the chunks they reach by traversing the file's median-cut
+  // tree. Single rays visit chunks in order of entry along the ray. Batches
+  // of rays visit each chunk once, in file order, tracing all rays that
+  // reach it, so that I/O is sequential. Hits index the original scene's
+  // spheres and triangles. Safe to share between threads.
+  class chunked_geometry {
+  private:
+    struct chunk_entry {
+      aabb bounds;
+      std::uint64_t offset;
+      std::uint32_t spheres, triangles;
+    };
+
+    // a node of the file's tree; second is 0 for a leaf
+    struct tree_node {
+      aabb bounds;
+      std::uint32_t second, chunk;
+    };
+
+    // a decoded chunk
+    struct chunk {
+      object primitives;
+      // scene indices of primitives' spheres and triangles
+      std::vector<std::uint32_t> sphere_indices, triangle_indices;
+      bvh tree;
+
+      chunk() : primitives("chunk") { }
+    };
+
+    const scene* shading_;
+    mapped_file file_;
+    std::vector<tree_node> nodes_;
+    std::vector<chunk_entry> chunks_;
+    size_t capacity_;
+
+    std::mutex mutex_;
+    std::list<std::pair<size_t, std::shared_ptr<const chunk>>> recent_;
+    std::unordered_map<size_t, decltype(recent_)::iterator> cached_;
+    size_t loads_;
+
+    std::shared_ptr<const chunk> decode(size_t i) const {
+      auto& entry = chunks_[i];
+      auto p = file_.data() + entry.offset;
+      auto get_u32 = [&]() {
+        std::uint32_t x;
+        std::memcpy(&x, p, sizeof(x));
+        p += sizeof(x);
+        return x;
+      };
+      auto get_double = [&]() {
+        double x;
+        std::memcpy(&x, p, sizeof(x));
+        p += sizeof(x);
+        return x;
+      };
+      auto get_vector3 = [&]() {
+        double x = get_double(), y = get_double();
+        return vector3(x, y, get_double());
+      };
+      auto get_material = [&]() {
+        auto index = get_u32();
+        if (index >= shading_->materials().size()) {
+          throw read_exception("chunked scene references an undefined material");
+        }
+        return &shading_->materials()[index];
+      };
+
+      auto result = std::make_shared<chunk>();
+      for (std::uint32_t k = 0; k < entry.spheres; ++k) {
+        result->sphere_indices.push_back(get_u32());
+        auto material = get_material();
+        auto center = get_vector3();
+        double radius = get_double();
+        if (!(radius > 0.0)) {
+          throw read_exception("chunked scene has a sphere without a positive radius");
+        }
+        result->primitives.emplace_sphere(sphere(material, center, radius));
+      }
+      for (std::uint32_t k = 0; k < entry.triangles; ++k) {
+        result->triangle_indices.push_back(get_u32());
+        auto material = get_material();
+        auto a = get_vector3(), b = get_vector3(), c = get_vector3();
+        if ((a == b) || (a == c) || (b == c)) {
+          throw read_exception("chunked scene has a degenerate triangle");
+        }
+        result->primitives.emplace_triangle(triangle(material, a, b, c));
+      }
+      result->tree = bvh(result->primitives, *shading_);
+      return result;
+    }
+
+    // the hit h in chunk c, indexed into the original scene
+    static hit global(const chunk& c, const hit& h) noexcept {
+      auto& indices = (h.kind() == primitive_kind::sphere) ? c.sphere_indices : c.triangle_indices;
+      return hit(h.t(), h.kind(), indices[h.index()], h.material_index(), h.normal());
+    }
+
+    static vector3 inverse(const ray& r) noexcept {
+      return vector3(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    }
+
+    // The decoded chunk i, from the cache or the file. Throws
+    // read_exception for a malformed chunk.
+    std::shared_ptr<const chunk> load(size_t i) {
+      assert(i < chunks_.size());
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = cached_.find(i);
+        if (found != cached_.end()) {
+          recent_.splice(recent_.begin(), recent_, found->second);
+          return found->second->second;
+        }
+      }
+      // decode outside the lock; a racing thread may decode it too
+      auto decoded = decode(i);
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto found = cached_.find(i);
+      if (found != cached_.end()) {
+        recent_.splice(recent_.begin(), recent_, found->second);
+        return found->second->second;
+      }
+      ++loads_;
+      recent_.emplace_front(i, decoded);
+      cached_[i] = recent_.begin();
+      if (recent_.size() > capacity_) {
+        cached_.erase(recent_.back().first);
+        recent_.pop_back();
+      }
+      return decoded;
+    }
+
+    // Calls f(t, i) for each chunk i that r, with inverse direction inv,
+    // enters at t within (t_min, t_max), in no particular order.
+    template <typename F>
+    void visit(const ray& r, const vector3& inv, double t_min, double t_max, F&& f) const {
+      if (nodes_.empty()) {
+        return;
+      }
+      std::uint32_t stack[64];
+      unsigned depth = 0;
+      stack[depth++] = 0;
+      while (depth > 0) {
+        auto& n = nodes_[stack[--depth]];
+        double t = n.bounds.entry(r, inv, t_min, t_max);
+        if (t == std::numeric_limits<double>::infinity()) {
+          continue;
+        }
+        if (n.second == 0) {
+          f(t, static_cast<size_t>(n.chunk));
+        } else {
+          stack[depth++] = n.second;
+          stack[depth++] = static_cast<std::uint32_t>(&n - nodes_.data()) + 1;
+        }
+      }
+    }
+
+    // Chunks that r enters within (t_min, t_max), nearest first.
+    std::vector<std::pair<double, size_t>> entered(const ray& r, double t_min, double t_max) const {
+      std::vector<std::pair<double, size_t>> result;
+      visit(r, inverse(r), t_min, t_max, [&](double t, size_t i) { result.emplace_back(t, i); });
+      std::sort(result.begin(), result.end());
+      return result;
+    }
+
+    // For each chunk, the rays that enter it within (t_min, t_max), in
+    // order.
+    std::vector<std::vector<size_t>> reaching(const std::vector<ray>& rays,
+                                              const std::vector<vector3>& inverses,
+                                              double t_min, double t_max) const {
+      std::vector<std::vector<std::uint32_t>> per_ray(rays.size());
+      detail::parallel_for(rays.size(), 256, [&](size_t begin, size_t end) {
+        for (auto k = begin; k < end; ++k) {
+          visit(rays[k], inverses[k], t_min, t_max, [&](double, size_t i) {
+            per_ray[k].push_back(static_cast<std::uint32_t>(i));
+          });
+        }
+      });
+      std::vector<std::vector<size_t>> result(chunks_.size());
+      for (size_t k = 0; k < rays.size(); ++k) {
+        for (auto i : per_ray[k]) {
+          result[i].push_back(k);
+        }
+      }
+      return result;
+    }
+
+  public:
+
+    // Opens the chunked scene file at path. shading provides the materials
+    // that the file indexes, and must outlive this. Up to capacity decoded
+    // chunks are cached. Throws read_exception.
+    chunked_geometry(const std::string& path, const scene& shading, size_t capacity = 64)
+    : shading_(&shading), file_(path), capacity_(capacity), loads_(0) {
+      assert(capacity > 0);
+      auto fail = [&](const std::string& message) {
+        return read_exception(message + " in \"" + path + "\"");
+      };
+      auto data = file_.data();
+      auto size = file_.size();
+      if ((size < detail::chunked_header_size) ||
+          (std::memcmp(data, detail::chunked_magic, sizeof(detail::chunked_magic)) != 0)) {
+        throw fail("not a chunked scene");
+      }
+      std::uint32_t version, count, node_count;
+      std::uint64_t materials;
+      std::memcpy(&version, data + 8, sizeof(version));
+      if (version != detail::chunked_version) {
+        throw fail("unsupported chunked scene version");
+      }
+      std::memcpy(&count, data + 12, sizeof(count));
+      std::memcpy(&materials, data + 16, sizeof(materials));
+      std::memcpy(&node_count, data + 24, sizeof(node_count));
+      if (materials != shading.materials().size()) {
+        throw fail("chunked scene was written with " + std::to_string(materials) + " materials, but " +
+                   std::to_string(shading.materials().size()) + " were given");
+      }
+      auto nodes_size = std::uint64_t(node_count) * detail::chunked_node_size;
+      if ((size - detail::chunked_header_size < nodes_size) ||
+          ((size - detail::chunked_header_size - nodes_size) / detail::chunked_entry_size < count)) {
+        throw fail("truncated chunk directory");
+      }
+      // a tree over count leaves has 2 count - 1 nodes; second children
+      // point forward, so traversal cannot cycle, and depth is bounded for
+      // visit()'s stack
+      if (node_count != ((count == 0) ? 0 : 2 * std::uint64_t(count) - 1)) {
+        throw fail("malformed chunk tree");
+      }
+      std::vector<unsigned> depths(node_count, 0);
+      for (std::uint32_t i = 0; i < node_count; ++i) {
+        double v[6];
+        tree_node n;
+        auto p = data + detail::chunked_header_size + i * detail::chunked_node_size;
+        std::memcpy(v, p, sizeof(v));
+        std::memcpy(&n.second, p + 48, sizeof(n.second));
+        std::memcpy(&n.chunk, p + 52, sizeof(n.chunk));
+        n.bounds = aabb(vector3(v[0], v[1], v[2]), vector3(v[3], v[4], v[5]));
+        if (n.second == 0) {
+          if (n.chunk >= count) {
+            throw fail("malformed chunk tree");
+          }
+        } else if ((n.second <= i + 1) || (n.second >= node_count) || (depths[i] + 1 >= 32)) {
+          throw fail("malformed chunk tree");
+        } else {
+          depths[i + 1] = std::max(depths[i + 1], depths[i] + 1);
+          depths[n.second] = std::max(depths[n.second], depths[i] + 1);
+        }
+        nodes_.push_back(n);
+      }
+      for (std::uint32_t i = 0; i < count; ++i) {
+        double v[6];
+        chunk_entry entry;
+        auto p = data + detail::chunked_header_size + nodes_size + i * detail::chunked_entry_size;
+        std::memcpy(v, p, sizeof(v));
+        std::memcpy(&entry.offset, p + 48, sizeof(entry.offset));
+        std::memcpy(&entry.spheres, p + 56, sizeof(entry.spheres));
+        std::memcpy(&entry.triangles, p + 60, sizeof(entry.triangles));
+        entry.bounds = aabb(vector3(v[0], v[1], v[2]), vector3(v[3], v[4], v[5]));
+        std::uint64_t bytes = entry.spheres * std::uint64_t(detail::chunked_sphere_size) +
+                              entry.triangles * std::uint64_t(detail::chunked_triangle_size);
+        if ((entry.offset > size) || (bytes > size - entry.offset)) {
+          throw fail("chunk is out of bounds");
+        }
+        chunks_.push_back(entry);
+      }
+    }
+
+    chunked_geometry(const chunked_geometry&) = delete;
+    chunked_geometry& operator=(const chunked_geometry&) = delete;
+
+    size_t chunk_count() const noexcept { return chunks_.size(); }
+    const aabb& chunk_bounds(size_t i) const noexcept { return chunks_[i].bounds; }
+    size_t capacity() const noexcept { return capacity_; }
+
+    // chunks decoded from the file so far, including reloads of evicted ones
+    size_t loads() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return loads_;
+    }
+
+    size_t resident() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return recent_.size();
+    }
+
+    std::optional<hit> intersect(const ray& r,
+                                 double t_min = 0.0,
+                                 double t_max = std::numeric_limits<double>::infinity()) {
+      std::optional<hit> result;
+      double closest = t_max;
+      for (auto [t, i] : entered(r, t_min, t_max)) {
+        if (t >= closest) {
+          break;
+        }
+        auto c = load(i);
+        if (auto h = c->tree.intersect(r, t_min, closest)) {
+          closest = h->t();
+          result = global(*c, *h);
+        }
+      }
+      return result;
+    }
+
+    bool occluded(const ray& r,
+                  double t_min = 0.0,
+                  double t_max = std::numeric_limits<double>::infinity()) {
+      for (auto [t, i] : entered(r, t_min, t_max)) {
+        if (load(i)->tree.occluded(r, t_min, t_max)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // intersect for a batch of rays, visiting each chunk once in file
+    // order. Rays are traced in parallel within each chunk.
+    std::vector<std::optional<hit>> intersect(const std::vector<ray>& rays,
+                                              double t_min = 0.0,
+                                              double t_max = std::numeric_limits<double>::infinity()) {
+      std::vector<std::optional<hit>> result(rays.size());
+      std::vector<double> closest(rays.size(), t_max);
+      std::vector<vector3> inverses(rays.size());
+      for (size_t k = 0; k < rays.size(); ++k) {
+        inverses[k] = inverse(rays[k]);
+      }
+      auto candidates = reaching(rays, inverses, t_min, t_max);
+      for (size_t i = 0; i < chunks_.size(); ++i) {
+        // rays may have hit something nearer in an earlier chunk
+        std::vector<size_t> still;
+        for (auto k : candidates[i]) {
+          if (chunks_[i].bounds.entry(rays[k], inverses[k], t_min, closest[k]) != std::numeric_limits<double>::infinity()) {
+            still.push_back(k);
+          }
+        }
+        if (still.empty()) {
+          continue;
+        }
+        auto c = load(i);
+        detail::parallel_for(still.size(), 256, [&](size_t begin, size_t end) {
+          for (auto j = begin; j < end; ++j) {
+            auto k = still[j];
+            if (auto h = c->tree.intersect(rays[k], t_min, closest[k])) {
+              closest[k] = h->t();
+              result[k] = global(*c, *h);
+            }
+          }
+        });
+      }
+      return result;
+    }
+
+    // occluded for a batch of rays, visiting each chunk once in file order.
+    std::vector<bool> occluded(const std::vector<ray>& rays,
+                               double t_min = 0.0,
+                               double t_max = std::numeric_limits<double>::infinity()) {
+      std::vector<char> blocked(rays.size(), 0);
+      std::vector<vector3> inverses(rays.size());
+      for (size_t k = 0; k < rays.size(); ++k) {
+        inverses[k] = inverse(rays[k]);
+      }
+      auto candidates = reaching(rays, inverses, t_min, t_max);
+      for (size_t i = 0; i < chunks_.size(); ++i) {
+        std::vector<size_t> still;
+        for (auto k : candidates[i]) {
+          if (!blocked[k]) {
+            still.push_back(k);
+          }
+        }
+        if (still.empty()) {
+          continue;
+        }
+        auto c = load(i);
+        detail::parallel_for(still.size(), 256, [&](size_t begin, size_t end) {
+          for (auto j = begin; j < end; ++j) {
+            blocked[still[j]] = c->tree.occluded(rays[still[j]], t_min, t_max);
+          }
+        });
+      }
+      return std::vector<bool>(blocked.begin(), blocked.end());
+    }
+  };
+
+  // Renders shading, a scene whose camera, lights, and materials go with
+  // geometry, in bands of rows. Each band's primary rays, and then its
+  // shadow rays, are traced as one batch, so each chunk is read at most
+  // twice per band.
+  framebuffer render(const scene& shading, chunked_geometry& geometry, unsigned band_height = 64) {
+    assert(band_height > 0);
+    framebuffer result(shading.viewport());
+    ray_generator eye(shading);
+    auto& lights = shading.point_lights();
+    bool phong = std::holds_alternative<phong_shader>(shading.shader());
+    size_t width = result.width();
+    for (unsigned top = 0; top < result.height(); top += band_height) {
+      unsigned bottom = std::min(result.height(), top + band_height);
+      std::vector<ray> rays;
+      for (unsigned y = top; y < bottom; ++y) {
+        for (unsigned x = 0; x < width; ++x) {
+          rays.push_back(eye.pixel(x, y));
+        }
+      }
+      auto hits = geometry.intersect(rays);
+
+      std::vector<surface_point> points(rays.size());
+      std::vector<ray> shadow_rays;
+      // index of each hit pixel's first shadow ray
+      std::vector<size_t> first_shadow(rays.size());
+      for (size_t k = 0; k < rays.size(); ++k) {
+        first_shadow[k] = shadow_rays.size();
+        if (hits[k] && phong) {
+          points[k] = surface_point(rays[k], *hits[k]);
+          for (auto& light : lights) {
+            shadow_rays.push_back(detail::shadow_ray(points[k].position(), light));
+          }
+        } else if (hits[k]) {
+          points[k] = surface_point(rays[k], *hits[k]);
+        }
+      }
+      auto occluded = geometry.occluded(shadow_rays, detail::shadow_epsilon, 1.0);
+
+      detail::parallel_for(rays.size(), 256, [&](size_t begin, size_t end) {
+        for (auto k = begin; k < end; ++k) {
+          auto x = static_cast<unsigned>(k % width), y = static_cast<unsigned>(top + k / width);
+          result.set(x, y, hits[k] ? shade(shading, points[k], [&](size_t light) {
+                                       return !occluded[first_shadow[k] + light];
+                                     })
+                                   : shading.background());
+        }
+      });
+    }
+    return result;
+  }
+
+#ifdef __linux__
+
+  // Watches a scene file with inotify, rereading it whenever it is
+  // written or replaced. The file's directory is watched, so editors that
+  // save by renaming a new file over the old one are also noticed.
+  class scene_watcher {
+  private:
+    std::string path_, name_;
+    int fd_;
+    scene current_;
+
+  public:
+
+    // Reads the scene at path and starts watching it. Throws
+    // read_exception.
+    explicit scene_watcher(const std::string& path)
+    : path_(path), fd_(-1), current_(read_file(path)) {
+      auto slash = path.rfind('/');
+      auto directory = (slash == std::string::npos) ? std::string(".") : path.substr(0, slash + 1);
+      name_ = (slash == std::string::npos) ? path : path.substr(slash + 1);
+      fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if ((fd_ < 0) ||
+          (inotify_add_watch(fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)) {
+        if (fd_ >= 0) {
+          close(fd_);
+        }
+        throw read_exception("could not watch \"" + path + "\"");
+      }
+    }
+
+    scene_watcher(const scene_watcher&) = delete;
+    scene_watcher& operator=(const scene_watcher&) = delete;
+
+    ~scene_watcher() {
+      close(fd_);
+    }
+
+    const std::string& path() const noexcept { return path_; }
+
+    // the most recently read version of the scene
+    const scene& current() const noexcept { return current_; }
+
+    // Waits up to timeout for the file to change. If it did, rereads it,
+    // makes it current, and returns its differences from the previous
+    // version. Throws read_exception when the new version cannot be read,
+    // leaving the previous version current.
+    std::optional<scene_diff> poll(std::chrono::milliseconds timeout) {
+      pollfd p{fd_, POLLIN, 0};
+      if (::poll(&p, 1, static_cast<int>(timeout.count())) <= 0) {
+        return std::nullopt;
+      }
+
+      bool changed = false;
+      alignas(inotify_event) char buffer[4096];
+      for (;;) {
+        auto count = read(fd_, buffer, sizeof(buffer));
+        if (count <= 0) {
+          break;
+        }
+        for (char* p = buffer; p < buffer + count; ) {
+          auto event = reinterpret_cast<const inotify_event*>(p);
+          if ((event->len > 0) && (name_ == event->name)) {
+            changed = true;
+          }
+          p += sizeof(inotify_event) + event->len;
+        }
+      }
+      if (!changed) {
+        return std::nullopt;
+      }
+
+      auto next = read_file(path_);
+      scene_diff diff(current_, next);
+      current_ = std::move(next);
+      return diff;
+    }
+  };
+
+#endif
 }
@@ -0,0 +1,33 @@
+// Generated by rayson-embed. Do not edit.
+
+#pragma once
+
+#include "rayson.hpp"
+
+namespace scene_2spheres_ortho_flat {
+
+  inline constexpr std::array<rayson::embedded_material, 2> materials = {
+    rayson::embedded_material("red", 4, rayson::color(1, 0, 0)),
+    rayson::embedded_material("blue", 4, rayson::color(0, 0, 1))
+  };
+
+  inline constexpr std::array<rayson::point_light, 2> point_lights = {
+    rayson::point_light(rayson::vector3(-2, 2, -1), rayson::color(1, 1, 1), 1.1),
+    rayson::point_light(rayson::vector3(1, 0, -1), rayson::color(1, 1, 1), 0.25)
+  };
+
+  inline constexpr std::array<rayson::embedded_sphere, 2> spheres = {
+    rayson::embedded_sphere(0, rayson::vector3(-1, 0, 2), 0.5),
+    rayson::embedded_sphere(1, rayson::vector3(1, 0, 8), 0.5)
+  };
+
+  inline constexpr std::array<rayson::embedded_triangle, 0> triangles = {};
+
+  inline constexpr rayson::embedded_scene scene(
+    rayson::camera(rayson::vector3(0, 0, 0), rayson::vector3(0, -1, 0), rayson::vector3(0, 0, 1)),
+    rayson::viewport(400, 400, -1, 1, 1, -1),
+    rayson::ortho_projection(),
+    rayson::flat_shader(),
+    rayson::color(0.7, 0.7, 0.9),
+    materials, point_lights, spheres, triangles);
+}
@@ -0,0 +1,31 @@
+// Generated by rayson-embed. Do not edit.
+
+#pragma once
+
+#include "rayson.hpp"
+
+namespace scene_gtri_persp_phong {
+
+  inline constexpr std::array<rayson::embedded_material, 1> materials = {
+    rayson::embedded_material("green", 4, rayson::color(0.2, 0.9, 0.2))
+  };
+
+  inline constexpr std::array<rayson::point_light, 2> point_lights = {
+    rayson::point_light(rayson::vector3(-2, 2, -1), rayson::color(1, 1, 1), 1.1),
+    rayson::point_light(rayson::vector3(1, 0, -1), rayson::color(1, 1, 1), 0.25)
+  };
+
+  inline constexpr std::array<rayson::embedded_sphere, 0> spheres = {};
+
+  inline constexpr std::array<rayson::embedded_triangle, 1> triangles = {
+    rayson::embedded_triangle(0, rayson::vector3(-0.3, 0.3, 2), rayson::vector3(0.3, 0.3, 2), rayson::vector3(0, -0.3, 2))
+  };
+
+  inline constexpr rayson::embedded_scene scene(
+    rayson::camera(rayson::vector3(0, 0, 0), rayson::vector3(0, -1, 0), rayson::vector3(0, 0, 1)),
+    rayson::viewport(400, 400, -1, 1, 1, -1),
+    rayson::persp_projection(1),
+    rayson::phong_shader(0.05, 0.5, 0.25, rayson::color(1, 1, 1)),
+    rayson::color(0.4, 0.4, 0.4),
+    materials, point_lights, spheres, triangles);
+}